@@ -167,6 +167,177 @@ acl_to_text(acl_t ap,
 
 
 
+#if defined(HAVE_ACL_GET_ENTRY) && (defined(HAVE_ACL_GET_PERM) || defined(HAVE_ACL_GET_PERM_NP)) && !defined(__APPLE__)
+#define ACL_ENTRYWISE 1
+
+#if !defined(HAVE_ACL_GET_PERM)
+#define acl_get_perm acl_get_perm_np
+#endif
+
+
+/*
+ * Only POSIX.1e ACLs are compared entry by entry (NFSv4 ACLs carry
+ * entry types & flags too)
+ */
+static int
+acl_is_posix(acl_t ap) {
+#if defined(HAVE_ACL_GET_BRAND_NP)
+  int brand;
+
+  if (acl_get_brand_np(ap, &brand) < 0 || brand != ACL_BRAND_POSIX)
+    return 0;
+#endif
+  return 1;
+}
+
+
+static int
+acl_entry_compare(acl_entry_t ae,
+		  acl_entry_t be) {
+  acl_tag_t at, bt;
+  acl_permset_t ap, bp;
+  static const acl_perm_t permv[] = { ACL_READ, ACL_WRITE, ACL_EXECUTE };
+  int i;
+
+
+  if (acl_get_tag_type(ae, &at) < 0 || acl_get_tag_type(be, &bt) < 0)
+    return -1;
+  if (at != bt)
+    return at < bt ? -1 : 1;
+
+  if (at == ACL_USER || at == ACL_GROUP) {
+    void *aq, *bq;
+    int rc;
+    
+    aq = acl_get_qualifier(ae);
+    bq = acl_get_qualifier(be);
+    if (!aq || !bq)
+      rc = -1;
+    else if (at == ACL_USER)
+      rc = (* (uid_t *) aq == * (uid_t *) bq ? 0 : (* (uid_t *) aq < * (uid_t *) bq ? -1 : 1));
+    else
+      rc = (* (gid_t *) aq == * (gid_t *) bq ? 0 : (* (gid_t *) aq < * (gid_t *) bq ? -1 : 1));
+    if (aq)
+      acl_free(aq);
+    if (bq)
+      acl_free(bq);
+    if (rc)
+      return rc;
+  }
+
+  if (acl_get_permset(ae, &ap) < 0 || acl_get_permset(be, &bp) < 0)
+    return -1;
+  
+  for (i = 0; i < sizeof(permv)/sizeof(permv[0]); i++) {
+    int ai = acl_get_perm(ap, permv[i]);
+    int bi = acl_get_perm(bp, permv[i]);
+
+    if (ai < 0 || bi < 0)
+      return -1;
+    if (ai != bi)
+      return ai < bi ? -1 : 1;
+  }
+  
+  return 0;
+}
+#endif
+
+
+/*
+ * Check if an ACL only contains the owner, group & other entries - ie
+ * it carries nothing that the mode bits don't already
+ */
+int
+acl_is_trivial(acl_t ap) {
+#if defined(HAVE_ACL_IS_TRIVIAL_NP)
+  int trivial = 0;
+
+  if (!ap)
+    return 0;
+  if (acl_is_trivial_np(ap, &trivial) < 0)
+    return 0;
+  return trivial;
+#elif defined(ACL_ENTRYWISE)
+  acl_entry_t ae;
+  acl_tag_t at;
+  int rc, n = 0;
+
+  
+  if (!ap || !acl_is_posix(ap))
+    return 0;
+  
+  for (rc = acl_get_entry(ap, ACL_FIRST_ENTRY, &ae);
+       rc == 1;
+       rc = acl_get_entry(ap, ACL_NEXT_ENTRY, &ae)) {
+    if (acl_get_tag_type(ae, &at) < 0)
+      return 0;
+    if (at != ACL_USER_OBJ && at != ACL_GROUP_OBJ && at != ACL_OTHER)
+      return 0;
+    ++n;
+  }
+  
+  return rc == 0 && n == 3;
+#else
+  return 0;
+#endif
+}
+
+
+
+/*
+ * Hash an ACL so that equal ACLs (see acl_compare) get the same value
+ */
+unsigned long
+acl_hash(acl_t ap) {
+  unsigned long h = 2166136261U;		/* FNV-1a */
+  char *s, *cp;
+
+  
+  if (!ap)
+    return 0;
+  
+#if defined(ACL_ENTRYWISE)
+  if (acl_is_posix(ap)) {
+    static const acl_perm_t permv[] = { ACL_READ, ACL_WRITE, ACL_EXECUTE };
+    acl_entry_t ae;
+    acl_tag_t at;
+    acl_permset_t ps;
+    int rc, i;
+    
+    for (rc = acl_get_entry(ap, ACL_FIRST_ENTRY, &ae);
+	 rc == 1;
+	 rc = acl_get_entry(ap, ACL_NEXT_ENTRY, &ae)) {
+      unsigned long v = 0;
+      
+      if (acl_get_tag_type(ae, &at) == 0)
+	v = (unsigned long) at;
+      if (at == ACL_USER || at == ACL_GROUP) {
+	void *qp = acl_get_qualifier(ae);
+
+	if (qp) {
+	  v = v*1000003U ^ (at == ACL_USER ? (unsigned long) * (uid_t *) qp : (unsigned long) * (gid_t *) qp);
+	  acl_free(qp);
+	}
+      }
+      if (acl_get_permset(ae, &ps) == 0) {
+	for (i = 0; i < sizeof(permv)/sizeof(permv[0]); i++)
+	  v = (v << 1) | (acl_get_perm(ps, permv[i]) == 1);
+      }
+      h = (h ^ v) * 16777619U;
+    }
+    return h;
+  }
+#endif
+
+  s = acl_to_text(ap, NULL);
+  if (!s)
+    return h;
+  for (cp = s; *cp; cp++)
+    h = (h ^ (unsigned char) *cp) * 16777619U;
+  acl_free(s);
+  return h;
+}
+
 int
 acl_compare(acl_t a,
 	    acl_t b) {
@@ -182,11 +353,40 @@ acl_compare(acl_t a,
 
   if (a && !b)
     return -1;
+
+  if (a == b)
+    return 0;
   
-  /* Hack, do a better/faster comparision */
+#if defined(ACL_ENTRYWISE)
+  if (acl_is_posix(a) && acl_is_posix(b)) {
+    acl_entry_t ae, be;
+    int arc, brc;
+    
+    /* Entries are kept sorted (tag & qualifier) so they can be compared pairwise */
+    arc = acl_get_entry(a, ACL_FIRST_ENTRY, &ae);
+    brc = acl_get_entry(b, ACL_FIRST_ENTRY, &be);
+    while (arc == 1 && brc == 1) {
+      rc = acl_entry_compare(ae, be);
+      if (rc)
+	return rc;
+      
+      arc = acl_get_entry(a, ACL_NEXT_ENTRY, &ae);
+      brc = acl_get_entry(b, ACL_NEXT_ENTRY, &be);
+    }
+    if (arc < 0 || brc < 0)
+      return -1;
+    
+    return arc - brc;
+  }
+#endif
+
+  /* Other ACL types - compare the text form */
   as = acl_to_text(a, NULL);
   bs = acl_to_text(b, NULL);
 
+  if (!as && !bs)
+    return -1;
+  
   if (!as && bs) {
     acl_free(bs);
     return -1;
@@ -204,4 +404,3 @@ acl_compare(acl_t a,
 
   return rc;
 }
-
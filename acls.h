@@ -44,6 +44,9 @@
 
 #include <sys/types.h>
 #include <sys/acl.h>
+#if defined(HAVE_ACL_LIBACL_H)
+#include <acl/libacl.h>
+#endif
 
 #if defined(HAVE_ACL)
 # undef acl_t
@@ -102,6 +105,12 @@ acl_to_text(acl_t ap,
 #endif
 #endif
 
+extern int
+acl_is_trivial(acl_t ap);
+
+extern unsigned long
+acl_hash(acl_t ap);
+
 extern int
 acl_compare(acl_t a,
 	    acl_t b);
@@ -0,0 +1,177 @@
+/*
+ * arena.c - Bump allocator for short-lived objects
+ * 
+ * Copyright (c) 2021, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "arena.h"
+
+
+/*
+ * Objects are carved out of large blocks and are never freed one by
+ * one - everything goes away at once in arena_destroy(). An arena must
+ * only be used by one thread at a time.
+ */
+
+#define ARENA_ALIGN     16
+#define ARENA_HDRSIZE   ((sizeof(ARENABLOCK) + ARENA_ALIGN-1) & ~((size_t) ARENA_ALIGN-1))
+
+
+ARENA *
+arena_create(size_t bsize) {
+  ARENA *ap;
+
+  
+  ap = malloc(sizeof(*ap));
+  if (!ap)
+    return NULL;
+
+  ap->head = NULL;
+  ap->bsize = bsize ? bsize : 64*1024;
+  return ap;
+}
+
+
+void
+arena_destroy(ARENA *ap) {
+  ARENABLOCK *bp, *next;
+
+  
+  if (!ap)
+    return;
+
+  for (bp = ap->head; bp; bp = next) {
+    next = bp->next;
+    free(bp);
+  }
+  free(ap);
+}
+
+
+void *
+arena_alloc(ARENA *ap,
+	    size_t size) {
+  ARENABLOCK *bp;
+  void *p;
+  
+
+  size = (size + ARENA_ALIGN-1) & ~((size_t) ARENA_ALIGN-1);
+  
+  bp = ap->head;
+  if (!bp || bp->used + size > bp->size) {
+    size_t bsize = ap->bsize;
+
+    if (size > bsize/4) {
+      /* Big object - give it a block of its own, behind the current one */
+      bp = malloc(ARENA_HDRSIZE + size);
+      if (!bp)
+	return NULL;
+      bp->size = bp->used = size;
+      if (ap->head) {
+	bp->next = ap->head->next;
+	ap->head->next = bp;
+      } else {
+	bp->next = NULL;
+	ap->head = bp;
+      }
+      return (char *) bp + ARENA_HDRSIZE;
+    }
+    
+    bp = malloc(ARENA_HDRSIZE + bsize);
+    if (!bp)
+      return NULL;
+    bp->size = bsize;
+    bp->used = 0;
+    bp->next = ap->head;
+    ap->head = bp;
+  }
+
+  p = (char *) bp + ARENA_HDRSIZE + bp->used;
+  bp->used += size;
+  return p;
+}
+
+
+char *
+arena_strdup(ARENA *ap,
+	     const char *s) {
+  size_t len = strlen(s)+1;
+  char *p;
+
+  
+  p = arena_alloc(ap, len);
+  if (p)
+    memcpy(p, s, len);
+  return p;
+}
+
+
+char *
+arena_strdupcat(ARENA *ap,
+		const char *str,
+		...) {
+  va_list va;
+  const char *cp;
+  char *retval, *res;
+  size_t reslen;
+
+
+  reslen = strlen(str)+1;
+  va_start(va, str);
+  while ((cp = va_arg(va, char *)) != NULL)
+    reslen += strlen(cp);
+  va_end(va);
+
+  retval = res = arena_alloc(ap, reslen);
+  if (!retval)
+    return NULL;
+
+  for (cp = str; *cp; )
+    *res++ = *cp++;
+  
+  va_start(va, str);
+  while ((cp = va_arg(va, char *)) != NULL) {
+    while (*cp)
+      *res++ = *cp++;
+  }
+  va_end(va);
+
+  *res = '\0';
+  return retval;
+}
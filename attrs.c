@@ -41,6 +41,10 @@
 #include <fcntl.h>
 #include <errno.h>
 
+#if defined(HAVE_PTHREAD_H)
+#include <pthread.h>
+#endif
+
 #include "btree.h"
 #include "attrs.h"
 
@@ -60,6 +64,94 @@ attr_alloc(size_t size) {
 }
 
 
+
+#if defined(HAVE_GETXATTR)
+/*
+ * Per-thread scratch buffers for attribute listings and values, grown
+ * as needed and reused so the common case is a single syscall with no
+ * size probe and no malloc.
+ */
+typedef struct attrbuf {
+  char *list;
+  size_t lsize;
+  unsigned char *data;
+  size_t dsize;
+} ATTRBUF;
+
+#define ATTRBUF_SIZE_MIN 256
+
+#if defined(HAVE_PTHREAD_H)
+static pthread_key_t attrbuf_key;
+static pthread_once_t attrbuf_once = PTHREAD_ONCE_INIT;
+
+static void
+attrbuf_free(void *vp) {
+  ATTRBUF *abp = (ATTRBUF *) vp;
+
+  free(abp->list);
+  free(abp->data);
+  free(abp);
+}
+
+static void
+attrbuf_init(void) {
+  pthread_key_create(&attrbuf_key, attrbuf_free);
+}
+#endif
+
+static ATTRBUF *
+attrbuf_get(void) {
+#if defined(HAVE_PTHREAD_H)
+  ATTRBUF *abp;
+
+  pthread_once(&attrbuf_once, attrbuf_init);
+  abp = pthread_getspecific(attrbuf_key);
+  if (!abp) {
+    abp = calloc(1, sizeof(*abp));
+    if (!abp)
+      return NULL;
+    if (pthread_setspecific(attrbuf_key, abp) != 0) {
+      free(abp);
+      return NULL;
+    }
+  }
+  return abp;
+#else
+  static ATTRBUF ab;
+
+  return &ab;
+#endif
+}
+
+/*
+ * Make sure *bufp holds at least 'size' bytes
+ */
+static int
+attrbuf_grow(void **bufp,
+	     size_t *sizep,
+	     size_t size) {
+  size_t nsize;
+  void *nbuf;
+
+  
+  if (*bufp && *sizep >= size)
+    return 0;
+
+  nsize = *sizep ? *sizep : ATTRBUF_SIZE_MIN;
+  while (nsize < size)
+    nsize *= 2;
+
+  nbuf = realloc(*bufp, nsize);
+  if (!nbuf)
+    return -1;
+
+  *bufp = nbuf;
+  *sizep = nsize;
+  return 0;
+}
+#endif
+
+
 #if defined(HAVE_GETXATTR)
 /* Linux or MacOS */
 
@@ -104,6 +196,22 @@ attr_delete(const char *path,
     return removexattr(path, name);
 }
 
+ssize_t
+attr_fset(int fd,
+	  int ns,
+	  const char *name,
+	  const void *data,
+	  size_t size) {
+  return fsetxattr(fd, name, data, size, 0);
+}
+
+ssize_t
+attr_fdelete(int fd,
+	     int ns,
+	     const char *name) {
+  return fremovexattr(fd, name);
+}
+
 
 
 int
@@ -116,31 +224,44 @@ attr_foreach(const char *path,
 			    int flags,
 			    void *xp),
 	     void *xp) {
+  ATTRBUF *abp;
   ssize_t bufsize;
   char *buf, *end, *name;
   int rc = 0;
   
   
-  if (flags & ATTR_FLAG_NOFOLLOW)
-    bufsize = llistxattr(path, NULL, 0);
-  else
-    bufsize = listxattr(path, NULL, 0);
-  if (bufsize < 0)
+  abp = attrbuf_get();
+  if (!abp || attrbuf_grow((void **) &abp->list, &abp->lsize, ATTRBUF_SIZE_MIN) < 0)
     return -1;
+
+  /* Try with the buffer we have, only probe for the size if it is too small */
+  while (1) {
+    if (flags & ATTR_FLAG_NOFOLLOW)
+      bufsize = llistxattr(path, abp->list, abp->lsize);
+    else
+      bufsize = listxattr(path, abp->list, abp->lsize);
+    if (bufsize >= 0)
+      break;
+    if (errno != ERANGE)
+      return -1;
+
+    if (flags & ATTR_FLAG_NOFOLLOW)
+      bufsize = llistxattr(path, NULL, 0);
+    else
+      bufsize = listxattr(path, NULL, 0);
+    if (bufsize < 0)
+      return -1;
     
-  buf = (char *) malloc(bufsize);
-  if (!buf)
-    return -1;
-  
-  if (flags & ATTR_FLAG_NOFOLLOW)
-    bufsize = llistxattr(path, buf, bufsize);
-  else
-    bufsize = listxattr(path, buf, bufsize);
-  if (bufsize < 0) {
-    free(buf);
-    return -1;
+    if (attrbuf_grow((void **) &abp->list, &abp->lsize, bufsize+1) < 0)
+      return -1;
   }
-  
+
+  /* No attributes - nothing more to do */
+  if (bufsize == 0)
+    return 0;
+
+  /* Note: The handler must not call attr_foreach() itself */
+  buf = abp->list;
   end = buf+bufsize;
   name = buf;
   while (name < end) {
@@ -154,7 +275,6 @@ attr_foreach(const char *path,
     ++name; /* Skip NUL */
   }
 
-  free(buf);
   return rc;
 }
 
@@ -194,6 +314,22 @@ attr_delete(const char *path,
 		     (flags & ATTR_FLAG_NOFOLLOW) ? XATTR_NOFOLLOW : 0);
 }
 
+ssize_t
+attr_fset(int fd,
+	  int ns,
+	  const char *name,
+	  const void *data,
+	  size_t size) {
+  return fsetxattr(fd, name, (void *) data, size, 0, 0);
+}
+
+ssize_t
+attr_fdelete(int fd,
+	     int ns,
+	     const char *name) {
+  return fremovexattr(fd, name, 0);
+}
+
 
 int
 attr_foreach(const char *path,
@@ -290,6 +426,22 @@ attr_delete(const char *path,
     return extattr_delete_file(path, ns, name);
 }
 
+ssize_t
+attr_fset(int fd,
+	  int ns,
+	  const char *name,
+	  const void *data,
+	  size_t size) {
+  return extattr_set_fd(fd, ns, name, data, size);
+}
+
+ssize_t
+attr_fdelete(int fd,
+	     int ns,
+	     const char *name) {
+  return extattr_delete_fd(fd, ns, name);
+}
+
 
 int
 attr_foreach(const char *path,
@@ -440,6 +592,40 @@ attr_delete(const char *path,
   return rc;
 }
 
+ssize_t
+attr_fset(int fd,
+	  int ns,
+	  const char *name,
+	  const void *data,
+	  size_t size) {
+  int afd;
+  ssize_t len;
+  
+
+  afd = openat(fd, name, O_XATTR|O_WRONLY|O_CREAT|O_TRUNC, 0777);
+  if (afd < 0)
+    return -1;
+  
+  len = write(afd, data, size);
+  close(afd);
+  return len;
+}
+
+ssize_t
+attr_fdelete(int fd,
+	     int ns,
+	     const char *name) {
+  int afd, rc;
+
+  afd = openat(fd, ".", O_XATTR|O_RDONLY);
+  if (afd < 0)
+    return -1;
+
+  rc = unlinkat(afd, name, 0);
+  close(afd);
+  return rc;
+}
+
 
 int
 attr_foreach(const char *path,
@@ -518,6 +704,24 @@ attr_delete(const char *path,
   return -1;
 }
 
+ssize_t
+attr_fset(int fd,
+	  int ns,
+	  const char *name,
+	  const void *data,
+	  size_t size) {
+  errno = ENOSYS;
+  return -1;
+}
+
+ssize_t
+attr_fdelete(int fd,
+	     int ns,
+	     const char *name) {
+  errno = ENOSYS;
+  return -1;
+}
+
 
 int
 attr_foreach(const char *path,
@@ -537,6 +741,67 @@ attr_foreach(const char *path,
 
 
 
+/*
+ * Fetch an attribute value into a freshly allocated ATTR
+ */
+static ATTR *
+attr_fetch(const char *path,
+	   int ns,
+	   const char *name,
+	   int flags) {
+  ATTR *ap;
+  ssize_t asize;
+#if defined(HAVE_GETXATTR)
+  ATTRBUF *abp;
+
+  
+  /* 
+   * getxattr() fails with ERANGE instead of truncating, so read into
+   * the scratch buffer right away and only probe for the size if needed
+   */
+  abp = attrbuf_get();
+  if (!abp || attrbuf_grow((void **) &abp->data, &abp->dsize, ATTRBUF_SIZE_MIN) < 0)
+    return NULL;
+
+  while ((asize = attr_get(path, ns, name, abp->data, abp->dsize, flags)) < 0) {
+    if (errno != ERANGE)
+      return NULL;
+
+    asize = attr_get(path, ns, name, NULL, 0, flags);
+    if (asize < 0)
+      return NULL;
+    
+    if (attrbuf_grow((void **) &abp->data, &abp->dsize, asize+1) < 0)
+      return NULL;
+  }
+
+  ap = attr_alloc(asize);
+  if (!ap)
+    return NULL;
+  memcpy(ap->buf, abp->data, asize);
+#else
+  /* Other systems silently truncate, so get the size first */
+  asize = attr_get(path, ns, name, NULL, 0, flags);
+  if (asize < 0)
+    return NULL;
+
+  ap = attr_alloc(asize);
+  if (!ap)
+    return NULL;
+  
+  asize = attr_get(path, ns, name, ap->buf, asize, flags);
+  if (asize < 0) {
+    free(ap);
+    return NULL;
+  }
+  
+  ap->len = asize;
+#endif
+  
+  return ap;
+}
+
+
 static int
 attr_list_handler(const char *path,
 		  int ns,
@@ -548,23 +813,9 @@ attr_list_handler(const char *path,
 
 
   if (flags & ATTR_FLAG_GETDATA) {
-    size_t asize;
-
-    asize = attr_get(path, ns, name, NULL, 0, flags);
-    if (asize < 0)
-      return asize;
-
-    ap = attr_alloc(asize);
+    ap = attr_fetch(path, ns, name, flags);
     if (!ap)
       return -1;
-    
-    asize = attr_get(path, ns, name, ap->buf, asize, flags);
-    if (asize < 0) {
-      free(ap);
-      return -1;
-    }
-    
-    ap->len = asize;
   }
 
   name = strdup(name);
@@ -583,7 +834,7 @@ attr_list(const char *path,
   int rc;
 
   
-  bp = btree_create(NULL, NULL);
+  bp = btree_create(NULL, free);
   if (!bp)
     return NULL;
 
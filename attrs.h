@@ -87,6 +87,18 @@ attr_delete(const char *path,
 	    const char *name,
 	    int flags);
 
+extern ssize_t
+attr_fset(int fd,
+	  int ns,
+	  const char *name,
+	  const void *data,
+	  size_t size);
+
+extern ssize_t
+attr_fdelete(int fd,
+	     int ns,
+	     const char *name);
+
 extern int
 attr_foreach(const char *path,
 	     int ns,
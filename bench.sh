@@ -0,0 +1,137 @@
+#!/bin/sh
+#
+# bench.sh - Performance benchmarks for pc (run via "make bench")
+#
+# Generates reproducible trees with mktree and times pc on them:
+# an initial copy, a no-op resync and a resync after changing 1% of
+# the files, with cold and warm caches. The numbers come from the
+# pc --stats=json output. MB/s is based on the file sizes, so sparse
+# files show their apparent size, and calls/obj only counts the metadata
+# calls pc keeps statistics for (not every read and write).
+#
+# Environment:
+#   BENCH_DIR    Where the trees are created [/tmp/pc-bench]
+#   BENCH_SCALE  Divide all tree sizes by this (e.g. 100 for a quick run) [1]
+#   BENCH_TREES  Trees to test [tiny deep wide sparse xattr links]
+#   BENCH_OPTS   Options for pc [-M]
+#   BENCH_KEEP   Keep the trees afterwards if set
+#
+
+PC="${PC:-./pc}"
+MKTREE="${MKTREE:-./mktree}"
+DIR="${BENCH_DIR:-/tmp/pc-bench}"
+SCALE="${BENCH_SCALE:-1}"
+TREES="${BENCH_TREES:-tiny deep wide sparse xattr links}"
+OPTS="${BENCH_OPTS:--M}"
+
+SEED=4711
+
+
+size() {
+    case "$1" in
+	tiny)   n=1000000 ;;
+	deep)   n=1000 ;;
+	wide)   n=500000 ;;
+	sparse) n=64 ;;
+	xattr)  n=100000 ;;
+	links)  n=100000 ;;
+    esac
+    n=$(expr $n / $SCALE)
+    [ $n -lt 1 ] && n=1
+    echo $n
+}
+
+# Options a tree needs to be meaningful
+options() {
+    case "$1" in
+	sparse) echo "-z" ;;
+	links)  echo "-H" ;;
+    esac
+}
+
+# Drop the page cache, if we are allowed to. Returns 1 if not.
+drop_caches() {
+    sync
+    if [ -w /proc/sys/vm/drop_caches ]; then
+	echo 3 >/proc/sys/vm/drop_caches && return 0
+    fi
+    if [ "$(uname -s)" = Darwin ] && purge 2>/dev/null; then
+	return 0
+    fi
+    return 1
+}
+
+# Extract a number from the (single line) JSON statistics
+get() {
+    sed -n "s/.*\"$1\": \([0-9.e+-]*\).*/\1/p"
+}
+
+run() {
+    tree="$1"
+    case="$2"
+    cache="$3"
+
+    if [ "$cache" = cold ] && ! drop_caches; then
+	if [ "$case" != copy ]; then
+	    printf "%-8s %-6s %-5s (skipped - can't drop the caches)\n" "$tree" "$case" "$cache"
+	    return 0
+	fi
+	cache=warm
+    fi
+
+    if ! json=$($PC $OPTS $(options $tree) --stats=json "$DIR/src/$tree/" "$DIR/dst/$tree" | tail -1); then
+	echo "$0: Error: pc failed on $tree ($case, $cache)" >&2
+	exit 1
+    fi
+
+    elapsed=$(echo "$json" | get elapsed)
+    objs=0
+    for c in new changed unchanged removed; do
+	objs=$(expr $objs + $(echo "$json" | get $c))
+    done
+    files=$(echo "$json" | get files_copied)
+    bytes=$(echo "$json" | get bytes_copied)
+    calls=0
+    for c in stat readlink acl_get xattr_list opendir open; do
+	calls=$(expr $calls + $(echo "$json" | get $c))
+    done
+
+    echo "$tree $case $cache $elapsed $objs $files $bytes $calls" | awk '{
+      t = ($4 > 0 ? $4 : 0.000001);
+      printf "%-8s %-6s %-5s %9.3f s %9d obj %9d copied %10.0f obj/s %9.1f MB/s %7.2f calls/obj\n",
+        $1, $2, $3, $4, $5, $6, $5/t, $7/t/1000000, ($5 > 0 ? $8/$5 : 0);
+    }'
+}
+
+
+if [ ! -x "$PC" ] || [ ! -x "$MKTREE" ]; then
+    echo "$0: Error: Build pc and mktree first (make bench)" >&2
+    exit 1
+fi
+
+echo "[pc benchmarks in $DIR, scale 1/$SCALE, options: $OPTS]"
+
+for tree in $TREES; do
+    n=$(size $tree)
+    rm -fr "$DIR/src/$tree" "$DIR/dst/$tree"
+    mkdir -p "$DIR/src" "$DIR/dst/$tree" || exit 1
+
+    echo "[Generating $tree ($n)]"
+    $MKTREE -s $SEED "$DIR/src/$tree" $tree $n >/dev/null || exit 1
+
+    run $tree copy cold
+    run $tree noop warm
+    run $tree noop cold
+
+    # Modification times are compared in whole seconds
+    sleep 1
+    $MKTREE -s $SEED "$DIR/src/$tree" delta 1 >/dev/null || exit 1
+    run $tree delta warm
+
+    sleep 1
+    $MKTREE -s $(expr $SEED + 1) "$DIR/src/$tree" delta 1 >/dev/null || exit 1
+    run $tree delta cold
+done
+
+[ -z "$BENCH_KEEP" ] && rm -fr "$DIR"
+exit 0
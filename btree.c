@@ -33,206 +33,233 @@
 #include <errno.h>
 #include <time.h>
 
+#include "arena.h"
 #include "btree.h"
 
 
+/*
+ * The tree is kept balanced as an AVL tree, since directory listings
+ * (and attribute lists) often arrive sorted, or nearly so.
+ *
+ * Trees using the default (strcmp) key order also get a hash index
+ * once they grow beyond BTREE_HASH_MIN entries, so btree_search()
+ * doesn't have to walk the tree.
+ */
+#define BTREE_HASH_MIN 64
+
 
 /* Allocate and initialize a btree node */
 static BNODE *
-bnode_create(const char *key,
+bnode_create(BTREE *bt,
+	     const char *key,
 	     void *val) {
   BNODE *n;
 
   
-  n = malloc(sizeof(*n));
+  n = bt->arena ? arena_alloc(bt->arena, sizeof(*n)) : malloc(sizeof(*n));
   if (!n)
     return NULL;
 
-  memset(n, 0, sizeof(*n));
+  n->left   = NULL;
+  n->right  = NULL;
+  n->hnext  = NULL;
+  n->height = 1;
   
   n->key = key;
   n->val = val;
 
-  n->parent = NULL;
-  n->left   = NULL;
-  n->right  = NULL;
-
   return n;
 }
 
 
+/* Release a node and its key & value (the arena owns the node & key, if set) */
+static void
+bnode_free(BTREE *bt,
+	   BNODE *n) {
+  if (bt->vfree)
+    bt->vfree(n->val);
+  if (bt->arena)
+    return;
+  free((void *) n->key);
+  free(n);
+}
+
+
 /* Destroy the btree starting at node 'n' */
 static void
-bnode_destroy(BTREE *bp,
+bnode_destroy(BTREE *bt,
 	      BNODE *n) {
   if (!n)
     return;
 
-  if (n->left) {
-    bnode_destroy(bp, n->left);
-    n->left = NULL;
-  }
+  bnode_destroy(bt, n->left);
+  bnode_destroy(bt, n->right);
+  bnode_free(bt, n);
+}
 
-  if (n->right) {
-    bnode_destroy(bp, n->right);
-    n->right = NULL;
-  }
 
-  if (n->parent) {
-    BNODE *pn = n->parent;
-    
-    if (pn->left == n)
-      pn->left = NULL;
-    if (pn->right == n)
-      pn->right = NULL;
+static inline int
+bnode_height(BNODE *n) {
+  return n ? n->height : 0;
+}
 
-    n->parent = NULL;
-  }
 
-  if (bp->vfree)
-    bp->vfree(n->val);
-  n->val = NULL;
+static inline void
+bnode_fix(BNODE *n) {
+  int hl = bnode_height(n->left);
+  int hr = bnode_height(n->right);
   
-  free((void *) n->key);
-  n->key = NULL;
-  
-  free(n);
+  n->height = (hl > hr ? hl : hr) + 1;
 }
 
 
-/* Search a btree for a specific node */
-static BNODE *
-bnode_search(BTREE *bt,
-	     BNODE *head,
-	     const char *key) {
-  BNODE *cn;
+static inline BNODE *
+bnode_rotate_right(BNODE *n) {
+  BNODE *l = n->left;
+
+  n->left = l->right;
+  l->right = n;
+  bnode_fix(n);
+  bnode_fix(l);
+  return l;
+}
 
-  
-  cn = head;
-  while (cn) {
-    int rc = bt->kcmp(key, cn->key);
 
-    if (rc < 0)
-      cn = cn->left;  /* not found, key < cn->key -> go left */
-    else if (rc > 0)
-      cn = cn->right; /* not found, key > cn->key -> go right */
-    else
-      return cn;      /* found, return the matching key */
-  }
-
-  return NULL;
+static inline BNODE *
+bnode_rotate_left(BNODE *n) {
+  BNODE *r = n->right;
+
+  n->right = r->left;
+  r->left = n;
+  bnode_fix(n);
+  bnode_fix(r);
+  return r;
 }
 
 
+/* Restore the AVL property at node 'n', returns the new subtree root */
+static BNODE *
+bnode_balance(BNODE *n) {
+  int b;
 
-/* Locate the left-most (first) node of a tree */
-static inline BNODE *
-bnode_min(BNODE *n) {
-  if (n) {
-    while (n->left)
-      n = n->left;
+  
+  bnode_fix(n);
+  b = bnode_height(n->left) - bnode_height(n->right);
+  
+  if (b > 1) {
+    if (bnode_height(n->left->left) < bnode_height(n->left->right))
+      n->left = bnode_rotate_left(n->left);
+    return bnode_rotate_right(n);
+  }
+  
+  if (b < -1) {
+    if (bnode_height(n->right->right) < bnode_height(n->right->left))
+      n->right = bnode_rotate_right(n->right);
+    return bnode_rotate_left(n);
   }
 
   return n;
 }
 
-#if 0 /* Not used currently */
 
-/* Locate the right-most (last) node of a tree */
-static inline BNODE *
-bnode_max(BNODE *n) {
-  if (n) {
-    while (n->right)
-      n = n->right;
+/* Insert node 'nn' in the tree at 'n', returns the new subtree root */
+static BNODE *
+bnode_insert(BTREE *bt,
+	     BNODE *n,
+	     BNODE *nn,
+	     int *rcp) {
+  int rc;
+
+  
+  if (!n)
+    return nn;
+
+  rc = bt->kcmp(nn->key, n->key);
+  if (rc < 0)
+    n->left = bnode_insert(bt, n->left, nn, rcp);
+  else if (rc > 0)
+    n->right = bnode_insert(bt, n->right, nn, rcp);
+  else {
+    *rcp = -1;
+    return n;
   }
 
-  return n;
+  return *rcp ? n : bnode_balance(n);
 }
 
-/* Locate the previous node of a tree */
-static inline BNODE *
-bnode_prev(BNODE *n) {
-  BNODE *pn;
 
-  if (n->left)
-    n = bnode_max(n->left);
-  else {
-    pn = n->parent;
-    while (pn && n == pn->left) {
-      n = pn;
-      pn = n->parent;
-    }
-    n = pn;
+/* Unlink the left-most node below 'n', returns the new subtree root */
+static BNODE *
+bnode_unlink_min(BNODE *n,
+		 BNODE **minp) {
+  if (!n->left) {
+    *minp = n;
+    return n->right;
   }
-  
-  return n;
+
+  n->left = bnode_unlink_min(n->left, minp);
+  return bnode_balance(n);
 }
 
 
-/* Locate the next node of a tree */
-static inline BNODE *
-bnode_next(BNODE *n) {
-  BNODE *pn;
+/* Unlink the node matching 'key' below 'n', returns the new subtree root */
+static BNODE *
+bnode_unlink(BTREE *bt,
+	     BNODE *n,
+	     const char *key,
+	     BNODE **dnp) {
+  BNODE *min, *r;
+  int rc;
 
-  if (n->right)
-    n = bnode_min(n->right);
+  
+  if (!n)
+    return NULL;
+  
+  rc = bt->kcmp(key, n->key);
+  if (rc < 0)
+    n->left = bnode_unlink(bt, n->left, key, dnp);
+  else if (rc > 0)
+    n->right = bnode_unlink(bt, n->right, key, dnp);
   else {
-    pn = n->parent;
-    while (pn && n == pn->right) {
-      n = pn;
-      pn = n->parent;
-    }
-    n = pn;
+    *dnp = n;
+    
+    if (!n->left)
+      return n->right;
+    if (!n->right)
+      return n->left;
+
+    /* Replace this node with the left-most node to the right */
+    r = bnode_unlink_min(n->right, &min);
+    min->right = r;
+    min->left = n->left;
+    return bnode_balance(min);
   }
   
-  return n;
+  return *dnp ? bnode_balance(n) : n;
 }
-#endif
 
-static inline BNODE *
-bnode_delete(BTREE *bt,
-	     const char *key,
-	     BNODE *n,
-	     BNODE *pn) {
-  int rc;
+
+/* Search a btree for a specific node */
+static BNODE *
+bnode_search(BTREE *bt,
+	     BNODE *head,
+	     const char *key) {
+  BNODE *cn;
 
   
-  rc = bt->kcmp(key, n->key);
-  if (rc < 0) {
-    /* Not this node, check left subtree */
-    if (n->left)
-      return bnode_delete(bt, key, n->left, n);
-    else
-      return NULL;
-  } else if (rc > 0) {
-    /* Not this node, check right subtree */
-    if (n->right)
-      return bnode_delete(bt, key, n->right, n);
+  cn = head;
+  while (cn) {
+    int rc = bt->kcmp(key, cn->key);
+
+    if (rc < 0)
+      cn = cn->left;  /* not found, key < cn->key -> go left */
+    else if (rc > 0)
+      cn = cn->right; /* not found, key > cn->key -> go right */
     else
-      return NULL;
-  } else {
-    /* Delete this node */
-    
-    if (n->left && n->right) {
-      /* We have both left and right trees below us */
-      BNODE *min = bnode_min(n->right);
-      /* Replace the key & val with the data from the left-most node to the right */
-      n->key = min->key;
-      n->val = min->val;
-
-      /* min->key & min->val will be free'd by our caller */
-      return bnode_delete(bt, key, n->right, n);
-    } else if (pn->left == n) {
-      /* We are parent's left node */
-      pn->left = n->left ? n->left : n->right;
-      return n;
-    } else if (pn->right == n) {
-      /* We are parent's right node */
-      pn->right = n->left ? n->left : n->right;
-      return n;
-    } else
-      return NULL;
+      return cn;      /* found, return the matching key */
   }
+
+  return NULL;
 }
 
 
@@ -263,6 +290,113 @@ bnode_walker(BNODE *n,
 
 
 
+/* --- Hash index -------------------------------------------------------- */
+
+static inline size_t
+bhash_key(const char *key) {
+  size_t h = 2166136261U;		/* FNV-1a */
+
+  while (*key)
+    h = (h ^ (unsigned char) *key++) * 16777619U;
+  return h;
+}
+
+
+static void
+bhash_add(BTREE *bt,
+	  BNODE *n) {
+  size_t h = bhash_key(n->key) & (bt->hsize-1);
+
+  n->hnext = bt->htab[h];
+  bt->htab[h] = n;
+}
+
+
+static void
+bhash_remove(BTREE *bt,
+	     BNODE *n) {
+  BNODE **np;
+
+  for (np = &bt->htab[bhash_key(n->key) & (bt->hsize-1)]; *np; np = &(*np)->hnext) {
+    if (*np == n) {
+      *np = n->hnext;
+      n->hnext = NULL;
+      return;
+    }
+  }
+}
+
+
+static void
+bhash_fill(BTREE *bt,
+	   BNODE *n) {
+  if (!n)
+    return;
+  
+  bhash_fill(bt, n->left);
+  bhash_add(bt, n);
+  bhash_fill(bt, n->right);
+}
+
+
+/* (Re)build the hash index. If it fails we just keep using the tree. */
+static void
+bhash_grow(BTREE *bt) {
+  BNODE **ntab;
+  size_t nsize;
+
+  
+  nsize = bt->hsize ? bt->hsize*2 : 2*BTREE_HASH_MIN;
+  while (nsize < bt->entries)
+    nsize *= 2;
+  
+  ntab = calloc(nsize, sizeof(*ntab));
+  if (!ntab)
+    return;
+
+  free(bt->htab);
+  bt->htab = ntab;
+  bt->hsize = nsize;
+  bhash_fill(bt, bt->head);
+}
+
+
+
+/* --- In-order iterator ------------------------------------------------ */
+
+/* An AVL tree with 2^32 nodes is less than 47 levels deep */
+#define BTREE_DEPTH_MAX 64
+
+typedef struct biter {
+  BNODE *stack[BTREE_DEPTH_MAX];
+  int top;
+} BITER;
+
+
+static inline void
+biter_push(BITER *it,
+	   BNODE *n) {
+  while (n) {
+    it->stack[it->top++] = n;
+    n = n->left;
+  }
+}
+
+
+static inline BNODE *
+biter_next(BITER *it) {
+  BNODE *n;
+  
+  if (it->top == 0)
+    return NULL;
+
+  n = it->stack[--it->top];
+  biter_push(it, n->right);
+  return n;
+}
+
+
+
 /* --- Public functions -------------------------------------------------- */
 
 BTREE *
@@ -278,17 +412,38 @@ btree_create(int (*kcmp)(const char *ka, const char *kb),
   bt->kcmp = kcmp ? kcmp : strcmp;
   bt->vfree = vfree;
   bt->entries = 0;
+  bt->htab = NULL;
+  bt->hsize = 0;
+  bt->arena = NULL;
   
   return bt;
 }
 
 
+/*
+ * Allocate the tree nodes from an arena. The keys inserted must then
+ * also be owned by the arena (or outlive it).
+ */
+int
+btree_arena(BTREE *bt,
+	    ARENA *ap) {
+  if (bt->entries > 0) {
+    errno = EBUSY;
+    return -1;
+  }
+
+  bt->arena = ap;
+  return 0;
+}
+
+
 void
 btree_destroy(BTREE *bt) {
   bnode_destroy(bt, bt->head);
   bt->head = NULL;
   bt->kcmp = NULL;
   bt->vfree = NULL;
+  free(bt->htab);
   free(bt);
 }
 
@@ -297,44 +452,32 @@ int
 btree_insert(BTREE *bt,
 	     const char *key,
 	     void *val) {
-  BNODE *pn, *cn, *nn;
+  BNODE *nn;
+  int rc = 0;
 
 
-  nn = bnode_create(key, val);
+  nn = bnode_create(bt, key, val);
   if (!nn)
     return -1;
 
-  pn = NULL;
-  cn = bt->head;
-
-  while (cn) {
-    int rc = bt->kcmp(key, cn->key);
-    
-    pn = cn;
-    if (rc < 0)
-      cn = cn->left;
-    else if (rc > 0) 
-      cn = cn->right;
-    else {
-      bnode_destroy(bt, nn);
-      errno = EEXIST;
-      return -1;
-    }
-  }
-  
-  nn->parent = pn;
-  
-  if (!pn)
-    bt->head = nn;
-  else {
-    int rc = bt->kcmp(key, pn->key);
-    if (rc < 0)
-      pn->left = nn;
-    else
-      pn->right = nn;
+  bt->head = bnode_insert(bt, bt->head, nn, &rc);
+  if (rc < 0) {
+    /* The key & value are released, as if inserted & deleted */
+    bnode_free(bt, nn);
+    errno = EEXIST;
+    return -1;
   }
 
   bt->entries++;
+  
+  if (bt->htab) {
+    if (bt->entries > bt->hsize)
+      bhash_grow(bt);
+    else
+      bhash_add(bt, nn);
+  } else if (bt->kcmp == strcmp && bt->entries >= BTREE_HASH_MIN)
+    bhash_grow(bt);
+  
   return 0;
 }
 
@@ -344,8 +487,15 @@ btree_search(BTREE *bt,
 	     const char *key,
 	     void **val) {
   BNODE *n;
+
+  
+  if (bt->htab) {
+    for (n = bt->htab[bhash_key(key) & (bt->hsize-1)]; n; n = n->hnext)
+      if (strcmp(key, n->key) == 0)
+	break;
+  } else
+    n = bnode_search(bt, bt->head, key);
   
-  n = bnode_search(bt, bt->head, key);
   if (n) {
     if (val)
       *val = n->val;
@@ -360,41 +510,22 @@ btree_search(BTREE *bt,
 int
 btree_delete(BTREE *bt,
 	     const char *key) {
-  BNODE *n, *rn;
+  BNODE *dn = NULL;
 
 
-  n = bnode_search(bt, bt->head, key);
-  if (!n)
+  bt->head = bnode_unlink(bt, bt->head, key, &dn);
+  if (!dn)
     return 1;
 
-  if (bt->head == n) {
-    BNODE *althead, *rn;
-
-    althead = malloc(sizeof(*althead));
-    if (!althead)
-      return -1;
-    
-    althead->parent = NULL;
-    althead->left = bt->head;
-    althead->right = NULL;
-
-    rn = bnode_delete(bt, key, n, althead);
-    bt->head = althead->left;
-    if (rn) {
-      free(rn);
-      return 0;
-    } else
-      return 1;
-  } else {
-    rn = bnode_delete(bt, key, bt->head, NULL);
-    if (rn) {
-      free(rn);
-      return 0;
-    } else
-      return 1;
-  }
+  if (bt->htab)
+    bhash_remove(bt, dn);
+  
+  bt->entries--;
+  bnode_free(bt, dn);
+  return 0;
 }
 
+
 int
 btree_foreach(BTREE *bt,
 	      int (*fun)(const char *key, void *val, void *extra),
@@ -412,12 +543,75 @@ btree_foreach(BTREE *bt,
 
 
 
+/*
+ * Walk two trees (ordered by the same comparator) in parallel, calling
+ * 'fun' once per key with the values from both trees (or NULL if the
+ * key is missing in one of them).
+ */
+int
+btree_merge(BTREE *a,
+	    BTREE *b,
+	    int (*fun)(const char *key, void *aval, void *bval, void *extra),
+	    void *extra) {
+  int (*kcmp)(const char *ka, const char *kb);
+  BITER ai, bi;
+  BNODE *an, *bn, *n;
+  int rc;
+
+
+  if (!a && !b) {
+    errno = EINVAL;
+    return -1;
+  }
+  
+  kcmp = a ? a->kcmp : b->kcmp;
+  
+  ai.top = bi.top = 0;
+  if (a)
+    biter_push(&ai, a->head);
+  if (b)
+    biter_push(&bi, b->head);
+
+  an = biter_next(&ai);
+  bn = biter_next(&bi);
+  while (an || bn) {
+    if (an && bn)
+      rc = kcmp(an->key, bn->key);
+    else
+      rc = an ? -1 : 1;
+
+    if (rc < 0) {
+      n = an;
+      an = biter_next(&ai);
+      rc = fun(n->key, n->val, NULL, extra);
+    } else if (rc > 0) {
+      n = bn;
+      bn = biter_next(&bi);
+      rc = fun(n->key, NULL, n->val, extra);
+    } else {
+      BNODE *m = bn;
+      
+      n = an;
+      an = biter_next(&ai);
+      bn = biter_next(&bi);
+      rc = fun(n->key, n->val, m->val, extra);
+    }
+    
+    if (rc)
+      return rc;
+  }
+
+  return 0;
+}
+
+
+
 #ifdef BTREE_MAIN
 int
 print_node(const char *key,
 	   void *val,
 	   void *extra) {
-  printf("%-30s  %s\n", key, val);
+  printf("%-30s  %s\n", key, (char *) val);
   return 0;
 }
 
@@ -437,10 +631,9 @@ main(int argc,
   char *ptr, *key, *val;
   BTREE *bt;
   time_t t1, t2;
-  BNODE *n;
   
 
-  bt = btree_create(NULL);
+  bt = btree_create(NULL, NULL);
   if (!bt) {
     fprintf(stderr, "%s: Error: Btree Create failed: %s\n", argv[0], strerror(errno));
     exit(1);
@@ -460,7 +653,7 @@ main(int argc,
     key = strtok_r(buf, " \t\n\r", &ptr);
     val = strtok_r(NULL, "\n\r", &ptr);
 
-    if (btree_insert(bt, key, (void *) val) < 0) {
+    if (btree_insert(bt, strdup(key), (void *) strdup(val ? val : "")) < 0) {
       fprintf(stderr, "%s: Error: %s (%s): Btree Insert failed: %s\n",
 	      argv[0], key, val, strerror(errno));
       exit(1);
@@ -470,7 +663,7 @@ main(int argc,
   fclose(fp);
 
   
-  fprintf(stderr, "%u entries loaded in %f seconds\n", bt->entries, difftime(t1, t2));
+  fprintf(stderr, "%u entries loaded in %f seconds\n", bt->entries, difftime(t2, t1));
   
   if (argv[2]) {
     int rc;
@@ -479,8 +672,9 @@ main(int argc,
     printf("Btree Delete (%s) -> %d\n", argv[2], rc);
   
     if (argv[3]) {
-      val = btree_search(bt, argv[3]);
-      printf("Btree Search (%s) -> %s\n", argv[2], val);
+      val = NULL;
+      btree_search(bt, argv[3], (void **) &val);
+      printf("Btree Search (%s) -> %s\n", argv[3], val ? val : "<null>");
     }
   }
   
@@ -488,21 +682,6 @@ main(int argc,
   /*  btree_foreach(bt, print_node, NULL); */
   btree_foreach(bt, print_node, NULL);
 
-#if 0
-  puts("\nWalking Forward:");
-  n = bnode_min(bt->head);
-  while (n) {
-    printf("%-30s  %s\n", n->key, n->val);
-    n = bnode_next(n);
-  }
-
-  puts("\nWalking Backwards:");
-  n = bnode_max(bt->head);
-  while (n) {
-    printf("%-30s  %s\n", n->key, n->val);
-    n = bnode_prev(n);
-  }
-#endif
   
   return 0;
 }
@@ -29,10 +29,15 @@
 #ifndef BTREE_H
 #define BTREE_H 1
 
+#include <sys/types.h>
+
+#include "arena.h"
+
 typedef struct bnode {
-  struct bnode *parent;
   struct bnode *left;
   struct bnode *right;
+  struct bnode *hnext;	/* Hash index chain */
+  int height;		/* AVL subtree height */
   const char *key;
   void *val;
 } BNODE;
@@ -42,6 +47,9 @@ typedef struct btree {
   unsigned int entries;
   int (*kcmp)(const char *ka, const char *kb);
   void (*vfree)(void *val);
+  BNODE **htab;		/* Optional hash index (strcmp-ordered trees) */
+  size_t hsize;
+  ARENA *arena;		/* Optional owner of nodes & keys */
 } BTREE;
 
 
@@ -53,6 +61,10 @@ btree_create(int (*kcmp)(const char *ka, const char *kb),
 	     void (*vfree)(void *vp));
 
 
+extern int
+btree_arena(BTREE *bt,
+	    ARENA *ap);
+
 extern void
 btree_destroy(BTREE *bt);
 
@@ -75,4 +87,10 @@ btree_foreach(BTREE *bt,
 	      int (*fun)(const char *key, void *val, void *extra),
 	      void *extra);
 
+extern int
+btree_merge(BTREE *a,
+	    BTREE *b,
+	    int (*fun)(const char *key, void *aval, void *bval, void *extra),
+	    void *extra);
+
 #endif
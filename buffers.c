@@ -0,0 +1,184 @@
+/*
+ * buffers.c - Reusable I/O buffer pool
+ * 
+ * Copyright (c) 2021, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#if defined(HAVE_PTHREAD_H)
+#include <pthread.h>
+#endif
+
+#include "buffers.h"
+
+
+static size_t pool_bufsize = 0;
+static size_t pool_align = 0;
+static BUFFER *pool_free = NULL;
+
+#if defined(HAVE_PTHREAD_H)
+static pthread_mutex_t pool_mtx = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+
+
+/*
+ * Set up the buffer pool. The size is rounded up to a multiple of the
+ * page size so the buffers can be used for O_DIRECT I/O.
+ */
+int
+buffer_pool_init(size_t size) {
+  long pagesize;
+
+
+  if (size == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  pagesize = sysconf(_SC_PAGESIZE);
+  if (pagesize < 4096)
+    pagesize = 4096;
+
+  buffer_pool_destroy();
+
+  pool_align = pagesize;
+  pool_bufsize = ((size + pagesize - 1) / pagesize) * pagesize;
+  return 0;
+}
+
+
+size_t
+buffer_pool_size(void) {
+  return pool_bufsize;
+}
+
+
+/*
+ * Get a buffer from the pool (allocating a new one if none is free)
+ */
+BUFFER *
+buffer_get(void) {
+  BUFFER *bp;
+  void *data;
+  int rc;
+
+
+#if defined(HAVE_PTHREAD_H)
+  pthread_mutex_lock(&pool_mtx);
+#endif
+  bp = pool_free;
+  if (bp)
+    pool_free = bp->next;
+#if defined(HAVE_PTHREAD_H)
+  pthread_mutex_unlock(&pool_mtx);
+#endif
+
+  if (bp) {
+    bp->next = NULL;
+    return bp;
+  }
+
+  if (!pool_bufsize) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  bp = malloc(sizeof(*bp));
+  if (!bp)
+    return NULL;
+
+  rc = posix_memalign(&data, pool_align, pool_bufsize);
+  if (rc) {
+    free(bp);
+    errno = rc;
+    return NULL;
+  }
+
+  bp->next = NULL;
+  bp->size = pool_bufsize;
+  bp->data = data;
+  return bp;
+}
+
+
+/*
+ * Return a buffer to the pool
+ */
+void
+buffer_put(BUFFER *bp) {
+  if (!bp)
+    return;
+
+  if (bp->size != pool_bufsize) {
+    /* Left over from before the pool was resized */
+    free(bp->data);
+    free(bp);
+    return;
+  }
+
+#if defined(HAVE_PTHREAD_H)
+  pthread_mutex_lock(&pool_mtx);
+#endif
+  bp->next = pool_free;
+  pool_free = bp;
+#if defined(HAVE_PTHREAD_H)
+  pthread_mutex_unlock(&pool_mtx);
+#endif
+}
+
+
+/*
+ * Release all free buffers
+ */
+void
+buffer_pool_destroy(void) {
+  BUFFER *bp;
+
+
+#if defined(HAVE_PTHREAD_H)
+  pthread_mutex_lock(&pool_mtx);
+#endif
+  while ((bp = pool_free) != NULL) {
+    pool_free = bp->next;
+    free(bp->data);
+    free(bp);
+  }
+#if defined(HAVE_PTHREAD_H)
+  pthread_mutex_unlock(&pool_mtx);
+#endif
+}
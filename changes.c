@@ -0,0 +1,304 @@
+/*
+ * changes.c - Change lists for incremental mode
+ * 
+ * Copyright (c) 2021, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "changes.h"
+
+
+/*
+ * The change list names the paths that may differ since the last run
+ * (from "zfs diff -H", a file system event log, "find -newer" or the like).
+ * Every listed path is stored together with all its parent directories so
+ * the traversal only needs to descend into directories leading to changes.
+ */
+
+
+CHANGES *
+changes_create(const char *root) {
+  CHANGES *cp;
+
+
+  cp = malloc(sizeof(*cp));
+  if (!cp)
+    return NULL;
+
+  memset(cp, 0, sizeof(*cp));
+  cp->arena = arena_create(0);
+  cp->paths = btree_create(NULL, NULL);
+  if (!cp->arena || !cp->paths) {
+    changes_destroy(cp);
+    return NULL;
+  }
+  btree_arena(cp->paths, cp->arena);
+
+  if (root) {
+    size_t len = strlen(root);
+
+    /* No trailing '/' */
+    while (len > 1 && root[len-1] == '/')
+      --len;
+    cp->root = arena_alloc(cp->arena, len+1);
+    if (!cp->root) {
+      changes_destroy(cp);
+      return NULL;
+    }
+    memcpy((char *) cp->root, root, len);
+    ((char *) cp->root)[len] = '\0';
+  }
+  
+  return cp;
+}
+
+
+void
+changes_destroy(CHANGES *cp) {
+  if (!cp)
+    return;
+
+  if (cp->paths)
+    btree_destroy(cp->paths);
+  arena_destroy(cp->arena);
+  free(cp);
+}
+
+
+/*
+ * Convert a listed path to a clean path relative to the root
+ * (no "." or empty components, and "" for the root itself)
+ */
+static char *
+changes_normalize(CHANGES *cp,
+		  const char *path) {
+  char *buf, *bp;
+  const char *cur, *end;
+  size_t len;
+
+  
+  if (*path == '/') {
+    len = cp->root ? strlen(cp->root) : 0;
+    
+    if (!cp->root || *cp->root != '/' ||
+	strncmp(path, cp->root, len) != 0 ||
+	(path[len] != '/' && path[len] != '\0' && len > 1)) {
+      errno = EINVAL;
+      return NULL;
+    }
+    path += len;
+  }
+
+  buf = bp = malloc(strlen(path)+1);
+  if (!buf)
+    return NULL;
+  
+  for (cur = path; *cur; cur = end) {
+    while (*cur == '/')
+      ++cur;
+    for (end = cur; *end && *end != '/'; ++end)
+      ;
+    len = end-cur;
+    
+    if (len == 0 || (len == 1 && *cur == '.'))
+      continue;
+    if (len == 2 && cur[0] == '.' && cur[1] == '.') {
+      free(buf);
+      errno = EINVAL;
+      return NULL;
+    }
+    
+    if (bp > buf)
+      *bp++ = '/';
+    memcpy(bp, cur, len);
+    bp += len;
+  }
+  *bp = '\0';
+  
+  return buf;
+}
+
+
+static int
+changes_set(CHANGES *cp,
+	    const char *path,
+	    int flags) {
+  int *fp = NULL;
+  char *key;
+
+  
+  if (btree_search(cp->paths, path, (void **) &fp) == 0 && fp) {
+    *fp |= flags;
+    return 0;
+  }
+
+  key = arena_strdup(cp->arena, path);
+  fp = arena_alloc(cp->arena, sizeof(*fp));
+  if (!key || !fp)
+    return -1;
+  *fp = flags;
+  
+  return btree_insert(cp->paths, key, fp);
+}
+
+
+/*
+ * Add a path (relative to the root, or absolute below it)
+ */
+int
+changes_add(CHANGES *cp,
+	    const char *path) {
+  char *rel, *cp2;
+  int rc = 0;
+
+  
+  rel = changes_normalize(cp, path);
+  if (!rel)
+    return -1;
+
+  /* The parent directories down to the path */
+  for (cp2 = rel; rc == 0 && (cp2 = strchr(cp2, '/')) != NULL; *cp2++ = '/') {
+    *cp2 = '\0';
+    rc = changes_set(cp, rel, CHANGES_F_PARENT);
+  }
+
+  if (rc == 0)
+    rc = changes_set(cp, rel, CHANGES_F_PATH);
+  
+  free(rel);
+  return rc;
+}
+
+
+/*
+ * Undo the octal escapes ("\040" or "\0040") used by zfs diff
+ */
+static void
+changes_unescape(char *s) {
+  char *d = s;
+
+  
+  while (*s) {
+    if (*s == '\\' && s[1] >= '0' && s[1] <= '7') {
+      int i, v = 0;
+
+      for (i = 1; i <= 4 && s[i] >= '0' && s[i] <= '7' && v*8 + (s[i]-'0') <= 255; i++)
+	v = v*8 + (s[i]-'0');
+      *d++ = (char) v;
+      s += i;
+    } else
+      *d++ = *s++;
+  }
+  *d = '\0';
+}
+
+
+/*
+ * Load a change list - one path per line, or "zfs diff -H [-F]" output
+ * ("<change>\t[<type>\t]<path>[\t<new path>]"). "-" reads standard input.
+ */
+int
+changes_load(CHANGES *cp,
+	     const char *file) {
+  FILE *fp;
+  char *line = NULL, *fv[4];
+  size_t size = 0;
+  ssize_t len;
+  int i, fc, rc = 0;
+
+  
+  if (strcmp(file, "-") == 0)
+    fp = stdin;
+  else {
+    fp = fopen(file, "r");
+    if (!fp)
+      return -1;
+  }
+  
+  while (rc == 0 && (len = getline(&line, &size, fp)) >= 0) {
+    while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r'))
+      line[--len] = '\0';
+    if (len == 0)
+      continue;
+
+    fc = 0;
+    if (strchr("-+MR", line[0]) && line[1] == '\t') {
+      char *s = line+2, *t;
+
+      /* File type column (-F) */
+      if (s[0] && s[1] == '\t')
+	s += 2;
+      while (fc < 2 && s) {
+	t = strchr(s, '\t');
+	if (t)
+	  *t++ = '\0';
+	fv[fc++] = s;
+	s = t;
+      }
+    } else
+      fv[fc++] = line;
+
+    for (i = 0; rc == 0 && i < fc; i++) {
+      changes_unescape(fv[i]);
+      rc = changes_add(cp, fv[i]);
+    }
+  }
+  if (rc == 0 && ferror(fp))
+    rc = -1;
+  
+  free(line);
+  if (fp != stdin)
+    fclose(fp);
+  return rc;
+}
+
+
+/*
+ * Get the CHANGES_F_* flags for a path relative to the root (the root
+ * itself always leads to the changes)
+ */
+int
+changes_match(CHANGES *cp,
+	      const char *path) {
+  int *fp = NULL;
+
+
+  if (btree_search(cp->paths, path, (void **) &fp) == 0 && fp)
+    return *fp;
+
+  return *path ? 0 : CHANGES_F_PARENT;
+}
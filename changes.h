@@ -0,0 +1,76 @@
+/*
+ * changes.h - Change lists for incremental mode
+ * 
+ * Copyright (c) 2021, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef CHANGES_H
+#define CHANGES_H 1
+
+#include "config.h"
+
+#include "btree.h"
+#include "arena.h"
+
+
+#define CHANGES_F_PATH    0x01	/* The path itself is listed */
+#define CHANGES_F_PARENT  0x02	/* Something below the path is listed */
+
+
+/*
+ * Set of paths (relative to the source root) that may have changed
+ */
+typedef struct changes {
+  BTREE *paths;		/* Path -> CHANGES_F_* */
+  ARENA *arena;
+  const char *root;	/* Prefix stripped from absolute paths */
+} CHANGES;
+
+
+extern CHANGES *
+changes_create(const char *root);
+
+extern void
+changes_destroy(CHANGES *cp);
+
+extern int
+changes_add(CHANGES *cp,
+	    const char *path);
+
+extern int
+changes_load(CHANGES *cp,
+	     const char *file);
+
+extern int
+changes_match(CHANGES *cp,
+	      const char *path);
+
+#endif
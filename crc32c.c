@@ -0,0 +1,284 @@
+/*
+** crc32c.c - CRC-32C (Castagnoli) checksum
+**
+** Copyright (c) 2021, Peter Eriksson <pen@lysator.liu.se>
+** All rights reserved.
+** 
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+** 
+** 1. Redistributions of source code must retain the above copyright notice, this
+**    list of conditions and the following disclaimer.
+** 
+** 2. Redistributions in binary form must reproduce the above copyright notice,
+**    this list of conditions and the following disclaimer in the documentation
+**    and/or other materials provided with the distribution.
+** 
+** 3. Neither the name of the copyright holder nor the names of its
+**    contributors may be used to endorse or promote products derived from
+**    this software without specific prior written permission.
+** 
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+** DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+** FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+** DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+** SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+** CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+** OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+** OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#include "config.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+#if defined(HAVE_PTHREAD_H)
+#include <pthread.h>
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define CRC32C_SSE42 1
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC32C_ARMV8 1
+#endif
+
+#include "crc32c.h"
+
+
+/*
+ * CRC-32C as used by iSCSI, ext4, btrfs etc. Uses the SSE4.2 crc32
+ * instruction (if the CPU has it) or the ARMv8 CRC extension, and
+ * falls back to a slicing-by-8 table implementation.
+ */
+
+#define CRC32C_POLY 0x82F63B78	/* Reflected Castagnoli polynomial */
+
+static uint32_t crc32c_table[8][256];
+
+static uint32_t (*crc32c_fun)(uint32_t crc, const unsigned char *buf, size_t len) = NULL;
+
+
+static uint32_t
+crc32c_sw(uint32_t crc,
+	  const unsigned char *p,
+	  size_t len) {
+  crc = ~crc;
+
+  while (len > 0 && ((uintptr_t) p & 7) != 0) {
+    crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    len--;
+  }
+  
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  while (len >= 8) {
+    uint64_t w;
+
+    memcpy(&w, p, 8);
+    w ^= crc;
+    crc =
+      crc32c_table[7][w & 0xff] ^
+      crc32c_table[6][(w >> 8) & 0xff] ^
+      crc32c_table[5][(w >> 16) & 0xff] ^
+      crc32c_table[4][(w >> 24) & 0xff] ^
+      crc32c_table[3][(w >> 32) & 0xff] ^
+      crc32c_table[2][(w >> 40) & 0xff] ^
+      crc32c_table[1][(w >> 48) & 0xff] ^
+      crc32c_table[0][w >> 56];
+    p += 8;
+    len -= 8;
+  }
+#endif
+  
+  while (len-- > 0)
+    crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  
+  return ~crc;
+}
+
+
+#if defined(CRC32C_SSE42)
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_sse42(uint32_t crc,
+	     const unsigned char *p,
+	     size_t len) {
+  uint64_t c = ~crc;
+
+  while (len > 0 && ((uintptr_t) p & 7) != 0) {
+    c = _mm_crc32_u8((uint32_t) c, *p++);
+    len--;
+  }
+  while (len >= 8) {
+    uint64_t w;
+
+    memcpy(&w, p, 8);
+    c = _mm_crc32_u64(c, w);
+    p += 8;
+    len -= 8;
+  }
+  while (len-- > 0)
+    c = _mm_crc32_u8((uint32_t) c, *p++);
+  
+  return ~(uint32_t) c;
+}
+#endif
+
+
+#if defined(CRC32C_ARMV8)
+static uint32_t
+crc32c_armv8(uint32_t crc,
+	     const unsigned char *p,
+	     size_t len) {
+  crc = ~crc;
+
+  while (len > 0 && ((uintptr_t) p & 7) != 0) {
+    crc = __crc32cb(crc, *p++);
+    len--;
+  }
+  while (len >= 8) {
+    uint64_t w;
+
+    memcpy(&w, p, 8);
+    crc = __crc32cd(crc, w);
+    p += 8;
+    len -= 8;
+  }
+  while (len-- > 0)
+    crc = __crc32cb(crc, *p++);
+  
+  return ~crc;
+}
+#endif
+
+
+static void
+crc32c_setup(void) {
+  uint32_t c;
+  int i, k;
+
+
+  for (i = 0; i < 256; i++) {
+    c = i;
+    for (k = 0; k < 8; k++)
+      c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : (c >> 1);
+    crc32c_table[0][i] = c;
+  }
+  for (i = 0; i < 256; i++) {
+    c = crc32c_table[0][i];
+    for (k = 1; k < 8; k++) {
+      c = crc32c_table[0][c & 0xff] ^ (c >> 8);
+      crc32c_table[k][i] = c;
+    }
+  }
+
+  crc32c_fun = crc32c_sw;
+#if defined(CRC32C_SSE42)
+  if (__builtin_cpu_supports("sse4.2"))
+    crc32c_fun = crc32c_sse42;
+#endif
+#if defined(CRC32C_ARMV8)
+  crc32c_fun = crc32c_armv8;
+#endif
+}
+
+
+/*
+ * Update a CRC-32C with more data (start with crc = 0)
+ */
+uint32_t
+crc32c(uint32_t crc,
+       const void *buf,
+       size_t len) {
+#if defined(HAVE_PTHREAD_H)
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+  pthread_once(&once, crc32c_setup);
+#else
+  if (!crc32c_fun)
+    crc32c_setup();
+#endif
+  return crc32c_fun(crc, (const unsigned char *) buf, len);
+}
+
+
+
+/*
+ * Combining CRCs by multiplying with a matrix of x^len2 over GF(2),
+ * as in zlib's crc32_combine()
+ */
+static uint32_t
+gf2_matrix_times(const uint32_t *mat,
+		 uint32_t vec) {
+  uint32_t sum = 0;
+
+  while (vec) {
+    if (vec & 1)
+      sum ^= *mat;
+    vec >>= 1;
+    mat++;
+  }
+  return sum;
+}
+
+static void
+gf2_matrix_square(uint32_t *square,
+		  const uint32_t *mat) {
+  int n;
+
+  for (n = 0; n < 32; n++)
+    square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+
+/*
+ * Return the CRC-32C of A+B given crc1 = CRC-32C(A), crc2 = CRC-32C(B)
+ * and len2 = length of B
+ */
+uint32_t
+crc32c_combine(uint32_t crc1,
+	       uint32_t crc2,
+	       off_t len2) {
+  uint32_t row, even[32], odd[32];
+  int n;
+
+  
+  if (len2 <= 0)
+    return crc1;
+
+  /* Operator for one zero bit */
+  odd[0] = CRC32C_POLY;
+  row = 1;
+  for (n = 1; n < 32; n++) {
+    odd[n] = row;
+    row <<= 1;
+  }
+
+  gf2_matrix_square(even, odd);	/* Two zero bits */
+  gf2_matrix_square(odd, even);	/* Four zero bits */
+
+  /* Apply len2 zero bytes to crc1 */
+  do {
+    gf2_matrix_square(even, odd);
+    if (len2 & 1)
+      crc1 = gf2_matrix_times(even, crc1);
+    len2 >>= 1;
+    if (len2 == 0)
+      break;
+
+    gf2_matrix_square(odd, even);
+    if (len2 & 1)
+      crc1 = gf2_matrix_times(odd, crc1);
+    len2 >>= 1;
+  } while (len2 != 0);
+
+  return crc1 ^ crc2;
+}
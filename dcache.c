@@ -0,0 +1,600 @@
+/*
+ * dcache.c - Persistent file digest cache
+ * 
+ * Copyright (c) 2021, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#if defined(HAVE_PTHREAD_H)
+#include <pthread.h>
+#endif
+
+#include "attrs.h"
+#include "dcache.h"
+
+
+#if defined(__APPLE__)
+#define ST_MTIM(sp) ((sp)->st_mtimespec)
+#define ST_CTIM(sp) ((sp)->st_ctimespec)
+#else
+#define ST_MTIM(sp) ((sp)->st_mtim)
+#define ST_CTIM(sp) ((sp)->st_ctim)
+#endif
+
+
+/*
+ * A cached digest is valid as long as the file (dev & inode) has the
+ * same size, mtime and ctime as when the digest was calculated.
+ */
+typedef struct dcentry {
+  struct dcentry *next;
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  struct timespec ctime;
+  DIGEST_TYPE type;
+  size_t len;
+  unsigned char buf[DIGEST_BUFSIZE_MAX];
+} DCENTRY;
+
+
+static int dc_flags = 0;
+static char *dc_path = NULL;
+static struct stat dc_stat;		/* The cache file itself at load time */
+static int dc_loaded = 0;
+static int dc_modified = 0;
+
+static DCENTRY **dc_tab = NULL;
+static size_t dc_size = 0;
+static size_t dc_entries = 0;
+
+#if defined(HAVE_PTHREAD_H)
+static pthread_mutex_t dc_mtx = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+
+
+static inline size_t
+dc_hash(dev_t dev,
+	ino_t ino) {
+  uint64_t h = ((uint64_t) dev * 0x9E3779B97F4A7C15ULL) ^ (uint64_t) ino;
+
+  h ^= h >> 33;
+  h *= 0xFF51AFD7ED558CCDULL;
+  h ^= h >> 33;
+  return (size_t) h;
+}
+
+
+static int
+dc_grow(void) {
+  DCENTRY **ntab, *ep, *next;
+  size_t nsize, i, h;
+
+
+  nsize = dc_size ? dc_size*2 : 1024;
+  ntab = calloc(nsize, sizeof(*ntab));
+  if (!ntab)
+    return -1;
+
+  for (i = 0; i < dc_size; i++) {
+    for (ep = dc_tab[i]; ep; ep = next) {
+      next = ep->next;
+      h = dc_hash(ep->dev, ep->ino) & (nsize-1);
+      ep->next = ntab[h];
+      ntab[h] = ep;
+    }
+  }
+
+  free(dc_tab);
+  dc_tab = ntab;
+  dc_size = nsize;
+  return 0;
+}
+
+
+static DCENTRY *
+dc_lookup(dev_t dev,
+	  ino_t ino) {
+  DCENTRY *ep;
+
+  
+  if (!dc_tab)
+    return NULL;
+  
+  for (ep = dc_tab[dc_hash(dev, ino) & (dc_size-1)]; ep; ep = ep->next)
+    if (ep->dev == dev && ep->ino == ino)
+      return ep;
+
+  return NULL;
+}
+
+
+static DCENTRY *
+dc_insert(dev_t dev,
+	  ino_t ino) {
+  DCENTRY *ep;
+  size_t h;
+
+  
+  ep = dc_lookup(dev, ino);
+  if (ep)
+    return ep;
+
+  if (dc_entries >= dc_size && dc_grow() < 0)
+    return NULL;
+	
+  ep = calloc(1, sizeof(*ep));
+  if (!ep)
+    return NULL;
+
+  ep->dev = dev;
+  ep->ino = ino;
+  
+  h = dc_hash(dev, ino) & (dc_size-1);
+  ep->next = dc_tab[h];
+  dc_tab[h] = ep;
+  dc_entries++;
+  return ep;
+}
+
+
+static int
+timespec_equal(const struct timespec *a,
+	       const struct timespec *b) {
+  return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+
+static int
+hex2bin(const char *s,
+	unsigned char *buf,
+	size_t size) {
+  size_t len = 0;
+  unsigned int v;
+
+  while (s[0] && s[1] && len < size) {
+    if (sscanf(s, "%2x", &v) != 1)
+      return -1;
+    buf[len++] = v;
+    s += 2;
+  }
+
+  return (*s == '\0' || *s == '\n') ? (int) len : -1;
+}
+
+
+static void
+bin2hex(const unsigned char *buf,
+	size_t len,
+	char *s) {
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    sprintf(s+2*i, "%02x", buf[i]);
+  s[2*len] = '\0';
+}
+
+
+/*
+ * Cache file format (one file per line):
+ *   <dev> <ino> <size> <mtime>.<ns> <ctime>.<ns> <digest-type> <hex-digest>
+ */
+static int
+dc_load(FILE *fp) {
+  char line[2*DIGEST_BUFSIZE_MAX+256];
+  char tname[32], hex[2*DIGEST_BUFSIZE_MAX+2];
+  unsigned long long dev, ino;
+  long long size, mt, ct;
+  long mn, cn;
+  DIGEST_TYPE type;
+  DCENTRY *ep;
+  int len;
+
+
+  while (fgets(line, sizeof(line), fp)) {
+    if (line[0] == '#')
+      continue;
+    
+    if (sscanf(line, "%llx %llx %lld %lld.%ld %lld.%ld %31s %129s",
+	       &dev, &ino, &size, &mt, &mn, &ct, &cn, tname, hex) != 9)
+      continue;
+
+    type = digest_str2type(tname);
+    if (type <= DIGEST_TYPE_NONE)
+      continue;
+    
+    ep = dc_insert((dev_t) dev, (ino_t) ino);
+    if (!ep)
+      return -1;
+    
+    len = hex2bin(hex, ep->buf, sizeof(ep->buf));
+    if (len <= 0) {
+      ep->len = 0;
+      continue;
+    }
+    ep->len = len;
+    ep->type = type;
+    ep->size = size;
+    ep->mtime.tv_sec = mt;
+    ep->mtime.tv_nsec = mn;
+    ep->ctime.tv_sec = ct;
+    ep->ctime.tv_nsec = cn;
+  }
+
+  return 0;
+}
+
+
+static int
+dc_save(void) {
+  char *tmp;
+  char hex[2*DIGEST_BUFSIZE_MAX+1];
+  FILE *fp;
+  DCENTRY *ep;
+  size_t i;
+  int fd;
+
+
+  tmp = malloc(strlen(dc_path)+32);
+  if (!tmp)
+    return -1;
+  sprintf(tmp, "%s.%ld", dc_path, (long) getpid());
+
+  fd = open(tmp, O_WRONLY|O_CREAT|O_EXCL, 0600);
+  if (fd < 0 || (fp = fdopen(fd, "w")) == NULL) {
+    if (fd >= 0)
+      close(fd);
+    free(tmp);
+    return -1;
+  }
+
+  fprintf(fp, "# pc digest cache v1\n");
+  for (i = 0; i < dc_size; i++) {
+    for (ep = dc_tab[i]; ep; ep = ep->next) {
+      if (!ep->len)
+	continue;
+      
+      bin2hex(ep->buf, ep->len, hex);
+      fprintf(fp, "%llx %llx %lld %lld.%09ld %lld.%09ld %s %s\n",
+	      (unsigned long long) ep->dev,
+	      (unsigned long long) ep->ino,
+	      (long long) ep->size,
+	      (long long) ep->mtime.tv_sec, (long) ep->mtime.tv_nsec,
+	      (long long) ep->ctime.tv_sec, (long) ep->ctime.tv_nsec,
+	      digest_type2str(ep->type),
+	      hex);
+    }
+  }
+  
+  if (fflush(fp) != 0 || fsync(fileno(fp)) < 0) {
+    fclose(fp);
+    unlink(tmp);
+    free(tmp);
+    return -1;
+  }
+  fclose(fp);
+
+  if (rename(tmp, dc_path) < 0) {
+    unlink(tmp);
+    free(tmp);
+    return -1;
+  }
+  
+  free(tmp);
+  return 0;
+}
+
+
+/*
+ * Set up the digest cache. If path is a directory then the cache
+ * file is stored in it as DCACHE_FILENAME.
+ */
+int
+dcache_open(const char *path,
+	    int flags) {
+  struct stat sb;
+  FILE *fp;
+  
+
+  dc_flags = flags;
+  if (!(flags & DCACHE_FLAG_FILE))
+    return 0;
+
+  if (!path) {
+    errno = EINVAL;
+    return -1;
+  }
+  
+  if (stat(path, &sb) == 0 && S_ISDIR(sb.st_mode)) {
+    dc_path = malloc(strlen(path)+sizeof(DCACHE_FILENAME)+2);
+    if (!dc_path)
+      return -1;
+    sprintf(dc_path, "%s/%s", path, DCACHE_FILENAME);
+  } else {
+    dc_path = strdup(path);
+    if (!dc_path)
+      return -1;
+  }
+
+  fp = fopen(dc_path, "r");
+  if (!fp) {
+    if (errno == ENOENT)
+      return 0;
+    return -1;
+  }
+
+  if (fstat(fileno(fp), &dc_stat) == 0)
+    dc_loaded = 1;
+  
+  if (dc_load(fp) < 0) {
+    fclose(fp);
+    return -1;
+  }
+  
+  fclose(fp);
+  return 0;
+}
+
+
+/*
+ * Write back the cache file (if modified) and release the cache
+ */
+int
+dcache_close(void) {
+  DCENTRY *ep, *next;
+  size_t i;
+  int rc = 0;
+
+
+  if (dc_path && dc_modified && !(dc_flags & DCACHE_FLAG_RDONLY))
+    rc = dc_save();
+  
+  for (i = 0; i < dc_size; i++) {
+    for (ep = dc_tab[i]; ep; ep = next) {
+      next = ep->next;
+      free(ep);
+    }
+  }
+  free(dc_tab);
+  dc_tab = NULL;
+  dc_size = dc_entries = 0;
+  
+  free(dc_path);
+  dc_path = NULL;
+  dc_flags = 0;
+  dc_loaded = dc_modified = 0;
+  return rc;
+}
+
+
+/*
+ * Digest stored as an extended attribute: "<type> <size> <mtime>.<ns> <hex-digest>"
+ *
+ * The ctime can't be part of the key here since setting the attribute
+ * updates it.
+ */
+static int
+dc_attr_get(const char *path,
+	    const NSTAT *sp,
+	    DIGEST_TYPE type,
+	    unsigned char *buf,
+	    size_t *lenp) {
+  char val[2*DIGEST_BUFSIZE_MAX+128];
+  char tname[32], hex[2*DIGEST_BUFSIZE_MAX+2];
+  long long size, mt;
+  long mn;
+  ssize_t vlen;
+  int len;
+
+
+  vlen = attr_get(path, ATTR_NAMESPACE_USER, DCACHE_ATTR_NAME, val, sizeof(val)-1, ATTR_FLAG_NOFOLLOW);
+  if (vlen <= 0)
+    return 0;
+  val[vlen] = '\0';
+
+  if (sscanf(val, "%31s %lld %lld.%ld %129s", tname, &size, &mt, &mn, hex) != 5)
+    return 0;
+
+  if (digest_str2type(tname) != type ||
+      size != (long long) sp->st_size ||
+      mt != (long long) ST_MTIM(sp).tv_sec ||
+      mn != (long) ST_MTIM(sp).tv_nsec)
+    return 0;
+
+  len = hex2bin(hex, buf, DIGEST_BUFSIZE_MAX);
+  if (len <= 0)
+    return 0;
+  
+  *lenp = len;
+  return 1;
+}
+
+
+static int
+dc_attr_put(const char *path,
+	    const NSTAT *sp,
+	    DIGEST_TYPE type,
+	    const unsigned char *buf,
+	    size_t len) {
+  char val[2*DIGEST_BUFSIZE_MAX+128];
+  char hex[2*DIGEST_BUFSIZE_MAX+1];
+
+  
+  bin2hex(buf, len, hex);
+  snprintf(val, sizeof(val), "%s %lld %lld.%09ld %s",
+	   digest_type2str(type),
+	   (long long) sp->st_size,
+	   (long long) ST_MTIM(sp).tv_sec, (long) ST_MTIM(sp).tv_nsec,
+	   hex);
+  
+  return attr_set(path, ATTR_NAMESPACE_USER, DCACHE_ATTR_NAME, val, strlen(val), ATTR_FLAG_NOFOLLOW) < 0 ? -1 : 0;
+}
+
+
+/*
+ * Look up a cached digest for a file
+ *
+ * Returns: 1 if found, 0 if not
+ */
+int
+dcache_get(const char *path,
+	   const NSTAT *sp,
+	   DIGEST_TYPE type,
+	   unsigned char *buf,
+	   size_t *lenp) {
+  DCENTRY *ep;
+  int rc = 0;
+
+  
+  if (!S_ISREG(sp->st_mode))
+    return 0;
+  
+  if (dc_flags & DCACHE_FLAG_FILE) {
+#if defined(HAVE_PTHREAD_H)
+    pthread_mutex_lock(&dc_mtx);
+#endif
+    ep = dc_lookup(sp->st_dev, sp->st_ino);
+    if (ep && ep->len &&
+	ep->type == type &&
+	ep->size == sp->st_size &&
+	timespec_equal(&ep->mtime, &ST_MTIM(sp)) &&
+	timespec_equal(&ep->ctime, &ST_CTIM(sp))) {
+      memcpy(buf, ep->buf, ep->len);
+      *lenp = ep->len;
+      rc = 1;
+    }
+#if defined(HAVE_PTHREAD_H)
+    pthread_mutex_unlock(&dc_mtx);
+#endif
+    if (rc)
+      return rc;
+  }
+
+  if ((dc_flags & DCACHE_FLAG_ATTR) && path) {
+    rc = dc_attr_get(path, sp, type, buf, lenp);
+    if (rc > 0 && (dc_flags & DCACHE_FLAG_FILE))
+      /* Remember it in the cache file too */
+      dcache_put(NULL, sp, type, buf, *lenp);
+  }
+
+  return rc;
+}
+
+
+/*
+ * Store a digest for a file. The stat info must be from before
+ * the digest was calculated. If path is NULL then only the cache
+ * file is updated.
+ */
+int
+dcache_put(const char *path,
+	   const NSTAT *sp,
+	   DIGEST_TYPE type,
+	   const unsigned char *buf,
+	   size_t len) {
+  DCENTRY *ep;
+  int rc = 0;
+
+  
+  if (!S_ISREG(sp->st_mode) || len == 0 || len > DIGEST_BUFSIZE_MAX ||
+      (dc_flags & DCACHE_FLAG_RDONLY))
+    return 0;
+  
+  if (dc_flags & DCACHE_FLAG_FILE) {
+#if defined(HAVE_PTHREAD_H)
+    pthread_mutex_lock(&dc_mtx);
+#endif
+    ep = dc_insert(sp->st_dev, sp->st_ino);
+    if (ep) {
+      ep->type = type;
+      ep->size = sp->st_size;
+      ep->mtime = ST_MTIM(sp);
+      ep->ctime = ST_CTIM(sp);
+      memcpy(ep->buf, buf, len);
+      ep->len = len;
+      dc_modified = 1;
+    } else
+      rc = -1;
+#if defined(HAVE_PTHREAD_H)
+    pthread_mutex_unlock(&dc_mtx);
+#endif
+  }
+
+  if ((dc_flags & DCACHE_FLAG_ATTR) && path) {
+    struct stat sb;
+    
+    /* Errors (read-only source, no xattr support) are not fatal */
+    if (dc_attr_put(path, sp, type, buf, len) == 0 &&
+	(dc_flags & DCACHE_FLAG_FILE) &&
+	lstat(path, &sb) == 0 &&
+	sb.st_size == sp->st_size &&
+	timespec_equal(&ST_MTIM(&sb), &ST_MTIM(sp))) {
+      /* Setting the attribute changed the ctime */
+#if defined(HAVE_PTHREAD_H)
+      pthread_mutex_lock(&dc_mtx);
+#endif
+      ep = dc_lookup(sp->st_dev, sp->st_ino);
+      if (ep)
+	ep->ctime = ST_CTIM(&sb);
+#if defined(HAVE_PTHREAD_H)
+      pthread_mutex_unlock(&dc_mtx);
+#endif
+    }
+  }
+  
+  return rc;
+}
+
+
+/*
+ * Check if a file is the cache file itself (so it isn't expunged
+ * when stored inside the destination tree)
+ */
+int
+dcache_self(const NSTAT *sp) {
+  return dc_loaded && sp->st_dev == dc_stat.st_dev && sp->st_ino == dc_stat.st_ino;
+}
+
+
+int
+dcache_flags(void) {
+  return dc_flags;
+}
@@ -0,0 +1,88 @@
+/*
+ * dcache.h - Persistent file digest cache
+ * 
+ * Copyright (c) 2021, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef DCACHE_H
+#define DCACHE_H 1
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "digest.h"
+#include "nstat.h"
+
+
+/* Default cache file name if a directory is given */
+#define DCACHE_FILENAME   ".pc-digests"
+
+/* Extended attribute used to store digests (with -K) */
+#if defined(HAVE_LGETXATTR)
+#define DCACHE_ATTR_NAME  "user.pc.digest"
+#else
+#define DCACHE_ATTR_NAME  "pc.digest"
+#endif
+
+#define DCACHE_FLAG_FILE  0x0001	/* Use the cache file */
+#define DCACHE_FLAG_ATTR  0x0002	/* Use extended attributes */
+#define DCACHE_FLAG_RDONLY 0x0004	/* Don't store anything (dry-run) */
+
+
+extern int
+dcache_open(const char *path,
+	    int flags);
+
+extern int
+dcache_close(void);
+
+extern int
+dcache_get(const char *path,
+	   const NSTAT *sp,
+	   DIGEST_TYPE type,
+	   unsigned char *buf,
+	   size_t *lenp);
+
+extern int
+dcache_put(const char *path,
+	   const NSTAT *sp,
+	   DIGEST_TYPE type,
+	   const unsigned char *buf,
+	   size_t len);
+
+extern int
+dcache_self(const NSTAT *sp);
+
+extern int
+dcache_flags(void);
+
+#endif
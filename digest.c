@@ -88,6 +88,24 @@ digest_str2type(const char *s) {
   if (strcasecmp(s, "SHA3-512") == 0)
     return DIGEST_TYPE_SHA3_512;
 #endif
+
+  if (strcasecmp(s, "CRC32C") == 0 || strcasecmp(s, "CRC-32C") == 0)
+    return DIGEST_TYPE_CRC32C;
+
+#if defined(HAVE_XXH3_64BITS_RESET)
+  if (strcasecmp(s, "XXH3") == 0 || strcasecmp(s, "XXH3-64") == 0)
+    return DIGEST_TYPE_XXH3;
+#endif
+
+#if defined(HAVE_XXH3_128BITS_RESET)
+  if (strcasecmp(s, "XXH128") == 0 || strcasecmp(s, "XXH3-128") == 0)
+    return DIGEST_TYPE_XXH128;
+#endif
+
+#if defined(HAVE_BLAKE3_HASHER_INIT)
+  if (strcasecmp(s, "BLAKE3") == 0)
+    return DIGEST_TYPE_BLAKE3;
+#endif
   return -1;
 }
 
@@ -143,6 +161,24 @@ digest_type2str(DIGEST_TYPE type) {
     return "SHA3-512";
 #endif
 
+  case DIGEST_TYPE_CRC32C:
+    return "CRC32C";
+
+#if defined(HAVE_XXH3_64BITS_RESET)
+  case DIGEST_TYPE_XXH3:
+    return "XXH3";
+#endif
+
+#if defined(HAVE_XXH3_128BITS_RESET)
+  case DIGEST_TYPE_XXH128:
+    return "XXH128";
+#endif
+
+#if defined(HAVE_BLAKE3_HASHER_INIT)
+  case DIGEST_TYPE_BLAKE3:
+    return "BLAKE3";
+#endif
+
   default:
     return NULL;
   }
@@ -159,7 +195,7 @@ digest_init(DIGEST *dp,
 
   dp->state = DIGEST_STATE_NONE;
   
-  switch (dp->type) {
+  switch (type) {
   case DIGEST_TYPE_NONE:
     break;
 
@@ -256,6 +292,37 @@ digest_init(DIGEST *dp,
     return -1;
 #endif
 
+  case DIGEST_TYPE_CRC32C:
+    dp->ctx.crc32c = crc32c(0, NULL, 0);
+    break;
+
+  case DIGEST_TYPE_XXH3:
+#if defined(HAVE_XXH3_64BITS_RESET)
+    XXH3_64bits_reset(&dp->ctx.xxh3);
+    break;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+
+  case DIGEST_TYPE_XXH128:
+#if defined(HAVE_XXH3_128BITS_RESET)
+    XXH3_128bits_reset(&dp->ctx.xxh3);
+    break;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+
+  case DIGEST_TYPE_BLAKE3:
+#if defined(HAVE_BLAKE3_HASHER_INIT)
+    blake3_hasher_init(&dp->ctx.blake3);
+    break;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+
 #if 1
   case DIGEST_TYPE_INVALID:
     errno = EINVAL;
@@ -381,6 +448,37 @@ digest_update(DIGEST *dp,
       return -1;
 #endif
 
+    case DIGEST_TYPE_CRC32C:
+      dp->ctx.crc32c = crc32c(dp->ctx.crc32c, buf, bufsize);
+      break;
+
+    case DIGEST_TYPE_XXH3:
+#if defined(HAVE_XXH3_64BITS_RESET)
+      XXH3_64bits_update(&dp->ctx.xxh3, buf, bufsize);
+      break;
+#else
+      errno = ENOSYS;
+      return -1;
+#endif
+
+    case DIGEST_TYPE_XXH128:
+#if defined(HAVE_XXH3_128BITS_RESET)
+      XXH3_128bits_update(&dp->ctx.xxh3, buf, bufsize);
+      break;
+#else
+      errno = ENOSYS;
+      return -1;
+#endif
+
+    case DIGEST_TYPE_BLAKE3:
+#if defined(HAVE_BLAKE3_HASHER_INIT)
+      blake3_hasher_update(&dp->ctx.blake3, buf, bufsize);
+      break;
+#else
+      errno = ENOSYS;
+      return -1;
+#endif
+
 #if 1
   case DIGEST_TYPE_INVALID:
     errno = EINVAL;
@@ -563,6 +661,59 @@ digest_final(DIGEST *dp,
       return -1;
 #endif
 
+    case DIGEST_TYPE_CRC32C:
+      if (bufsize < DIGEST_BUFSIZE_CRC32C) {
+	errno = EOVERFLOW;
+	return -1;
+      }
+      rlen = DIGEST_BUFSIZE_CRC32C;
+      * (uint32_t *) buf = htonl(dp->ctx.crc32c);
+      break;
+
+    case DIGEST_TYPE_XXH3:
+      if (bufsize < DIGEST_BUFSIZE_XXH3) {
+	errno = EOVERFLOW;
+	return -1;
+      }
+#if defined(HAVE_XXH3_64BITS_RESET)
+      XXH64_canonicalFromHash((XXH64_canonical_t *) buf,
+			      XXH3_64bits_digest(&dp->ctx.xxh3));
+      rlen = DIGEST_BUFSIZE_XXH3;
+      break;
+#else
+      errno = ENOSYS;
+      return -1;
+#endif
+
+    case DIGEST_TYPE_XXH128:
+      if (bufsize < DIGEST_BUFSIZE_XXH128) {
+	errno = EOVERFLOW;
+	return -1;
+      }
+#if defined(HAVE_XXH3_128BITS_RESET)
+      XXH128_canonicalFromHash((XXH128_canonical_t *) buf,
+			       XXH3_128bits_digest(&dp->ctx.xxh3));
+      rlen = DIGEST_BUFSIZE_XXH128;
+      break;
+#else
+      errno = ENOSYS;
+      return -1;
+#endif
+
+    case DIGEST_TYPE_BLAKE3:
+      if (bufsize < DIGEST_BUFSIZE_BLAKE3) {
+	errno = EOVERFLOW;
+	return -1;
+      }
+#if defined(HAVE_BLAKE3_HASHER_INIT)
+      blake3_hasher_finalize(&dp->ctx.blake3, buf, DIGEST_BUFSIZE_BLAKE3);
+      rlen = DIGEST_BUFSIZE_BLAKE3;
+      break;
+#else
+      errno = ENOSYS;
+      return -1;
+#endif
+
 #if 0
     default:
       errno = EINVAL;
@@ -592,6 +743,80 @@ digest_destroy(DIGEST *dp) {
   dp->type  = DIGEST_TYPE_NONE;
 }
 
+int
+digest_combinable(DIGEST_TYPE type) {
+  switch (type) {
+  case DIGEST_TYPE_CRC32C:
+    return 1;
+#if defined(HAVE_CRC32_Z) && defined(HAVE_CRC32_COMBINE)
+  case DIGEST_TYPE_CRC32:
+    return 1;
+#endif
+#if defined(HAVE_ADLER32_Z) && defined(HAVE_ADLER32_COMBINE)
+  case DIGEST_TYPE_ADLER32:
+    return 1;
+#endif
+  default:
+    return 0;
+  }
+}
+
+int
+digest_combine(DIGEST *dp,
+	       DIGEST *next,
+	       off_t nlen) {
+  if (!dp || !next || dp->type != next->type) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  switch (dp->state) {
+  case DIGEST_STATE_INIT:
+  case DIGEST_STATE_UPDATE:
+    break;
+  default:
+    errno = EINVAL;
+    return -1;
+  }
+  
+  switch (next->state) {
+  case DIGEST_STATE_INIT:
+    /* Empty segment */
+    return 0;
+  case DIGEST_STATE_UPDATE:
+    break;
+  default:
+    errno = EINVAL;
+    return -1;
+  }
+  
+  switch (dp->type) {
+  case DIGEST_TYPE_CRC32C:
+    dp->ctx.crc32c = crc32c_combine(dp->ctx.crc32c, next->ctx.crc32c, nlen);
+    break;
+    
+#if defined(HAVE_CRC32_Z) && defined(HAVE_CRC32_COMBINE)
+  case DIGEST_TYPE_CRC32:
+    dp->ctx.crc32 = crc32_combine(dp->ctx.crc32, next->ctx.crc32, nlen);
+    break;
+#endif
+
+#if defined(HAVE_ADLER32_Z) && defined(HAVE_ADLER32_COMBINE)
+  case DIGEST_TYPE_ADLER32:
+    dp->ctx.adler32 = adler32_combine(dp->ctx.adler32, next->ctx.adler32, nlen);
+    break;
+#endif
+
+  default:
+    errno = ENOSYS;
+    return -1;
+  }
+
+  dp->state = DIGEST_STATE_UPDATE;
+  return 0;
+}
+
+
 DIGEST_TYPE
 digest_typeof(DIGEST *dp) {
   if (!dp)
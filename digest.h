@@ -71,6 +71,17 @@
 #include <nettle/sha3.h>
 #endif
 
+#if defined(HAVE_XXHASH_H)
+#define XXH_STATIC_LINKING_ONLY 1
+#include <xxhash.h>
+#endif
+
+#if defined(HAVE_BLAKE3_H)
+#include <blake3.h>
+#endif
+
+#include "crc32c.h"
+
 
 
 typedef enum {
@@ -84,9 +95,13 @@ typedef enum {
 	      DIGEST_TYPE_SHA256,
 	      DIGEST_TYPE_SHA512,
 	      DIGEST_TYPE_SHA3_256,
-	      DIGEST_TYPE_SHA3_512
+	      DIGEST_TYPE_SHA3_512,
+	      DIGEST_TYPE_CRC32C,
+	      DIGEST_TYPE_XXH3,
+	      DIGEST_TYPE_XXH128,
+	      DIGEST_TYPE_BLAKE3
 } DIGEST_TYPE;
-#define DIGEST_TYPE_LAST 11
+#define DIGEST_TYPE_LAST 15
 
 
 typedef enum {
@@ -140,6 +155,16 @@ typedef struct digest {
 #if defined(HAVE_NETTLE_SHA3_512_INIT)
     struct sha3_512_ctx sha3_512;
 #endif
+
+    uint32_t     crc32c;
+
+#if defined(HAVE_XXH3_64BITS_RESET) || defined(HAVE_XXH3_128BITS_RESET)
+    XXH3_state_t xxh3;
+#endif
+
+#if defined(HAVE_BLAKE3_HASHER_INIT)
+    blake3_hasher blake3;
+#endif
   } ctx;
 } DIGEST;
 
@@ -199,6 +224,16 @@ typedef struct digest {
 #define DIGEST_BUFSIZE_SHA3_512 64
 #endif
 
+#define DIGEST_BUFSIZE_CRC32C   sizeof(uint32_t)
+#define DIGEST_BUFSIZE_XXH3     sizeof(uint64_t)
+#define DIGEST_BUFSIZE_XXH128   (2*sizeof(uint64_t))
+
+#if defined(BLAKE3_OUT_LEN)
+#define DIGEST_BUFSIZE_BLAKE3   BLAKE3_OUT_LEN
+#else
+#define DIGEST_BUFSIZE_BLAKE3   32
+#endif
+
 #define DIGEST_BUFSIZE_MAX DIGEST_BUFSIZE_SHA3_512
 
 
@@ -220,6 +255,21 @@ digest_final(DIGEST *dp,
 	     size_t bufsize);
 
 
+/*
+ * Combinable digests (CRC32C, CRC32 & ADLER32) can be computed over
+ * separate segments of a file in parallel and then be merged in order.
+ * digest_combine() appends the (updated, not finalized) digest 'next'
+ * covering 'nlen' bytes to 'dp'.
+ */
+extern int
+digest_combinable(DIGEST_TYPE type);
+
+extern int
+digest_combine(DIGEST *dp,
+	       DIGEST *next,
+	       off_t nlen);
+
+
 extern DIGEST_TYPE
 digest_typeof(DIGEST *dp);
 
@@ -0,0 +1,222 @@
+/*
+ * intern.c - Shared copies of equal objects
+ * 
+ * Copyright (c) 2021, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "intern.h"
+
+
+#define INTERN_HSIZE_MIN 256
+
+
+INTERN *
+intern_create(unsigned long (*hash)(const void *obj),
+	      int (*cmp)(const void *a, const void *b),
+	      void (*ofree)(void *obj)) {
+  INTERN *ip;
+
+
+  ip = malloc(sizeof(*ip));
+  if (!ip)
+    return NULL;
+
+  memset(ip, 0, sizeof(*ip));
+  ip->hsize = INTERN_HSIZE_MIN;
+  ip->htab = calloc(ip->hsize, sizeof(*ip->htab));
+  if (!ip->htab) {
+    free(ip);
+    return NULL;
+  }
+  ip->hash = hash;
+  ip->cmp = cmp;
+  ip->ofree = ofree;
+#if defined(HAVE_PTHREAD_H)
+  pthread_mutex_init(&ip->mtx, NULL);
+#endif
+  return ip;
+}
+
+
+void
+intern_destroy(INTERN *ip) {
+  size_t i;
+  INTERNENT *ep, *next;
+
+
+  if (!ip)
+    return;
+
+  for (i = 0; i < ip->hsize; i++) {
+    for (ep = ip->htab[i]; ep; ep = next) {
+      next = ep->next;
+      if (ip->ofree)
+	ip->ofree(ep->obj);
+      free(ep);
+    }
+  }
+  free(ip->htab);
+#if defined(HAVE_PTHREAD_H)
+  pthread_mutex_destroy(&ip->mtx);
+#endif
+  free(ip);
+}
+
+
+static void
+intern_grow(INTERN *ip) {
+  INTERNENT **nt, *ep, *next;
+  size_t i, ns = ip->hsize*4;
+
+
+  nt = calloc(ns, sizeof(*nt));
+  if (!nt)
+    return; /* Just longer chains */
+
+  for (i = 0; i < ip->hsize; i++) {
+    for (ep = ip->htab[i]; ep; ep = next) {
+      next = ep->next;
+      ep->next = nt[ep->hash % ns];
+      nt[ep->hash % ns] = ep;
+    }
+  }
+  free(ip->htab);
+  ip->htab = nt;
+  ip->hsize = ns;
+}
+
+
+/*
+ * Return the shared copy of an object equal to obj (obj is freed), or
+ * make obj the shared copy. Every call must be paired with an
+ * intern_release() of the returned object.
+ *
+ * Returns NULL (with obj freed) if out of memory.
+ */
+void *
+intern_get(INTERN *ip,
+	   void *obj) {
+  INTERNENT *ep;
+  unsigned long h;
+
+
+  if (!ip || !obj)
+    return obj;
+
+  h = ip->hash(obj);
+
+#if defined(HAVE_PTHREAD_H)
+  pthread_mutex_lock(&ip->mtx);
+#endif
+  for (ep = ip->htab[h % ip->hsize]; ep; ep = ep->next) {
+    if (ep->hash == h && ip->cmp(ep->obj, obj) == 0)
+      break;
+  }
+  
+  if (ep) {
+    ep->refs++;
+#if defined(HAVE_PTHREAD_H)
+    pthread_mutex_unlock(&ip->mtx);
+#endif
+    if (ip->ofree)
+      ip->ofree(obj);
+    return ep->obj;
+  }
+
+  ep = malloc(sizeof(*ep));
+  if (!ep) {
+    /* Equal objects must be shared (callers compare pointers) - so fail */
+#if defined(HAVE_PTHREAD_H)
+    pthread_mutex_unlock(&ip->mtx);
+#endif
+    if (ip->ofree)
+      ip->ofree(obj);
+    errno = ENOMEM;
+    return NULL;
+  }
+  ep->obj = obj;
+  ep->hash = h;
+  ep->refs = 1;
+  ep->next = ip->htab[h % ip->hsize];
+  ip->htab[h % ip->hsize] = ep;
+  if (++ip->entries > ip->hsize)
+    intern_grow(ip);
+#if defined(HAVE_PTHREAD_H)
+  pthread_mutex_unlock(&ip->mtx);
+#endif
+  return obj;
+}
+
+
+/*
+ * Drop a reference to a shared object (and free it if it was the last)
+ */
+void
+intern_release(INTERN *ip,
+	       void *obj) {
+  INTERNENT *ep, **epp;
+  unsigned long h;
+
+
+  if (!ip || !obj)
+    return;
+
+  h = ip->hash(obj);
+  
+#if defined(HAVE_PTHREAD_H)
+  pthread_mutex_lock(&ip->mtx);
+#endif
+  for (epp = &ip->htab[h % ip->hsize]; (ep = *epp) != NULL; epp = &ep->next) {
+    if (ep->obj == obj)
+      break;
+  }
+  
+  if (ep && --ep->refs == 0) {
+    *epp = ep->next;
+    ip->entries--;
+  } else
+    ep = NULL;
+#if defined(HAVE_PTHREAD_H)
+  pthread_mutex_unlock(&ip->mtx);
+#endif
+
+  if (ep) {
+    if (ip->ofree)
+      ip->ofree(ep->obj);
+    free(ep);
+  }
+}
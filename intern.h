@@ -0,0 +1,82 @@
+/*
+ * intern.h - Shared copies of equal objects
+ * 
+ * Copyright (c) 2021, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef INTERN_H
+#define INTERN_H 1
+
+#include "config.h"
+
+#include <sys/types.h>
+
+#if defined(HAVE_PTHREAD_H)
+#include <pthread.h>
+#endif
+
+
+typedef struct internent {
+  struct internent *next;
+  void *obj;
+  unsigned long hash;
+  unsigned long refs;
+} INTERNENT;
+
+typedef struct intern {
+#if defined(HAVE_PTHREAD_H)
+  pthread_mutex_t mtx;
+#endif
+  INTERNENT **htab;
+  size_t hsize;
+  size_t entries;
+  unsigned long (*hash)(const void *obj);
+  int (*cmp)(const void *a, const void *b);
+  void (*ofree)(void *obj);
+} INTERN;
+
+
+extern INTERN *
+intern_create(unsigned long (*hash)(const void *obj),
+	      int (*cmp)(const void *a, const void *b),
+	      void (*ofree)(void *obj));
+
+extern void
+intern_destroy(INTERN *ip);
+
+extern void *
+intern_get(INTERN *ip,
+	   void *obj);
+
+extern void
+intern_release(INTERN *ip,
+	       void *obj);
+
+#endif
@@ -0,0 +1,295 @@
+/*
+ * iopace.c - I/O pacing & page cache hints
+ * 
+ * Copyright (c) 2021, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#if defined(HAVE_PTHREAD_H)
+#include <pthread.h>
+#endif
+
+#include "iopace.h"
+
+
+static uint64_t pace_bps = 0;
+static int pace_flags = 0;
+static struct timespec pace_next;	/* When the next byte may be transferred */
+
+#if defined(HAVE_PTHREAD_H)
+static pthread_mutex_t pace_mtx = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+
+
+/*
+ * Set the bandwidth limit (bytes/s, 0 = none) shared by all threads
+ * and the page cache handling (IOPACE_F_*)
+ */
+void
+iopace_init(uint64_t bps,
+	    int flags) {
+  pace_bps = bps;
+  pace_flags = flags;
+  clock_gettime(CLOCK_MONOTONIC, &pace_next);
+}
+
+
+int
+iopace_limited(void) {
+  return pace_bps > 0;
+}
+
+
+/*
+ * Account for 'len' bytes against the bandwidth limit, sleeping until
+ * they fit. The time slots are reserved under the lock and the sleeping
+ * is done outside it, so all threads together stay below the limit.
+ */
+static void
+iopace_wait(off_t len) {
+  struct timespec now, until;
+  uint64_t ns;
+
+  
+  if (!pace_bps || len <= 0)
+    return;
+
+  ns = (uint64_t) len * 1000000000 / pace_bps;
+  
+  clock_gettime(CLOCK_MONOTONIC, &now);
+#if defined(HAVE_PTHREAD_H)
+  pthread_mutex_lock(&pace_mtx);
+#endif
+  /* Don't save up credit while idle */
+  if (pace_next.tv_sec < now.tv_sec ||
+      (pace_next.tv_sec == now.tv_sec && pace_next.tv_nsec < now.tv_nsec))
+    pace_next = now;
+  until = pace_next;
+  pace_next.tv_sec += ns / 1000000000;
+  pace_next.tv_nsec += ns % 1000000000;
+  if (pace_next.tv_nsec >= 1000000000) {
+    pace_next.tv_sec++;
+    pace_next.tv_nsec -= 1000000000;
+  }
+#if defined(HAVE_PTHREAD_H)
+  pthread_mutex_unlock(&pace_mtx);
+#endif
+
+  /* (No clock_nanosleep() everywhere) */
+  while (now.tv_sec < until.tv_sec ||
+	 (now.tv_sec == until.tv_sec && now.tv_nsec < until.tv_nsec)) {
+    struct timespec ts;
+
+    ts.tv_sec = until.tv_sec - now.tv_sec;
+    ts.tv_nsec = until.tv_nsec - now.tv_nsec;
+    if (ts.tv_nsec < 0) {
+      ts.tv_sec--;
+      ts.tv_nsec += 1000000000;
+    }
+    (void) nanosleep(&ts, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+  }
+}
+
+
+/*
+ * Start reading src_fd (and writing dst_fd) sequentially from 'off'
+ */
+void
+iopace_start(IOWINDOW *wp,
+	     int src_fd,
+	     int dst_fd,
+	     off_t off) {
+  wp->src_fd = src_fd;
+  wp->dst_fd = dst_fd;
+  wp->pos = wp->flushed = wp->released = off;
+  wp->direct = 0;
+
+  if (src_fd < 0)
+    return;
+  
+  if (pace_flags & IOPACE_F_DIRECT) {
+#if defined(O_DIRECT)
+    int fl = fcntl(src_fd, F_GETFL);
+    
+    /* Not all filesystems support it - then just go via the cache */
+    if (fl >= 0 && fcntl(src_fd, F_SETFL, fl|O_DIRECT) == 0)
+      wp->direct = 1;
+#elif defined(F_NOCACHE)
+    (void) fcntl(src_fd, F_NOCACHE, 1);
+#endif
+  }
+  
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_SEQUENTIAL)
+  (void) posix_fadvise(src_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+}
+
+
+/*
+ * O_DIRECT reads must be block aligned. If [off, off+len) isn't
+ * (typically the tail of a file) then read via the page cache from
+ * here on. Reads already in flight are not affected.
+ */
+void
+iopace_align(IOWINDOW *wp,
+	     off_t off,
+	     size_t len) {
+#if defined(O_DIRECT)
+  int fl;
+
+  
+  if (!wp->direct || ((off | (off_t) len) & (IOPACE_ALIGN-1)) == 0)
+    return;
+  
+  fl = fcntl(wp->src_fd, F_GETFL);
+  if (fl >= 0)
+    (void) fcntl(wp->src_fd, F_SETFL, fl & ~O_DIRECT);
+  wp->direct = 0;
+#else
+  (void) wp;
+  (void) off;
+  (void) len;
+#endif
+}
+
+
+/*
+ * Drop [released, off) from the page cache. Dirty destination pages
+ * are waited for first (their writeback was started one window ago).
+ */
+static void
+iopace_release(IOWINDOW *wp,
+	       off_t off) {
+  off_t len = off - wp->released;
+
+  
+  if (len <= 0)
+    return;
+  
+#if defined(HAVE_SYNC_FILE_RANGE)
+  if (wp->dst_fd >= 0)
+    (void) sync_file_range(wp->dst_fd, wp->released, len,
+			   SYNC_FILE_RANGE_WAIT_BEFORE|SYNC_FILE_RANGE_WRITE|SYNC_FILE_RANGE_WAIT_AFTER);
+#endif
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_DONTNEED)
+  (void) posix_fadvise(wp->src_fd, wp->released, len, POSIX_FADV_DONTNEED);
+  if (wp->dst_fd >= 0)
+    (void) posix_fadvise(wp->dst_fd, wp->released, len, POSIX_FADV_DONTNEED);
+#endif
+  wp->released = off;
+}
+
+
+/*
+ * The data up to 'off' has been transferred
+ */
+void
+iopace_update(IOWINDOW *wp,
+	      off_t off) {
+  if (off > wp->pos) {
+    iopace_wait(off - wp->pos);
+    wp->pos = off;
+  }
+
+  if (!(pace_flags & IOPACE_F_NOCACHE) || off - wp->flushed < IOPACE_WINDOW)
+    return;
+
+  /* The previous window should be on disk by now */
+  iopace_release(wp, wp->flushed);
+
+#if defined(HAVE_SYNC_FILE_RANGE)
+  /* Start writing this one out, without waiting */
+  if (wp->dst_fd >= 0)
+    (void) sync_file_range(wp->dst_fd, wp->flushed, off - wp->flushed, SYNC_FILE_RANGE_WRITE);
+#endif
+  wp->flushed = off;
+}
+
+
+/*
+ * Done with the file (before the descriptors are closed)
+ */
+void
+iopace_end(IOWINDOW *wp) {
+  if (wp->src_fd < 0 || !(pace_flags & IOPACE_F_NOCACHE))
+    return;
+
+  iopace_release(wp, wp->flushed);
+  
+  /* The last window is not waited for - only what is clean gets dropped */
+#if defined(HAVE_SYNC_FILE_RANGE)
+  if (wp->dst_fd >= 0 && wp->pos > wp->flushed)
+    (void) sync_file_range(wp->dst_fd, wp->flushed, wp->pos - wp->flushed, SYNC_FILE_RANGE_WRITE);
+#endif
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_DONTNEED)
+  (void) posix_fadvise(wp->src_fd, 0, 0, POSIX_FADV_DONTNEED);
+  if (wp->dst_fd >= 0)
+    (void) posix_fadvise(wp->dst_fd, wp->flushed, 0, POSIX_FADV_DONTNEED);
+#endif
+}
+
+
+/*
+ * Start reading in the beginning of a file that will be needed soon
+ */
+void
+iopace_willneed(int dfd,
+		const char *name,
+		off_t size) {
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_WILLNEED)
+  int fd;
+
+  
+  if ((pace_flags & IOPACE_F_DIRECT) || size <= 0)
+    return;
+  
+  fd = openat(dfd, name, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+  if (fd < 0)
+    return;
+  (void) posix_fadvise(fd, 0, size < IOPACE_READAHEAD ? size : IOPACE_READAHEAD, POSIX_FADV_WILLNEED);
+  close(fd);
+#else
+  (void) dfd;
+  (void) name;
+  (void) size;
+#endif
+}
@@ -0,0 +1,93 @@
+/*
+ * iopace.h - I/O pacing & page cache hints
+ * 
+ * Copyright (c) 2021, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef IOPACE_H
+#define IOPACE_H 1
+
+#include <stdint.h>
+#include <sys/types.h>
+
+
+#define IOPACE_F_NOCACHE 0x0001	/* Keep the data out of the page cache */
+#define IOPACE_F_DIRECT  0x0002	/* Bypass the page cache for reads (O_DIRECT) */
+
+#define IOPACE_WINDOW    (8*1024*1024)	/* Write-behind & cache release granularity */
+#define IOPACE_READAHEAD (4*1024*1024)	/* Max readahead for the next file */
+#define IOPACE_ALIGN     4096		/* O_DIRECT offset & length alignment */
+
+
+/*
+ * Progress of one file being read (and possibly written) sequentially
+ */
+typedef struct iowindow {
+  int src_fd;
+  int dst_fd;		/* -1 if only reading */
+  off_t pos;		/* Bytes accounted for the bandwidth limit up to here */
+  off_t flushed;	/* Writeback started up to here */
+  off_t released;	/* Dropped from the page cache up to here */
+  int direct;		/* src_fd has O_DIRECT set */
+} IOWINDOW;
+
+
+extern void
+iopace_init(uint64_t bps,
+	    int flags);
+
+extern void
+iopace_start(IOWINDOW *wp,
+	     int src_fd,
+	     int dst_fd,
+	     off_t off);
+
+extern void
+iopace_align(IOWINDOW *wp,
+	     off_t off,
+	     size_t len);
+
+extern void
+iopace_update(IOWINDOW *wp,
+	      off_t off);
+
+extern void
+iopace_end(IOWINDOW *wp);
+
+extern void
+iopace_willneed(int dfd,
+		const char *name,
+		off_t size);
+
+extern int
+iopace_limited(void);
+
+#endif
@@ -0,0 +1,300 @@
+/*
+ * jobs.c - Worker thread pool
+ * 
+ * Copyright (c) 2021, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "jobs.h"
+
+
+
+/*
+ * Mark a job as finished in its group and wake up any waiters
+ */
+static void
+jobgroup_done(JOBGROUP *gp,
+	      int rc) {
+  if (!gp)
+    return;
+
+#if defined(HAVE_PTHREAD_H)
+  pthread_mutex_lock(&gp->mtx);
+#endif
+  if (rc < 0 && gp->rc == 0)
+    gp->rc = rc;
+  if (--gp->pending == 0) {
+#if defined(HAVE_PTHREAD_H)
+    pthread_cond_broadcast(&gp->cv);
+#endif
+  }
+#if defined(HAVE_PTHREAD_H)
+  pthread_mutex_unlock(&gp->mtx);
+#endif
+}
+
+
+static void
+job_run(JOB *jp) {
+  int rc;
+
+  rc = jp->fun(jp->arg);
+  if (jp->afree)
+    jp->afree(jp->arg);
+  jobgroup_done(jp->group, rc);
+  free(jp);
+}
+
+
+#if defined(HAVE_PTHREAD_H)
+static void *
+jobpool_worker(void *vp) {
+  JOBPOOL *pp = (JOBPOOL *) vp;
+  JOB *jp;
+
+
+  pthread_mutex_lock(&pp->mtx);
+  for (;;) {
+    while (!pp->head && !pp->shutdown)
+      pthread_cond_wait(&pp->cv_work, &pp->mtx);
+
+    jp = pp->head;
+    if (!jp)
+      break; /* Shutdown and queue is drained */
+
+    pp->head = jp->next;
+    if (!pp->head)
+      pp->tail = NULL;
+    if (pp->queued-- == pp->max_queued)
+      pthread_cond_signal(&pp->cv_room);
+
+    pthread_mutex_unlock(&pp->mtx);
+    job_run(jp);
+    pthread_mutex_lock(&pp->mtx);
+  }
+  pthread_mutex_unlock(&pp->mtx);
+
+  return NULL;
+}
+#endif
+
+
+
+/* --- Public functions -------------------------------------------------- */
+
+JOBPOOL *
+jobpool_create(int nworkers) {
+#if defined(HAVE_PTHREAD_H)
+  JOBPOOL *pp;
+  int i, rc;
+
+
+  if (nworkers < 1) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  pp = malloc(sizeof(*pp));
+  if (!pp)
+    return NULL;
+
+  memset(pp, 0, sizeof(*pp));
+
+  pp->tv = calloc(nworkers, sizeof(pp->tv[0]));
+  if (!pp->tv) {
+    free(pp);
+    return NULL;
+  }
+
+  /* Limit the number of queued jobs so the tree walk can't run away from us */
+  pp->max_queued = nworkers*4;
+
+  pthread_mutex_init(&pp->mtx, NULL);
+  pthread_cond_init(&pp->cv_work, NULL);
+  pthread_cond_init(&pp->cv_room, NULL);
+
+  for (i = 0; i < nworkers; i++) {
+    rc = pthread_create(&pp->tv[i], NULL, jobpool_worker, pp);
+    if (rc) {
+      errno = rc;
+      break;
+    }
+    pp->tc++;
+  }
+
+  if (pp->tc < nworkers) {
+    int saved_errno = errno;
+
+    jobpool_destroy(pp);
+    errno = saved_errno;
+    return NULL;
+  }
+
+  return pp;
+#else
+  errno = ENOSYS;
+  return NULL;
+#endif
+}
+
+
+/*
+ * Wait for all queued jobs to finish and then stop the worker threads
+ */
+void
+jobpool_destroy(JOBPOOL *pp) {
+#if defined(HAVE_PTHREAD_H)
+  int i;
+
+
+  if (!pp)
+    return;
+
+  pthread_mutex_lock(&pp->mtx);
+  pp->shutdown = 1;
+  pthread_cond_broadcast(&pp->cv_work);
+  pthread_mutex_unlock(&pp->mtx);
+
+  for (i = 0; i < pp->tc; i++)
+    pthread_join(pp->tv[i], NULL);
+
+  pthread_cond_destroy(&pp->cv_room);
+  pthread_cond_destroy(&pp->cv_work);
+  pthread_mutex_destroy(&pp->mtx);
+
+  free(pp->tv);
+  free(pp);
+#endif
+}
+
+
+/*
+ * Queue a job in the pool. If 'pp' is NULL then the job is run directly.
+ *
+ * 'afree' (if non-NULL) is called to release 'arg' after the job has run.
+ */
+int
+jobpool_add(JOBPOOL *pp,
+	    JOBGROUP *gp,
+	    int (*fun)(void *arg),
+	    void (*afree)(void *arg),
+	    void *arg) {
+  JOB *jp;
+
+
+  jp = malloc(sizeof(*jp));
+  if (!jp)
+    return -1;
+
+  jp->next  = NULL;
+  jp->group = gp;
+  jp->fun   = fun;
+  jp->afree = afree;
+  jp->arg   = arg;
+
+  if (gp) {
+#if defined(HAVE_PTHREAD_H)
+    pthread_mutex_lock(&gp->mtx);
+#endif
+    gp->pending++;
+#if defined(HAVE_PTHREAD_H)
+    pthread_mutex_unlock(&gp->mtx);
+#endif
+  }
+
+#if defined(HAVE_PTHREAD_H)
+  if (pp) {
+    pthread_mutex_lock(&pp->mtx);
+    while (pp->queued >= pp->max_queued)
+      pthread_cond_wait(&pp->cv_room, &pp->mtx);
+
+    if (pp->tail)
+      pp->tail->next = jp;
+    else
+      pp->head = jp;
+    pp->tail = jp;
+    pp->queued++;
+
+    pthread_cond_signal(&pp->cv_work);
+    pthread_mutex_unlock(&pp->mtx);
+    return 0;
+  }
+#endif
+
+  job_run(jp);
+  return 0;
+}
+
+
+void
+jobgroup_init(JOBGROUP *gp) {
+  memset(gp, 0, sizeof(*gp));
+#if defined(HAVE_PTHREAD_H)
+  pthread_mutex_init(&gp->mtx, NULL);
+  pthread_cond_init(&gp->cv, NULL);
+#endif
+}
+
+
+/*
+ * Wait for all jobs in a group to finish.
+ * Returns: the first error returned by a job, or 0
+ */
+int
+jobgroup_wait(JOBGROUP *gp) {
+  int rc;
+
+#if defined(HAVE_PTHREAD_H)
+  pthread_mutex_lock(&gp->mtx);
+  while (gp->pending > 0)
+    pthread_cond_wait(&gp->cv, &gp->mtx);
+  rc = gp->rc;
+  pthread_mutex_unlock(&gp->mtx);
+#else
+  rc = gp->rc;
+#endif
+
+  return rc;
+}
+
+
+void
+jobgroup_destroy(JOBGROUP *gp) {
+#if defined(HAVE_PTHREAD_H)
+  pthread_cond_destroy(&gp->cv);
+  pthread_mutex_destroy(&gp->mtx);
+#endif
+}
@@ -0,0 +1,105 @@
+/*
+ * jobs.h - Worker thread pool
+ * 
+ * Copyright (c) 2021, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef JOBS_H
+#define JOBS_H 1
+
+#include "config.h"
+
+#if defined(HAVE_PTHREAD_H)
+#include <pthread.h>
+#endif
+
+
+/*
+ * A group of jobs that can be waited for as a unit
+ */
+typedef struct jobgroup {
+#if defined(HAVE_PTHREAD_H)
+  pthread_mutex_t mtx;
+  pthread_cond_t  cv;
+#endif
+  unsigned int pending;	/* Jobs queued or running */
+  int rc;		/* First error returned by a job */
+} JOBGROUP;
+
+
+typedef struct job {
+  struct job *next;
+  JOBGROUP *group;
+  int (*fun)(void *arg);
+  void (*afree)(void *arg);
+  void *arg;
+} JOB;
+
+
+typedef struct jobpool {
+#if defined(HAVE_PTHREAD_H)
+  pthread_mutex_t mtx;
+  pthread_cond_t  cv_work;	/* New job queued or shutdown */
+  pthread_cond_t  cv_room;	/* Queue no longer full */
+  pthread_t *tv;
+#endif
+  int tc;			/* Number of worker threads */
+  JOB *head;
+  JOB *tail;
+  unsigned int queued;
+  unsigned int max_queued;
+  int shutdown;
+} JOBPOOL;
+
+
+extern JOBPOOL *
+jobpool_create(int nworkers);
+
+extern void
+jobpool_destroy(JOBPOOL *jp);
+
+extern int
+jobpool_add(JOBPOOL *jp,
+	    JOBGROUP *gp,
+	    int (*fun)(void *arg),
+	    void (*afree)(void *arg),
+	    void *arg);
+
+
+extern void
+jobgroup_init(JOBGROUP *gp);
+
+extern int
+jobgroup_wait(JOBGROUP *gp);
+
+extern void
+jobgroup_destroy(JOBGROUP *gp);
+
+#endif
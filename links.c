@@ -0,0 +1,203 @@
+/*
+ * links.c - Hard link tracking
+ * 
+ * Copyright (c) 2021, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "links.h"
+
+
+/*
+ * Map from source (st_dev, st_ino) to the destination of the first
+ * name seen for multiply linked files. An entry is dropped again once
+ * all names of the inode have been seen, so only inodes with links
+ * still "in flight" are kept. Not locked - only the thread doing the
+ * directory traversal uses it.
+ */
+
+#define LINKMAP_HSIZE_MIN 256
+
+
+static size_t
+linkmap_hash(LINKMAP *lmp,
+	     dev_t dev,
+	     ino_t ino) {
+  unsigned long long h = (unsigned long long) ino * 0x9E3779B97F4A7C15ULL;
+
+  h ^= (unsigned long long) dev;
+  return (size_t) (h % lmp->hsize);
+}
+
+
+LINKMAP *
+linkmap_create(void) {
+  LINKMAP *lmp;
+
+
+  lmp = malloc(sizeof(*lmp));
+  if (!lmp)
+    return NULL;
+
+  memset(lmp, 0, sizeof(*lmp));
+  lmp->hsize = LINKMAP_HSIZE_MIN;
+  lmp->htab = calloc(lmp->hsize, sizeof(*lmp->htab));
+  if (!lmp->htab) {
+    free(lmp);
+    return NULL;
+  }
+  return lmp;
+}
+
+
+void
+linkmap_destroy(LINKMAP *lmp) {
+  size_t i;
+  LINK *lp, *next;
+
+
+  if (!lmp)
+    return;
+
+  for (i = 0; i < lmp->hsize; i++) {
+    for (lp = lmp->htab[i]; lp; lp = next) {
+      next = lp->next;
+      free(lp);
+    }
+  }
+  free(lmp->htab);
+  free(lmp);
+}
+
+
+static void
+linkmap_grow(LINKMAP *lmp) {
+  LINK **ot, *lp, *next;
+  size_t i, os = lmp->hsize;
+
+
+  ot = lmp->htab;
+  lmp->htab = calloc(os*4, sizeof(*lmp->htab));
+  if (!lmp->htab) {
+    lmp->htab = ot;
+    return; /* Just longer chains */
+  }
+  lmp->hsize = os*4;
+
+  for (i = 0; i < os; i++) {
+    for (lp = ot[i]; lp; lp = next) {
+      size_t h = linkmap_hash(lmp, lp->dev, lp->ino);
+
+      next = lp->next;
+      lp->next = lmp->htab[h];
+      lmp->htab[h] = lp;
+    }
+  }
+  free(ot);
+}
+
+
+LINK *
+linkmap_lookup(LINKMAP *lmp,
+	       dev_t dev,
+	       ino_t ino) {
+  LINK *lp;
+
+
+  for (lp = lmp->htab[linkmap_hash(lmp, dev, ino)]; lp; lp = lp->next) {
+    if (lp->ino == ino && lp->dev == dev)
+      return lp;
+  }
+  return NULL;
+}
+
+
+/*
+ * Record the first name of an inode with nlink names
+ */
+LINK *
+linkmap_add(LINKMAP *lmp,
+	    dev_t dev,
+	    ino_t ino,
+	    nlink_t nlink,
+	    const char *path) {
+  LINK *lp;
+  size_t h, len = strlen(path);
+
+
+  lp = malloc(sizeof(*lp)+len+1);
+  if (!lp)
+    return NULL;
+
+  memset(lp, 0, sizeof(*lp));
+  lp->dev = dev;
+  lp->ino = ino;
+  lp->left = nlink > 0 ? nlink-1 : 0;
+  memcpy(lp->path, path, len+1);
+
+  h = linkmap_hash(lmp, dev, ino);
+  lp->next = lmp->htab[h];
+  lmp->htab[h] = lp;
+  if (++lmp->entries > lmp->hsize)
+    linkmap_grow(lmp);
+  return lp;
+}
+
+
+/*
+ * One more name of the inode has been handled - forget it after the last one
+ */
+void
+linkmap_seen(LINKMAP *lmp,
+	     LINK *lp) {
+  LINK **lpp;
+
+
+  if (lp->left > 1) {
+    lp->left--;
+    return;
+  }
+
+  for (lpp = &lmp->htab[linkmap_hash(lmp, lp->dev, lp->ino)]; *lpp; lpp = &(*lpp)->next) {
+    if (*lpp == lp) {
+      *lpp = lp->next;
+      lmp->entries--;
+      free(lp);
+      return;
+    }
+  }
+}
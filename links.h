@@ -0,0 +1,87 @@
+/*
+ * links.h - Hard link tracking
+ * 
+ * Copyright (c) 2021, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef LINKS_H
+#define LINKS_H 1
+
+#include "config.h"
+
+#include <sys/types.h>
+
+
+/*
+ * A source inode with more than one name, and where its first name
+ * went in the destination
+ */
+typedef struct link {
+  struct link *next;
+  dev_t dev;
+  ino_t ino;
+  nlink_t left;		/* Names not seen yet */
+  dev_t ddev;		/* Destination inode (if dvalid) */
+  ino_t dino;
+  int dvalid;
+  char path[];		/* Destination path of the first name */
+} LINK;
+
+typedef struct linkmap {
+  LINK **htab;
+  size_t hsize;
+  size_t entries;
+} LINKMAP;
+
+
+extern LINKMAP *
+linkmap_create(void);
+
+extern void
+linkmap_destroy(LINKMAP *lmp);
+
+extern LINK *
+linkmap_lookup(LINKMAP *lmp,
+	       dev_t dev,
+	       ino_t ino);
+
+extern LINK *
+linkmap_add(LINKMAP *lmp,
+	    dev_t dev,
+	    ino_t ino,
+	    nlink_t nlink,
+	    const char *path);
+
+extern void
+linkmap_seen(LINKMAP *lmp,
+	     LINK *lp);
+
+#endif
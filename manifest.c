@@ -0,0 +1,614 @@
+/*
+ * manifest.c - Binary tree manifests
+ * 
+ * Copyright (c) 2021, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "manifest.h"
+#include "misc.h"
+
+
+/*
+ * A manifest records the scanned source tree (what the destination should
+ * look like after a run) so a later run can compare against it instead of
+ * reading the destination. The entries are written a directory at a time
+ * as the tree is traversed: a directory's record gets pointed at its block
+ * of entry records once that directory is reached. The file can be used
+ * directly from an mmap() when read back.
+ *
+ * The path "-" writes to standard output (or reads from standard input),
+ * going through an anonymous temporary file, so manifests can be passed
+ * through pipes (e.g. "ssh host pc -W - dir").
+ */
+
+
+/*
+ * Copy from the current position of 'from' until end of file
+ */
+static int
+manifest_fdcopy(int from,
+		int to) {
+  char buf[65536];
+  ssize_t len, wlen, rc;
+
+  
+  while ((len = read(from, buf, sizeof(buf))) > 0) {
+    for (wlen = 0; wlen < len; wlen += rc) {
+      rc = write(to, buf+wlen, len-wlen);
+      if (rc < 0) {
+	if (errno == EINTR) {
+	  rc = 0;
+	  continue;
+	}
+	return -1;
+      }
+    }
+  }
+  return len < 0 ? -1 : 0;
+}
+
+
+static void
+manifest_fdclose(MANIFEST *mp) {
+  if (mp->tmpfp) {
+    fclose(mp->tmpfp);
+    mp->tmpfp = NULL;
+  } else if (mp->fd >= 0)
+    close(mp->fd);
+  mp->fd = -1;
+}
+
+static void
+manifest_abort(MANIFEST *mp) {
+  if (mp->strfp)
+    fclose(mp->strfp);
+  manifest_fdclose(mp);
+  if (mp->tmppath) {
+    (void) unlink(mp->tmppath);
+    free(mp->tmppath);
+  }
+  if (mp->pending)
+    btree_destroy(mp->pending);
+  free(mp->path);
+  free(mp);
+}
+
+
+static int
+manifest_rec_write(MANIFEST *mp,
+		   int64_t idx,
+		   const MANIFEST_REC *rp) {
+  off_t off = sizeof(MANIFEST_HEADER) + (off_t) idx * sizeof(*rp);
+
+  if (pwrite(mp->fd, rp, sizeof(*rp), off) != sizeof(*rp)) {
+    mp->error = errno ? errno : EIO;
+    return -1;
+  }
+  return 0;
+}
+
+
+static int
+manifest_rec_read(MANIFEST *mp,
+		  int64_t idx,
+		  MANIFEST_REC *rp) {
+  off_t off = sizeof(MANIFEST_HEADER) + (off_t) idx * sizeof(*rp);
+
+  if (pread(mp->fd, rp, sizeof(*rp), off) != sizeof(*rp)) {
+    mp->error = errno ? errno : EIO;
+    return -1;
+  }
+  return 0;
+}
+
+
+/*
+ * Append to the string table, returning the offset (0 if nothing)
+ */
+static uint64_t
+manifest_str_add(MANIFEST *mp,
+		 const void *buf,
+		 size_t len,
+		 int nul_f) {
+  uint64_t off = mp->strsize;
+
+  
+  if (!buf)
+    return 0;
+
+  if (fwrite(buf, 1, len, mp->strfp) != len ||
+      (nul_f && putc('\0', mp->strfp) == EOF)) {
+    mp->error = errno ? errno : EIO;
+    return 0;
+  }
+  mp->strsize += len + (nul_f ? 1 : 0);
+  return off;
+}
+
+
+MANIFEST *
+manifest_create(const char *path,
+		int digest) {
+  MANIFEST *mp;
+  MANIFEST_REC root;
+
+  
+  mp = malloc(sizeof(*mp));
+  if (!mp)
+    return NULL;
+  memset(mp, 0, sizeof(*mp));
+  mp->fd = -1;
+  mp->digest = digest;
+  
+  mp->path = strdup(path);
+  mp->pending = btree_create(NULL, free);
+  if (!mp->path || !mp->pending)
+    goto Fail;
+
+  if (strcmp(path, "-") == 0) {
+    mp->tmpfp = tmpfile();
+    if (!mp->tmpfp)
+      goto Fail;
+    mp->fd = fileno(mp->tmpfp);
+  } else {
+    mp->tmppath = strdupcat(path, ".tmp", NULL);
+    if (!mp->tmppath)
+      goto Fail;
+    mp->fd = open(mp->tmppath, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+    if (mp->fd < 0)
+      goto Fail;
+  }
+
+  mp->strfp = tmpfile();
+  if (!mp->strfp)
+    goto Fail;
+
+  /* Offset 0 is the empty string (and means "none") */
+  if (putc('\0', mp->strfp) == EOF)
+    goto Fail;
+  mp->strsize = 1;
+
+  memset(&root, 0, sizeof(root));
+  root.mode = S_IFDIR;
+  if (manifest_rec_write(mp, 0, &root) < 0)
+    goto Fail;
+  mp->nrecs = 1;
+  
+  return mp;
+
+ Fail:
+  manifest_abort(mp);
+  return NULL;
+}
+
+
+/*
+ * Reserve the records for the 'nent' entries of the directory at 'path'
+ * (the first call is for the root directory). Returns the index of the
+ * first, or -1 (with errno ENOENT) if the directory isn't part of the tree.
+ */
+int64_t
+manifest_dir(MANIFEST *mp,
+	     const char *path,
+	     size_t nent) {
+  int64_t *pp = NULL;
+  MANIFEST_REC dir;
+  int64_t pidx, base;
+
+
+  if (!mp->rooted) {
+    pidx = 0;
+    mp->rooted = 1;
+  } else {
+    if (btree_search(mp->pending, path, (void **) &pp) < 0 || !pp) {
+      errno = ENOENT;
+      return -1;
+    }
+    pidx = *pp;
+    btree_delete(mp->pending, path);
+  }
+
+  if (manifest_rec_read(mp, pidx, &dir) < 0)
+    return -1;
+
+  base = mp->nrecs;
+  mp->nrecs += nent;
+  
+  dir.child = base;
+  dir.nchild = nent;
+  dir.f |= MANIFEST_F_LISTED;
+  if (manifest_rec_write(mp, pidx, &dir) < 0)
+    return -1;
+  
+  return base;
+}
+
+
+/*
+ * Remember where the record of a directory is until its entries are written
+ */
+int
+manifest_pending(MANIFEST *mp,
+		 const char *path,
+		 int64_t idx) {
+  int64_t *pp;
+  char *key;
+
+
+  /* The tree owns (and frees) both - also if the insert fails */
+  key = strdup(path);
+  pp = malloc(sizeof(*pp));
+  if (!key || !pp) {
+    free(key);
+    free(pp);
+    return -1;
+  }
+  *pp = idx;
+  
+  return btree_insert(mp->pending, key, pp);
+}
+
+
+int
+manifest_put(MANIFEST *mp,
+	     int64_t idx,
+	     const char *name,
+	     const NSTAT *sp,
+	     const char *link,
+	     const unsigned char *digest,
+	     size_t dlen,
+	     uint64_t acls,
+	     uint64_t attrs) {
+  MANIFEST_REC r;
+
+
+  memset(&r, 0, sizeof(r));
+  r.name = manifest_str_add(mp, name, strlen(name), 1);
+  if (link)
+    r.link = manifest_str_add(mp, link, strlen(link), 1);
+  if (digest && dlen > 0) {
+    r.digest = manifest_str_add(mp, digest, dlen, 0);
+    r.dlen = dlen;
+  }
+
+  r.mode = sp->st_mode;
+  r.uid = sp->st_uid;
+  r.gid = sp->st_gid;
+  r.nlink = sp->st_nlink;
+  r.size = sp->st_size;
+  r.dev = sp->st_dev;
+  r.ino = sp->st_ino;
+#if defined(HAVE_LCHFLAGS) || defined(UF_ARCHIVE)
+  r.flags = sp->st_flags;
+#endif
+#if !defined(st_mtime)
+  r.atime = sp->st_atime;
+  r.mtime = sp->st_mtime;
+#elif defined(__APPLE__)
+  r.atime = sp->st_atimespec.tv_sec;
+  r.atime_ns = sp->st_atimespec.tv_nsec;
+  r.mtime = sp->st_mtimespec.tv_sec;
+  r.mtime_ns = sp->st_mtimespec.tv_nsec;
+#else
+  r.atime = sp->st_atim.tv_sec;
+  r.atime_ns = sp->st_atim.tv_nsec;
+  r.mtime = sp->st_mtim.tv_sec;
+  r.mtime_ns = sp->st_mtim.tv_nsec;
+#endif
+  r.acls = acls;
+  r.attrs = attrs;
+  
+  return mp->error ? -1 : manifest_rec_write(mp, idx, &r);
+}
+
+
+/*
+ * Finish a manifest being written, or release one being read
+ */
+int
+manifest_close(MANIFEST *mp) {
+  MANIFEST_HEADER h;
+  char buf[65536];
+  size_t len;
+  off_t off;
+  int rc = 0;
+
+  
+  if (!mp)
+    return 0;
+
+  if (mp->map) {
+    munmap(mp->map, mp->mapsize);
+    manifest_fdclose(mp);
+    free(mp->path);
+    free(mp);
+    return 0;
+  }
+
+  /* Terminate the last string (digests aren't) */
+  if (putc('\0', mp->strfp) == EOF || fflush(mp->strfp) == EOF)
+    mp->error = errno ? errno : EIO;
+  mp->strsize++;
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, MANIFEST_MAGIC, sizeof(h.magic));
+  h.version = MANIFEST_VERSION;
+  h.byteorder = MANIFEST_BYTEORDER;
+  h.digest = mp->digest;
+  h.nrecs = mp->nrecs;
+  h.recoff = sizeof(h);
+  h.stroff = h.recoff + mp->nrecs * sizeof(MANIFEST_REC);
+  h.strsize = mp->strsize;
+
+  rewind(mp->strfp);
+  off = h.stroff;
+  while (!mp->error && (len = fread(buf, 1, sizeof(buf), mp->strfp)) > 0) {
+    if (pwrite(mp->fd, buf, len, off) != (ssize_t) len)
+      mp->error = errno ? errno : EIO;
+    off += len;
+  }
+  if (!mp->error && ferror(mp->strfp))
+    mp->error = EIO;
+
+  if (!mp->error && pwrite(mp->fd, &h, sizeof(h), 0) != sizeof(h))
+    mp->error = errno ? errno : EIO;
+  
+  if (mp->tmpfp) {
+    if (!mp->error &&
+	(lseek(mp->fd, 0, SEEK_SET) < 0 || manifest_fdcopy(mp->fd, STDOUT_FILENO) < 0))
+      mp->error = errno ? errno : EIO;
+  } else {
+    if (!mp->error && close(mp->fd) < 0)
+      mp->error = errno;
+    mp->fd = -1;
+  
+    if (!mp->error && rename(mp->tmppath, mp->path) < 0)
+      mp->error = errno;
+  }
+
+  if (mp->error) {
+    errno = mp->error;
+    rc = -1;
+  } else {
+    free(mp->tmppath);
+    mp->tmppath = NULL;
+  }
+  manifest_abort(mp);
+  return rc;
+}
+
+
+MANIFEST *
+manifest_open(const char *path) {
+  MANIFEST *mp;
+  struct stat sb;
+  const MANIFEST_HEADER *hp;
+
+  
+  mp = malloc(sizeof(*mp));
+  if (!mp)
+    return NULL;
+  memset(mp, 0, sizeof(*mp));
+  
+  mp->fd = -1;
+  mp->path = strdup(path);
+  if (!mp->path)
+    goto Fail;
+  
+  if (strcmp(path, "-") == 0) {
+    mp->tmpfp = tmpfile();
+    if (!mp->tmpfp)
+      goto Fail;
+    mp->fd = fileno(mp->tmpfp);
+    if (manifest_fdcopy(STDIN_FILENO, mp->fd) < 0)
+      goto Fail;
+  } else
+    mp->fd = open(path, O_RDONLY|O_CLOEXEC);
+  
+  if (mp->fd < 0 || fstat(mp->fd, &sb) < 0)
+    goto Fail;
+
+  if ((size_t) sb.st_size < sizeof(*hp)) {
+    errno = EINVAL;
+    goto Fail;
+  }
+  
+  mp->mapsize = sb.st_size;
+  mp->map = mmap(NULL, mp->mapsize, PROT_READ, MAP_SHARED, mp->fd, 0);
+  if (mp->map == MAP_FAILED) {
+    mp->map = NULL;
+    goto Fail;
+  }
+
+  hp = mp->hdr = (const MANIFEST_HEADER *) mp->map;
+  if (memcmp(hp->magic, MANIFEST_MAGIC, sizeof(hp->magic)) != 0 ||
+      hp->version != MANIFEST_VERSION ||
+      hp->byteorder != MANIFEST_BYTEORDER ||
+      hp->nrecs < 1 ||
+      hp->recoff < sizeof(*hp) ||
+      hp->recoff + hp->nrecs * sizeof(MANIFEST_REC) > hp->stroff ||
+      hp->strsize < 1 ||
+      hp->stroff + hp->strsize > mp->mapsize) {
+    errno = EINVAL;
+    goto Fail;
+  }
+
+  mp->recs = (const MANIFEST_REC *) ((const char *) mp->map + hp->recoff);
+  mp->strs = (const char *) mp->map + hp->stroff;
+  if (mp->strs[hp->strsize-1] != '\0') {
+    errno = EINVAL;
+    goto Fail;
+  }
+  mp->digest = hp->digest;
+
+  return mp;
+
+ Fail:
+  if (mp->map)
+    munmap(mp->map, mp->mapsize);
+  manifest_fdclose(mp);
+  free(mp->path);
+  free(mp);
+  return NULL;
+}
+
+
+const MANIFEST_REC *
+manifest_rec(MANIFEST *mp,
+	     int64_t idx) {
+  if (idx < 0 || (uint64_t) idx >= mp->hdr->nrecs)
+    return NULL;
+  return &mp->recs[idx];
+}
+
+
+const char *
+manifest_str(MANIFEST *mp,
+	     uint64_t off) {
+  if (off >= mp->hdr->strsize)
+    return "";
+  return mp->strs + off;
+}
+
+
+/*
+ * Get 'len' bytes of data from the string table (NULL if out of range)
+ */
+const unsigned char *
+manifest_blob(MANIFEST *mp,
+	      uint64_t off,
+	      size_t len) {
+  if (off == 0 || off >= mp->hdr->strsize || len > mp->hdr->strsize - off)
+    return NULL;
+  return (const unsigned char *) mp->strs + off;
+}
+
+
+/*
+ * Find the record for a path relative to the root ("" is the root)
+ */
+int64_t
+manifest_lookup(MANIFEST *mp,
+		const char *path) {
+  const MANIFEST_REC *rp;
+  char *buf, *name, *next;
+  int64_t idx = 0, lo, hi, mid;
+  int d;
+
+
+  buf = strdup(path);
+  if (!buf)
+    return -1;
+  
+  for (name = buf; idx >= 0 && name; name = next) {
+    next = strchr(name, '/');
+    if (next)
+      *next++ = '\0';
+    if (!*name)
+      continue;
+    
+    rp = manifest_rec(mp, idx);
+    if (!rp || !(rp->f & MANIFEST_F_LISTED) ||
+	rp->child + rp->nchild > mp->hdr->nrecs) {
+      idx = -1;
+      break;
+    }
+
+    /* Entries are sorted by name */
+    lo = rp->child;
+    hi = rp->child + rp->nchild - 1;
+    idx = -1;
+    while (lo <= hi) {
+      mid = lo + (hi-lo)/2;
+      d = strcmp(name, manifest_str(mp, mp->recs[mid].name));
+      if (d == 0) {
+	idx = mid;
+	break;
+      }
+      if (d < 0)
+	hi = mid-1;
+      else
+	lo = mid+1;
+    }
+  }
+
+  free(buf);
+  if (idx < 0)
+    errno = ENOENT;
+  return idx;
+}
+
+
+/*
+ * Get the stat info of a record
+ */
+void
+manifest_nstat(const MANIFEST_REC *rp,
+	       NSTAT *sp) {
+  memset(sp, 0, sizeof(*sp));
+  
+  sp->st_mode = rp->mode;
+  sp->st_uid = rp->uid;
+  sp->st_gid = rp->gid;
+  sp->st_nlink = rp->nlink;
+  sp->st_size = rp->size;
+  sp->st_dev = rp->dev;
+  sp->st_ino = rp->ino;
+#if defined(HAVE_LCHFLAGS) || defined(UF_ARCHIVE)
+  sp->st_flags = rp->flags;
+#endif
+#if !defined(st_mtime)
+  sp->st_atime = rp->atime;
+  sp->st_mtime = rp->mtime;
+#elif defined(__APPLE__)
+  sp->st_atimespec.tv_sec = rp->atime;
+  sp->st_atimespec.tv_nsec = rp->atime_ns;
+  sp->st_mtimespec.tv_sec = rp->mtime;
+  sp->st_mtimespec.tv_nsec = rp->mtime_ns;
+#else
+  sp->st_atim.tv_sec = rp->atime;
+  sp->st_atim.tv_nsec = rp->atime_ns;
+  sp->st_mtim.tv_sec = rp->mtime;
+  sp->st_mtim.tv_nsec = rp->mtime_ns;
+#endif
+}
@@ -0,0 +1,171 @@
+/*
+ * manifest.h - Binary tree manifests
+ * 
+ * Copyright (c) 2021, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef MANIFEST_H
+#define MANIFEST_H 1
+
+#include "config.h"
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "btree.h"
+#include "nstat.h"
+
+
+#define MANIFEST_MAGIC    "PCMF"
+#define MANIFEST_VERSION  1
+#define MANIFEST_BYTEORDER 0x01020304
+
+
+/*
+ * File layout: header, records, string table. The records of a
+ * directory's entries are contiguous and sorted by name (strcmp), and
+ * record 0 is the root directory (the destination given to pc). All
+ * numbers are in the byte order of the writer.
+ */
+typedef struct manifest_header {
+  char magic[4];
+  uint32_t version;
+  uint32_t byteorder;
+  int32_t digest;	/* DIGEST_TYPE of the stored digests */
+  uint64_t nrecs;
+  uint64_t recoff;	/* Offset of the records */
+  uint64_t stroff;	/* Offset of the string table */
+  uint64_t strsize;
+} MANIFEST_HEADER;
+
+typedef struct manifest_rec {
+  uint64_t name;	/* Offsets into the string table (0 = none) */
+  uint64_t link;	/* Symbolic link content */
+  uint64_t digest;	/* Content digest (dlen bytes) */
+  uint64_t child;	/* First entry (directories, if MANIFEST_F_LISTED) */
+  uint64_t size;
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t flags;	/* File flags */
+  uint64_t acls;	/* ACLs hash (0 = none) */
+  uint64_t attrs;	/* Extended attributes hash (0 = none) */
+  int64_t atime;
+  int64_t mtime;
+  uint32_t atime_ns;
+  uint32_t mtime_ns;
+  uint32_t nchild;
+  uint32_t mode;
+  uint32_t uid;
+  uint32_t gid;
+  uint32_t nlink;
+  uint16_t f;		/* MANIFEST_F_* */
+  uint16_t dlen;
+} MANIFEST_REC;
+
+#define MANIFEST_F_LISTED 0x0001	/* Directory entries are recorded */
+
+
+typedef struct manifest {
+  char *path;		/* "-" for standard input/output */
+  int fd;
+  FILE *tmpfp;		/* Anonymous file backing fd (for "-") */
+  /* Reading */
+  void *map;
+  size_t mapsize;
+  const MANIFEST_HEADER *hdr;
+  const MANIFEST_REC *recs;
+  const char *strs;
+  /* Writing */
+  char *tmppath;
+  FILE *strfp;
+  uint64_t strsize;
+  uint64_t nrecs;
+  int digest;
+  int rooted;		/* The root directory entries are written */
+  int error;		/* A write failed */
+  BTREE *pending;	/* Directories without entries yet (path -> record) */
+} MANIFEST;
+
+
+extern MANIFEST *
+manifest_create(const char *path,
+		int digest);
+
+extern int64_t
+manifest_dir(MANIFEST *mp,
+	     const char *path,
+	     size_t nent);
+
+extern int
+manifest_put(MANIFEST *mp,
+	     int64_t idx,
+	     const char *name,
+	     const NSTAT *sp,
+	     const char *link,
+	     const unsigned char *digest,
+	     size_t dlen,
+	     uint64_t acls,
+	     uint64_t attrs);
+
+extern int
+manifest_pending(MANIFEST *mp,
+		 const char *path,
+		 int64_t idx);
+
+extern int
+manifest_close(MANIFEST *mp);
+
+
+extern MANIFEST *
+manifest_open(const char *path);
+
+extern const unsigned char *
+manifest_blob(MANIFEST *mp,
+	      uint64_t off,
+	      size_t len);
+
+extern int64_t
+manifest_lookup(MANIFEST *mp,
+		const char *path);
+
+extern const MANIFEST_REC *
+manifest_rec(MANIFEST *mp,
+	     int64_t idx);
+
+extern const char *
+manifest_str(MANIFEST *mp,
+	     uint64_t off);
+
+extern void
+manifest_nstat(const MANIFEST_REC *rp,
+	       NSTAT *sp);
+
+#endif
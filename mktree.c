@@ -0,0 +1,454 @@
+/*
+ * iopace.h - I/O pacing & page cache hints
+ * 
+ * Copyright (c) 2021, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#if defined(HAVE_SYS_ACL_H)
+#include <sys/acl.h>
+#endif
+
+#include "attrs.h"
+
+
+#define DIR_FANOUT    1000		/* Files per directory in the 'tiny' & 'links' trees */
+#define TINY_MAX      4096		/* Max size of the tiny files */
+#define SPARSE_SIZE   (1024LL*1024*1024)	/* Apparent size of the sparse files */
+#define SPARSE_EXTENT (64*1024)		/* Size of each data extent in them */
+#define SPARSE_NDATA  16		/* Number of data extents per file */
+#define XATTR_COUNT   32		/* Attributes per file in the 'xattr' tree */
+#define LINK_COUNT    8			/* Names per inode in the 'links' tree */
+#define DELTA_SIZE    512		/* Bytes overwritten per file by 'delta' */
+
+
+char *argv0 = "mktree";
+
+static uint64_t seed = 1;
+static unsigned char buf[SPARSE_EXTENT];
+
+static int delta_every = 0;
+static int delta_skew = 0;
+static long delta_seen = 0;
+static long delta_done = 0;
+
+
+
+/*
+ * Deterministic pseudo-random numbers (xorshift64*), so the same
+ * seed gives the same tree everywhere
+ */
+static uint64_t
+rnd(uint64_t *sp) {
+  uint64_t x = *sp;
+
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *sp = x;
+  return x * 0x2545F4914F6CDD1DULL;
+}
+
+
+static void
+rnd_fill(uint64_t *sp,
+	 unsigned char *p,
+	 size_t len) {
+  size_t i;
+  uint64_t v = 0;
+
+  for (i = 0; i < len; i++) {
+    if ((i & 7) == 0)
+      v = rnd(sp);
+    p[i] = (unsigned char) v;
+    v >>= 8;
+  }
+}
+
+
+static int
+write_file(int dfd,
+	   const char *path,
+	   size_t size,
+	   uint64_t *sp) {
+  int fd;
+  ssize_t len;
+  size_t done;
+
+
+  fd = openat(dfd, path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if (fd < 0)
+    return -1;
+
+  for (done = 0; done < size; done += len) {
+    size_t want = size - done < sizeof(buf) ? size - done : sizeof(buf);
+    
+    rnd_fill(sp, buf, want);
+    len = write(fd, buf, want);
+    if (len < 0) {
+      close(fd);
+      return -1;
+    }
+  }
+  
+  return close(fd);
+}
+
+
+static int
+make_dir(const char *path) {
+  if (mkdir(path, 0755) < 0 && errno != EEXIST)
+    return -1;
+  return 0;
+}
+
+
+/*
+ * n tiny files (0..TINY_MAX bytes), DIR_FANOUT per directory
+ */
+static int
+tree_tiny(const char *dir,
+	  long n) {
+  char path[1024];
+  long i;
+
+  
+  for (i = 0; i < n; i++) {
+    if (i % DIR_FANOUT == 0) {
+      snprintf(path, sizeof(path), "%s/d%06ld", dir, i / DIR_FANOUT);
+      if (make_dir(path) < 0)
+	return -1;
+    }
+    snprintf(path, sizeof(path), "%s/d%06ld/f%06ld", dir, i / DIR_FANOUT, i);
+    if (write_file(AT_FDCWD, path, rnd(&seed) % (TINY_MAX+1), &seed) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+
+/*
+ * A chain of n nested directories with one small file in each
+ */
+static int
+tree_deep(const char *dir,
+	  long n) {
+  long i;
+  int fd, nfd;
+
+  
+  /* Relative to the parent - the paths get longer than PATH_MAX */
+  fd = open(dir, O_RDONLY|O_DIRECTORY);
+  if (fd < 0)
+    return -1;
+  
+  for (i = 0; i < n; i++) {
+    if (mkdirat(fd, "d", 0755) < 0 && errno != EEXIST)
+      break;
+    nfd = openat(fd, "d", O_RDONLY|O_DIRECTORY);
+    close(fd);
+    fd = nfd;
+    if (fd < 0 || write_file(fd, "f", 64, &seed) < 0)
+      break;
+  }
+  
+  if (fd >= 0)
+    close(fd);
+  return i < n ? -1 : 0;
+}
+
+
+/*
+ * n empty-ish files in a single directory
+ */
+static int
+tree_wide(const char *dir,
+	  long n) {
+  char path[1024];
+  long i;
+  
+  
+  for (i = 0; i < n; i++) {
+    snprintf(path, sizeof(path), "%s/entry-%08ld", dir, i);
+    if (write_file(AT_FDCWD, path, rnd(&seed) % 64, &seed) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+
+/*
+ * n large sparse files with a few data extents each
+ */
+static int
+tree_sparse(const char *dir,
+	    long n) {
+  char path[1024];
+  long i;
+  int fd, j;
+
+  
+  for (i = 0; i < n; i++) {
+    snprintf(path, sizeof(path), "%s/sparse-%04ld", dir, i);
+    fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd < 0)
+      return -1;
+    for (j = 0; j < SPARSE_NDATA; j++) {
+      off_t off = (off_t) (rnd(&seed) % (SPARSE_SIZE / SPARSE_EXTENT)) * SPARSE_EXTENT;
+      
+      rnd_fill(&seed, buf, SPARSE_EXTENT);
+      if (pwrite(fd, buf, SPARSE_EXTENT, off) < 0) {
+	close(fd);
+	return -1;
+      }
+    }
+    if (ftruncate(fd, SPARSE_SIZE) < 0) {
+      close(fd);
+      return -1;
+    }
+    if (close(fd) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+
+/*
+ * n files with XATTR_COUNT extended attributes (and an ACL) each.
+ * Filesystems that don't support them just get the files.
+ */
+static int
+tree_xattr(const char *dir,
+	   long n) {
+  char path[1024], name[64], val[64];
+  long i;
+  int j, a_ok = 1, x_ok = 1;
+#if defined(HAVE_ACL_FROM_TEXT) && defined(HAVE_ACL_SET_FILE) && defined(ACL_TYPE_ACCESS)
+  acl_t acl = acl_from_text("u::rw-,u:12345:r--,g::r--,g:12345:rw-,m::rw-,o::r--");
+#endif
+
+  
+  for (i = 0; i < n; i++) {
+    snprintf(path, sizeof(path), "%s/x%06ld", dir, i);
+    if (write_file(AT_FDCWD, path, rnd(&seed) % 1024, &seed) < 0)
+      return -1;
+    
+    for (j = 0; x_ok && j < XATTR_COUNT; j++) {
+#if defined(HAVE_EXTATTR_GET_LINK)
+      snprintf(name, sizeof(name), "pc-bench-%02d", j);
+#else
+      snprintf(name, sizeof(name), "user.pc-bench-%02d", j);
+#endif
+      snprintf(val, sizeof(val), "%016llx", (unsigned long long) rnd(&seed));
+      if (attr_set(path, ATTR_NAMESPACE_USER, name, val, strlen(val), 0) < 0) {
+	fprintf(stderr, "%s: Warning: %s: Extended attributes not supported: %s\n",
+		argv0, path, strerror(errno));
+	x_ok = 0;
+      }
+    }
+    
+#if defined(HAVE_ACL_FROM_TEXT) && defined(HAVE_ACL_SET_FILE) && defined(ACL_TYPE_ACCESS)
+    if (a_ok && acl && acl_set_file(path, ACL_TYPE_ACCESS, acl) < 0) {
+      fprintf(stderr, "%s: Warning: %s: ACLs not supported: %s\n",
+	      argv0, path, strerror(errno));
+      a_ok = 0;
+    }
+#endif
+  }
+  
+#if defined(HAVE_ACL_FROM_TEXT) && defined(HAVE_ACL_SET_FILE) && defined(ACL_TYPE_ACCESS)
+  if (acl)
+    acl_free(acl);
+#endif
+  (void) a_ok;
+  return 0;
+}
+
+
+/*
+ * n files with LINK_COUNT names each, spread over the directories
+ */
+static int
+tree_links(const char *dir,
+	   long n) {
+  char path[1024], lpath[1024];
+  long i, nd;
+  int j;
+
+  
+  nd = (n * LINK_COUNT + DIR_FANOUT - 1) / DIR_FANOUT;
+  for (i = 0; i < nd; i++) {
+    snprintf(path, sizeof(path), "%s/l%06ld", dir, i);
+    if (make_dir(path) < 0)
+      return -1;
+  }
+  
+  for (i = 0; i < n; i++) {
+    snprintf(path, sizeof(path), "%s/l%06ld/f%06ld-0", dir, (long) (rnd(&seed) % nd), i);
+    if (write_file(AT_FDCWD, path, 1024 + rnd(&seed) % 8192, &seed) < 0)
+      return -1;
+    for (j = 1; j < LINK_COUNT; j++) {
+      snprintf(lpath, sizeof(lpath), "%s/l%06ld/f%06ld-%d", dir, (long) (rnd(&seed) % nd), i, j);
+      if (link(path, lpath) < 0)
+	return -1;
+    }
+  }
+  return 0;
+}
+
+
+static int
+delta_file(const char *path,
+	   const struct stat *sp,
+	   int type,
+	   struct FTW *fp) {
+  int fd;
+  size_t len;
+  off_t off;
+
+  
+  (void) fp;
+  
+  if (type != FTW_F || !S_ISREG(sp->st_mode) || sp->st_size == 0)
+    return 0;
+  
+  if ((delta_seen++ + delta_skew) % delta_every != 0)
+    return 0;
+  
+  fd = open(path, O_WRONLY);
+  if (fd < 0)
+    return -1;
+  /* Overwrite in place - the size must not change */
+  len = sp->st_size < DELTA_SIZE ? sp->st_size : DELTA_SIZE;
+  off = (off_t) (rnd(&seed) % (sp->st_size - len + 1)) & ~(off_t) (DELTA_SIZE-1);
+  rnd_fill(&seed, buf, len);
+  if (pwrite(fd, buf, len, off) < 0) {
+    close(fd);
+    return -1;
+  }
+  delta_done++;
+  return close(fd);
+}
+
+
+/*
+ * Modify a small part of pct% of the (non-empty) files below dir,
+ * for the small-delta resync benchmarks
+ */
+static int
+tree_delta(const char *dir,
+	   long pct) {
+  if (pct < 1 || pct > 100) {
+    errno = EINVAL;
+    return -1;
+  }
+  delta_every = 100 / pct;
+  delta_skew = rnd(&seed) % delta_every;
+  
+  if (nftw(dir, delta_file, 64, FTW_PHYS) != 0)
+    return -1;
+  
+  printf("%ld of %ld files modified\n", delta_done, delta_seen);
+  return 0;
+}
+
+
+static struct {
+  const char *name;
+  int (*fun)(const char *dir, long n);
+  const char *help;
+} kinds[] = {
+  { "tiny",   tree_tiny,   "<n> tiny files in directories of 1000" },
+  { "deep",   tree_deep,   "<n> nested directories, one file in each" },
+  { "wide",   tree_wide,   "<n> small files in a single directory" },
+  { "sparse", tree_sparse, "<n> 1 GiB sparse files" },
+  { "xattr",  tree_xattr,  "<n> files with 32 extended attributes & an ACL" },
+  { "links",  tree_links,  "<n> files with 8 hard links each" },
+  { "delta",  tree_delta,  "Modify <n>% of the files in an existing tree" },
+  { NULL, NULL, NULL }
+};
+
+
+int
+main(int argc,
+     char *argv[]) {
+  int i = 1, k;
+  long n;
+  unsigned long long sv;
+
+  
+  if (i+1 < argc && strcmp(argv[i], "-s") == 0) {
+    if (sscanf(argv[i+1], "%llu", &sv) != 1 || sv == 0) {
+      fprintf(stderr, "%s: Error: %s: Invalid seed\n", argv0, argv[i+1]);
+      exit(1);
+    }
+    seed = sv;
+    i += 2;
+  }
+
+  if (i+3 != argc) {
+    fprintf(stderr, "Usage:\n  %s [-s <seed>] <dir> <kind> <n>\n\nKinds:\n", argv0);
+    for (k = 0; kinds[k].name; k++)
+      fprintf(stderr, "  %-8s %s\n", kinds[k].name, kinds[k].help);
+    exit(1);
+  }
+
+  for (k = 0; kinds[k].name && strcmp(kinds[k].name, argv[i+1]) != 0; k++)
+    ;
+  if (!kinds[k].name) {
+    fprintf(stderr, "%s: Error: %s: Invalid tree kind\n", argv0, argv[i+1]);
+    exit(1);
+  }
+  
+  if (sscanf(argv[i+2], "%ld", &n) != 1 || n < 0) {
+    fprintf(stderr, "%s: Error: %s: Invalid count\n", argv0, argv[i+2]);
+    exit(1);
+  }
+
+  if (make_dir(argv[i]) < 0 || kinds[k].fun(argv[i], n) < 0) {
+    fprintf(stderr, "%s: Error: %s: %s\n", argv0, argv[i], strerror(errno));
+    exit(1);
+  }
+  
+  return 0;
+}
@@ -0,0 +1,146 @@
+/*
+ * nstat.h - Compact file status for nodes
+ * 
+ * Copyright (c) 2021, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef NSTAT_H
+#define NSTAT_H 1
+
+#include "config.h"
+
+#include <time.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#if defined(HAVE_SYS_SYSMACROS_H)
+#include <sys/sysmacros.h>
+#endif
+
+
+/*
+ * The subset of struct stat that is kept for each node. The member
+ * names are the same as in struct stat (including the platform
+ * specific timespec names) so st_mtime etc. work as usual.
+ */
+typedef struct nstat {
+  mode_t st_mode;
+  uid_t st_uid;
+  gid_t st_gid;
+#if defined(HAVE_LCHFLAGS) || defined(UF_ARCHIVE)
+  unsigned long st_flags;
+#endif
+  nlink_t st_nlink;
+  off_t st_size;
+  dev_t st_dev;
+  ino_t st_ino;
+#if !defined(st_mtime)
+  time_t st_atime;
+  time_t st_mtime;
+  time_t st_ctime;
+#elif defined(__APPLE__)
+  struct timespec st_atimespec;
+  struct timespec st_mtimespec;
+  struct timespec st_ctimespec;
+#else
+  struct timespec st_atim;
+  struct timespec st_mtim;
+  struct timespec st_ctim;
+#endif
+} NSTAT;
+
+
+static inline void
+nstat_set(NSTAT *np,
+	  const struct stat *sp) {
+  np->st_mode = sp->st_mode;
+  np->st_uid = sp->st_uid;
+  np->st_gid = sp->st_gid;
+#if defined(HAVE_LCHFLAGS) || defined(UF_ARCHIVE)
+  np->st_flags = sp->st_flags;
+#endif
+  np->st_nlink = sp->st_nlink;
+  np->st_size = sp->st_size;
+  np->st_dev = sp->st_dev;
+  np->st_ino = sp->st_ino;
+#if !defined(st_mtime)
+  np->st_atime = sp->st_atime;
+  np->st_mtime = sp->st_mtime;
+  np->st_ctime = sp->st_ctime;
+#elif defined(__APPLE__)
+  np->st_atimespec = sp->st_atimespec;
+  np->st_mtimespec = sp->st_mtimespec;
+  np->st_ctimespec = sp->st_ctimespec;
+#else
+  np->st_atim = sp->st_atim;
+  np->st_mtim = sp->st_mtim;
+  np->st_ctim = sp->st_ctim;
+#endif
+}
+
+
+#if defined(HAVE_STATX)
+/*
+ * Fields not returned by statx() (not asked for, or not supported by
+ * the filesystem) are cleared
+ */
+static inline void
+nstat_set_statx(NSTAT *np,
+		const struct statx *sxp) {
+  memset(np, 0, sizeof(*np));
+  
+  np->st_mode = sxp->stx_mode;
+  if (sxp->stx_mask & STATX_UID)
+    np->st_uid = sxp->stx_uid;
+  if (sxp->stx_mask & STATX_GID)
+    np->st_gid = sxp->stx_gid;
+  if (sxp->stx_mask & STATX_NLINK)
+    np->st_nlink = sxp->stx_nlink;
+  if (sxp->stx_mask & STATX_SIZE)
+    np->st_size = sxp->stx_size;
+  np->st_dev = makedev(sxp->stx_dev_major, sxp->stx_dev_minor);
+  if (sxp->stx_mask & STATX_INO)
+    np->st_ino = sxp->stx_ino;
+  if (sxp->stx_mask & STATX_ATIME) {
+    np->st_atim.tv_sec = sxp->stx_atime.tv_sec;
+    np->st_atim.tv_nsec = sxp->stx_atime.tv_nsec;
+  }
+  if (sxp->stx_mask & STATX_MTIME) {
+    np->st_mtim.tv_sec = sxp->stx_mtime.tv_sec;
+    np->st_mtim.tv_nsec = sxp->stx_mtime.tv_nsec;
+  }
+  if (sxp->stx_mask & STATX_CTIME) {
+    np->st_ctim.tv_sec = sxp->stx_ctime.tv_sec;
+    np->st_ctim.tv_nsec = sxp->stx_ctime.tv_nsec;
+  }
+}
+#endif
+
+#endif
@@ -43,6 +43,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <time.h>
+#include <stdint.h>
 
 #if defined(HAVE_AIO_H)
 #include <aio.h>
@@ -50,9 +51,27 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include <sys/param.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/ioctl.h>
+
+#if defined(HAVE_LINUX_FS_H)
+#include <linux/fs.h>
+#endif
+
+#if defined(HAVE_LINUX_FIEMAP_H)
+#include <linux/fiemap.h>
+#endif
+
+#if defined(HAVE_SYS_CLONEFILE_H)
+#include <sys/clonefile.h>
+#endif
+
+#if defined(HAVE_PTHREAD_H)
+#include <pthread.h>
+#endif
 
 #if defined(HAVE_SYS_VNODE_H)
 #include <sys/vnode.h>
@@ -61,49 +80,95 @@
 #include "acls.h"
 #include "attrs.h"
 #include "misc.h"
+#include "arena.h"
 #include "btree.h"
 #include "digest.h"
+#include "jobs.h"
+#include "buffers.h"
+#include "iopace.h"
+#include "stats.h"
+#include "uring.h"
+#include "dcache.h"
+#include "nstat.h"
+#include "intern.h"
+#include "links.h"
+#include "changes.h"
+#include "manifest.h"
 
 
-/* 
- * Node information
+/*
+ * ACLs, Extended Attributes and Content Digest are kept in separate
+ * side storage that is only allocated when the matching option is
+ * enabled (or, for the digest, when one is calculated). Until then
+ * they point to shared empty (all NULL/zero) instances.
  */
-typedef struct node {
-  char *p;		/* Path to node */
-  struct stat s;	/* Stat info */
-  char *l;		/* Symbolic link content */
-  struct {
+typedef struct nodeacls {
 #if defined(ACL_TYPE_NFS4)
-    acl_t nfs;		/* NFSv4 / ZFS */
+  acl_t nfs;		/* NFSv4 / ZFS */
 #endif
 #if defined(ACL_TYPE_ACCESS)
-    acl_t acc;		/* POSIX */
+  acl_t acc;		/* POSIX */
 #endif
 #if defined(ACL_TYPE_DEFAULT)
-    acl_t def;		/* POSIX */
+  acl_t def;		/* POSIX */
 #endif
-  } a;
-  struct {
+  int t;		/* NODE_ACL_*_TRIVIAL */
+} NODEACLS;
+
+#define NODE_ACL_NFS4_TRIVIAL 0x0001
+#define NODE_ACL_ACC_TRIVIAL  0x0002
+
+typedef struct nodeattrs {
 #if defined(ATTR_NAMESPACE_USER)
-    BTREE *usr;		/* User Extended Attributes */
+  BTREE *usr;		/* User Extended Attributes */
 #endif
 #if defined(ATTR_NAMESPACE_SYSTEM)
-    BTREE *sys;		/* System Extended Attributes */
+  BTREE *sys;		/* System Extended Attributes */
 #endif
-  } x;
-  struct {		/* Content Digest */
-    unsigned char buf[DIGEST_BUFSIZE_MAX];
-    size_t len;
-  } d;
+} NODEATTRS;
+
+typedef struct nodedigest {
+  unsigned char buf[DIGEST_BUFSIZE_MAX];
+  size_t len;
+  int valid;
+} NODEDIGEST;
+
+static NODEACLS node_noacls;
+static NODEATTRS node_noattrs;
+static NODEDIGEST node_nodigest;
+
+
+/* 
+ * Node information
+ */
+typedef struct node {
+  char *p;		/* Path to node */
+  int dfd;		/* Directory fd for *at() calls (or AT_FDCWD) */
+  const char *n;	/* Name relative to dfd (or the path) */
+  ARENA *arena;		/* Owner of the node & path (if set) */
+  int f;		/* NODE_F_* */
+  NSTAT s;		/* Stat info */
+  char *l;		/* Symbolic link content */
+  NODEACLS *a;		/* ACLs (if -A) */
+  NODEATTRS *x;		/* Extended Attributes (if -X) */
+  NODEDIGEST *d;	/* Content Digest (calculated on demand) */
+  const MANIFEST_REC *m; /* Manifest record (if NODE_F_MANIFEST) */
 } NODE;
 
+#define NODE_F_TYPEONLY 0x0001	/* Only s.st_mode & S_IFMT is set (from readdir) */
+#define NODE_F_MANIFEST 0x0002	/* From a manifest (-R), ACLs & attributes only as hashes */
+#define NODE_F_FAILED   0x0004	/* Couldn't be synced (left out of the -W manifest) */
+
 
 /*
  * Directory contents
  */
 typedef struct dirnode {
   char *path;		/* Path to directory */
+  int fd;		/* Open directory (or -1) */
   BTREE *nodes;		/* Nodes in directory */
+  ARENA *arena;		/* Storage for the nodes, their paths & names */
+  int all;		/* All nodes needed, even if not in the change list (-c) */
 } DIRNODE;
 
 
@@ -113,16 +178,48 @@ typedef struct dirnode {
 typedef struct dirpair {
   DIRNODE *src;
   DIRNODE *dst;
+  JOBGROUP jobs;	/* Pending file jobs in this directory */
+  int filter;		/* Only nodes in the change list (-c) */
+  char **donev;		/* Names already handled (to be freed before descending) */
+  size_t donec;
+  size_t dones;
+  struct filejob **fjv;	/* File jobs waiting to be started in physical order (-O) */
+  size_t fjc;
+  size_t fjs;
 } DIRPAIR;
 
 
 typedef struct attrupdate {
   int ns;
+  int fd;
   const char *pn;
   BTREE *attrs;
 } ATTRUPDATE;
 
 
+/*
+ * Regular file copy & metadata update (possibly run by a worker thread)
+ */
+typedef struct filejob {
+  NODE *src_nip;
+  NODE *dst_nip;	/* NULL if new file */
+  int dstfd;		/* Destination directory fd (or AT_FDCWD) */
+  char *dstpath;
+  const char *dstname;	/* Name relative to dstfd (tail of dstpath) */
+  int copy_f;		/* Copy file contents */
+  uint64_t pos;		/* Physical location of the source data (-O) */
+  NODE *next;		/* Source of the following job, to read ahead (-O) */
+} FILEJOB;
+
+
+/*
+ * File copy order (-O)
+ */
+#define ORDER_NAME  0
+#define ORDER_INODE 1
+#define ORDER_DISK  2
+
+
 
 
 char *argv0 = PACKAGE_NAME;
@@ -137,8 +234,10 @@ int f_force   = 0;
 int f_ignore  = 0;
 int f_recurse = 0;
 int f_remove  = 0;
+int f_hardlinks = 0; /* Preserve hard links */
 int f_content = 1;
 int f_zero    = 0;
+int f_inplace = 0; /* Update changed files in place, writing only differing blocks */
 int f_perms   = 0;
 int f_owner   = 0;
 int f_times   = 0;
@@ -148,7 +247,50 @@ int f_attrs   = 0;
 int f_flags   = 0; /* Check and copy file flags */
 int f_aflag   = 0; /* Check the special UF_ARCHIVE flag and reset it when copying files */
 int f_digest  = 0; /* Generate and check a content digest for files */
+int f_verify  = 0; /* Digest file contents while copying (and re-read destination if -VV) */
+char *f_dcache = NULL; /* Digest cache file (or directory) */
+char *f_changes = NULL; /* Change list for incremental mode */
+char *f_wmanifest = NULL; /* Manifest of the source tree to write */
+char *f_rmanifest = NULL; /* Manifest to use instead of the destination tree */
+int f_dattr   = 0; /* Store digests in extended attributes */
 size_t f_bufsize = 128*1024;
+int f_jobs    = 1; /* Number of parallel file copy jobs */
+int f_qdepth  = 4; /* Number of I/O requests in flight per file copy (io_uring) */
+int f_prefetch = 1; /* Number of parallel metadata lookups */
+
+int f_dthreads = 1; /* Number of threads per digest calculation */
+int f_order = ORDER_NAME; /* Order to start the file copies in a directory */
+int f_nocache = 0; /* Keep copied data out of the page cache (-EE: and use direct I/O) */
+size_t f_bwlimit = 0; /* I/O bandwidth limit (bytes/s, 0 = none) */
+int f_stats = 0; /* Print statistics at the end (-SS: as JSON) */
+
+JOBPOOL *jobpool = NULL;
+JOBPOOL *statpool = NULL;
+JOBPOOL *digestpool = NULL;
+
+/*
+ * ACLs & Extended Attribute sets are shared between all nodes that have
+ * equal ones, so they can be compared by pointer
+ */
+INTERN *acl_intern = NULL;
+INTERN *attrs_intern = NULL;
+
+LINKMAP *linkmap = NULL; /* Multiply linked source files (-H) */
+
+/*
+ * Incremental mode (-c) - only the paths in the change list (and the
+ * directories leading to them) are looked at
+ */
+CHANGES *changes = NULL;
+char *changes_src = NULL; /* Source root (as in the node paths) */
+char *changes_dst = NULL; /* Destination corresponding to the source root */
+
+MANIFEST *mwrite = NULL; /* -W */
+MANIFEST *mread = NULL;	 /* -R */
+char *mread_root = NULL; /* Destination path of the manifest root */
+
+int dirfd_max = 256;	/* Max number of directories kept open (see main) */
+int dirfd_cnt = 0;
 
 gid_t *gidsetv = NULL;
 int gidsetlen = 0;
@@ -168,126 +310,1168 @@ in_gidset(gid_t g) {
 
 
 
+/*
+ * Smallest file segment digested by a separate thread (-T)
+ */
+#define DIGEST_SEGMENT_MIN (16*1024*1024)
+
+typedef struct digestseg {
+  int fd;
+  off_t off;
+  off_t len;		/* Bytes to digest, or -1 for until end of file */
+  off_t got;		/* Bytes digested */
+  DIGEST d;
+} DIGESTSEG;
+
+
+static int
+digest_segment(void *arg) {
+  DIGESTSEG *sp = (DIGESTSEG *) arg;
+  BUFFER *bp;
+  IOWINDOW iw;
+  ssize_t len;
+  size_t want;
+
+
+  if (digest_init(&sp->d, f_digest) < 0)
+    return -1;
+
+  bp = buffer_get();
+  if (!bp)
+    return -1;
+
+  iopace_start(&iw, sp->fd, -1, sp->off);
+  want = bp->size;
+  while (sp->len < 0 || sp->got < sp->len) {
+    if (sp->len >= 0 && sp->len - sp->got < (off_t) want)
+      want = sp->len - sp->got;
+    
+    len = pread(sp->fd, bp->data, want, sp->off + sp->got);
+    if (len <= 0)
+      break;
+    
+    digest_update(&sp->d, bp->data, len);
+    sp->got += len;
+    iopace_update(&iw, sp->off + sp->got);
+  }
+  iopace_end(&iw);
+  buffer_put(bp);
+  if (len < 0)
+    return -1;
+
+  /* File shrunk while reading - a gap would give a bogus digest */
+  if (sp->len >= 0 && sp->got < sp->len) {
+    errno = EIO;
+    return -1;
+  }
+  
+  return 0;
+}
+
+
+/*
+ * Digest segments of a large file in parallel and combine the results.
+ * Gives the same result as digesting the whole file in sequence.
+ */
+static ssize_t
+fd_digest_parallel(int fd,
+		   off_t size,
+		   unsigned char *dbuf,
+		   size_t dsize) {
+  DIGESTSEG *sv;
+  JOBGROUP jg;
+  off_t seglen;
+  int i, ns, rc = 0;
+  ssize_t rlen;
+  size_t bsize = buffer_pool_size();
+  
+
+  seglen = (size + f_dthreads - 1) / f_dthreads;
+  if (seglen < DIGEST_SEGMENT_MIN)
+    seglen = DIGEST_SEGMENT_MIN;
+  if (bsize > 0)
+    seglen = ((seglen + bsize - 1) / bsize) * bsize;
+  
+  ns = (size + seglen - 1) / seglen;
+  sv = calloc(ns, sizeof(*sv));
+  if (!sv)
+    return -1;
+  
+  jobgroup_init(&jg);
+  for (i = 0; i < ns; i++) {
+    sv[i].fd  = fd;
+    sv[i].off = i*seglen;
+    sv[i].len = (i < ns-1 ? seglen : -1);
+    
+    if (jobpool_add(digestpool, &jg, digest_segment, NULL, &sv[i]) < 0) {
+      rc = -1;
+      break;
+    }
+  }
+  if (jobgroup_wait(&jg) < 0)
+    rc = -1;
+  jobgroup_destroy(&jg);
+
+  for (i = 1; rc == 0 && i < ns; i++)
+    if (digest_combine(&sv[0].d, &sv[i].d, sv[i].got) < 0)
+      rc = -1;
+
+  rlen = (rc == 0 ? digest_final(&sv[0].d, dbuf, dsize) : -1);
+  
+  for (i = 0; i < ns; i++)
+    digest_destroy(&sv[i].d);
+  free(sv);
+  return rlen;
+}
+
+
+/*
+ * Calculate a digest checksum for the contents of an open file
+ */
+static ssize_t
+fd_digest(int fd,
+	  unsigned char *dbuf,
+	  size_t dsize) {
+  BUFFER *bp;
+  IOWINDOW iw;
+  ssize_t len;
+  off_t tlen;
+  DIGEST d;
+  struct stat sb;
+
+
+  if (digestpool && digest_combinable(f_digest) &&
+      fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) &&
+      sb.st_size >= 2*DIGEST_SEGMENT_MIN &&
+      lseek(fd, 0, SEEK_CUR) == 0)
+    return fd_digest_parallel(fd, sb.st_size, dbuf, dsize);
+  
+  if (digest_init(&d, f_digest) < 0)
+    return -1;
+  
+  bp = buffer_get();
+  if (!bp)
+    return -1;
+  
+  iopace_start(&iw, fd, -1, 0);
+  tlen = 0;
+  while ((len = read(fd, bp->data, bp->size)) > 0) {
+    digest_update(&d, bp->data, len);
+    tlen += len;
+    iopace_update(&iw, tlen);
+  }
+  iopace_end(&iw);
+  buffer_put(bp);
+  if (len < 0)
+    return -1;
+  
+  return digest_final(&d, dbuf, dsize);
+}
+
+
+/*
+ * Digest a block of data while copying it. The time and bytes go
+ * into the -S digest statistics - the call is counted once per file
+ * by stats_call() when the digest is finalized.
+ */
+static inline void
+copy_digest_update(DIGEST *dp,
+		   unsigned char *buf,
+		   size_t len) {
+  uint64_t t0 = stats_start();
+
+  digest_update(dp, buf, len);
+  stats_add(STATS_T_DIGEST, t0);
+  stats_count(STATS_C_DBYTES, len);
+}
+
+
+/*
+ * Get the (writable) digest storage of a node, allocating it if needed
+ */
+static NODEDIGEST *
+node_digest(NODE *nip) {
+  if (nip->d == &node_nodigest) {
+    NODEDIGEST *dp = malloc(sizeof(*dp));
+
+    if (!dp)
+      abort(); /* XXX: Better error handling */
+    memset(dp, 0, sizeof(*dp));
+    nip->d = dp;
+  }
+  return nip->d;
+}
+
+
+/*
+ * Remember the digest of a file in the digest cache. Source files
+ * are only tagged with the digest attribute if asked to (-KK).
+ */
+static void
+file_digest_save(NODE *nip,
+		 int src_f) {
+  if (nip->d->valid)
+    dcache_put(src_f && f_dattr < 2 ? NULL : nip->p, &nip->s, f_digest, nip->d->buf, nip->d->len);
+}
+
+
 /*
  * Calculate a digest checksum for a file
  */
 int
-file_digest(NODE *nip) {
-  unsigned char buf[128*1024];
+file_digest(NODE *nip,
+	    int src_f) {
   ssize_t len;
   int fd;
-  DIGEST d;
+  NODEDIGEST *dp;
+  uint64_t t0;
   
 
   if (!nip)
     return 0;
+
+  if (nip->d->valid)
+    return 0;
+
+  dp = node_digest(nip);
+  if (dcache_get(nip->p, &nip->s, f_digest, dp->buf, &dp->len) > 0) {
+    dp->valid = 1;
+    return 0;
+  }
   
-  fd = open(nip->p, O_RDONLY);
+  t0 = stats_start();
+  stats_syscall(STATS_S_OPEN);
+  fd = openat(nip->dfd, nip->n, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
   if (fd < 0)
     return -1;
-  
-  digest_init(&d, f_digest);
-  while ((len = read(fd, buf, sizeof(buf))) > 0) {
-    digest_update(&d, buf, len);
-  }
+
+  len = fd_digest(fd, dp->buf, sizeof(dp->buf));
   close(fd);
-  nip->d.len = digest_final(&d, nip->d.buf, sizeof(nip->d.buf));
+  stats_stop(STATS_T_DIGEST, t0);
+  if (len < 0)
+    return -1;
+  stats_count(STATS_C_DBYTES, nip->s.st_size);
+  
+  dp->len = len;
+  dp->valid = 1;
+  
+  file_digest_save(nip, src_f);
   return 0;
 }
 
 
+/*
+ * Progress output while copying (-vv). Limited to a few lines per
+ * second - the terminal would otherwise slow down the copy loops.
+ */
+#define PROGRESS_INTERVAL 250000000	/* ns */
+
+static void
+copy_progress(off_t bytes) {
+  static uint64_t last = 0;
+  uint64_t now = stats_now();
+  uint64_t prev = __atomic_load_n(&last, __ATOMIC_RELAXED);
+
+  
+  if (now - prev < PROGRESS_INTERVAL ||
+      !__atomic_compare_exchange_n(&last, &prev, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    return;
+  
+  printf("  %lld bytes copied\r", (long long) bytes);
+}
+
+
 /*
  * Check if a buffer contains just NUL (0x00) bytes
  */
 static inline int
-buffer_zero_check(char *buf,
-	   size_t len) {
-  while (len > 0 && *buf++ == 0)
+buffer_zero_check(const void *vp,
+		  size_t len) {
+  const unsigned char *buf = (const unsigned char *) vp;
+  const unsigned long *wp;
+
+
+  /* Leading bytes up to word alignment */
+  while (len > 0 && ((uintptr_t) buf & (sizeof(*wp)-1)) != 0) {
+    if (*buf++)
+      return 0;
+    --len;
+  }
+
+  /* Then a word at a time (four words per round) */
+  wp = (const unsigned long *) buf;
+  while (len >= 4*sizeof(*wp)) {
+    if (wp[0] | wp[1] | wp[2] | wp[3])
+      return 0;
+    wp += 4;
+    len -= 4*sizeof(*wp);
+  }
+  while (len >= sizeof(*wp)) {
+    if (*wp++)
+      return 0;
+    len -= sizeof(*wp);
+  }
+
+  /* And the trailing bytes */
+  buf = (const unsigned char *) wp;
+  while (len > 0) {
+    if (*buf++)
+      return 0;
     --len;
+  }
 
-  return (len == 0 ? 1 : 0);
+  return 1;
 }
 
 
 /*
- * Copy file contents
+ * Try to clone or copy the file contents inside the kernel.
+ * On return *tbytes is the number of bytes copied and both file
+ * offsets are positioned after it.
+ *
+ * Returns: 1 if all done, 0 if the rest must be copied via read/write
+ * and -1 on (hard) errors
  */
-int
-file_copy(const char *srcpath,
-	  const char *dstpath,
-	  mode_t mode) {
-  off_t sbytes, tbytes;
-  int src_fd = -1, dst_fd = -1, rc = -1;
-  int holed = 0;
-#if defined(HAVE_AIO_WAITCOMPLETE)
-  char bufv[2][128*1024];
-  struct aiocb cb[2], *cbp;
-  int ap;
-#else
-  char buf[128*1024];
+static int
+file_copy_kernel(int src_fd,
+		 int dst_fd,
+		 struct stat *sp,
+		 off_t *tbytes,
+		 IOWINDOW *wp) {
+  *tbytes = 0;
+  
+  if (!S_ISREG(sp->st_mode) || sp->st_size == 0)
+    return 0;
+
+#if defined(FICLONE)
+  /* Reflink (btrfs, XFS, ...) - holes are preserved */
+  if (ioctl(dst_fd, FICLONE, src_fd) == 0) {
+    if (lseek(src_fd, sp->st_size, SEEK_SET) < 0 ||
+	lseek(dst_fd, sp->st_size, SEEK_SET) < 0)
+      return -1;
+    *tbytes = sp->st_size;
+    return 1;
+  }
 #endif
 
+#if defined(HAVE_COPY_FILE_RANGE)
+  /* Would fill in holes on filesystems that can't clone (and goes via the page cache) */
+  if (f_zero || f_nocache > 1)
+    return 0;
   
-  src_fd = open(srcpath, O_RDONLY);
-  if (src_fd < 0) {
-    fprintf(stderr, "%s: Error: %s: open(O_RDONLY): %s\n",
-	    argv0, srcpath, strerror(errno));
-    rc = -1;
-    goto End;
+  while (*tbytes < sp->st_size) {
+    ssize_t len;
+    size_t want = sp->st_size - *tbytes;
+
+    /* In pieces so the bandwidth limit & cache release can keep up */
+    if ((iopace_limited() || f_nocache) && want > IOPACE_WINDOW)
+      want = IOPACE_WINDOW;
+    
+    len = copy_file_range(src_fd, NULL, dst_fd, NULL, want, 0);
+    if (len < 0) {
+      if (errno == EINTR)
+	continue;
+      if (errno == ENOSYS || errno == EXDEV || errno == EINVAL ||
+	  errno == EOPNOTSUPP || errno == EBADF || errno == ETXTBSY)
+	return 0; /* Not supported here - continue with read/write */
+      return -1;
+    }
+    if (len == 0)
+      break; /* File shrunk */
+    
+    *tbytes += len;
+    iopace_update(wp, *tbytes);
   }
-  
-  dst_fd = open(dstpath, O_WRONLY|O_CREAT|O_TRUNC, mode);
-  if (dst_fd < 0) {
-    fprintf(stderr, "%s: Error: %s: open(O_WRONLY|O_CREAT, 0x%x): %s\n",
-	    argv0, dstpath, mode, strerror(errno));
-    rc = -1;
-    goto End;
+  if (*tbytes > 0) {
+    /* Let read/write handle anything appended while we were copying */
+    return 0;
   }
-  
-  sbytes = 0;
-  tbytes = 0;
+#endif
 
-#if defined(HAVE_AIO_WAITCOMPLETE)
-  /* Start first read */
-  memset(&cb, 0, sizeof(cb));
-  cb[0].aio_fildes = src_fd;
-  cb[1].aio_fildes = src_fd;
-  cb[0].aio_buf = bufv[0];
-  cb[1].aio_buf = bufv[1];
-  cb[0].aio_nbytes = sizeof(bufv[ap]);
-  cb[1].aio_nbytes = sizeof(bufv[ap]);
-  
-  ap = 0;
-  cb[ap].aio_offset = 0;
-  if (aio_read(&cb[ap]) < 0) {
-    fprintf(stderr, "%s: Error: %s: aio_read(): %s\n", argv0, srcpath, strerror(errno));
-    exit(1);
+  return 0;
+}
+
+
+/*
+ * Copy a data extent at offset 'off' from src_fd to dst_fd.
+ * Blocks of zeroes (inside the extent) are skipped too.
+ */
+static int
+file_copy_extent(int src_fd,
+		 int dst_fd,
+		 off_t off,
+		 off_t len,
+		 BUFFER *bp,
+		 int *cfr_f,
+		 IOWINDOW *wp) {
+  ssize_t rlen, wlen, tlen;
+
+
+#if defined(HAVE_COPY_FILE_RANGE)
+  if (*cfr_f) {
+    off_t soff = off, doff = off;
+    
+    while (len > 0) {
+      rlen = copy_file_range(src_fd, &soff, dst_fd, &doff, len, 0);
+      if (rlen < 0) {
+	if (errno == EINTR)
+	  continue;
+	if (errno == ENOSYS || errno == EXDEV || errno == EINVAL ||
+	    errno == EOPNOTSUPP || errno == EBADF || errno == ETXTBSY) {
+	  *cfr_f = 0;
+	  break;
+	}
+	return -1;
+      }
+      if (rlen == 0)
+	return 0; /* File shrunk */
+      
+      len -= rlen;
+      iopace_update(wp, soff);
+    }
+    if (len == 0)
+      return 0;
+
+    off = soff;
   }
+#endif
   
-  cbp = NULL;
-  while ((rc = aio_waitcomplete(&cbp, NULL)) > 0) {
-    sbytes = rc;
-    
-    /* Start next read immediately in order to keep interleave reading & writing */
-    ap = !ap;
-    cb[ap].aio_offset = tbytes+sbytes;
-    if (aio_read(&cb[ap]) < 0) {
-      fprintf(stderr, "%s: Error: aio_read(): %s\n", argv0, strerror(errno));
-      exit(1);
+  while (len > 0) {
+    iopace_align(wp, off, len < bp->size ? len : bp->size);
+    rlen = pread(src_fd, bp->data, len < bp->size ? len : bp->size, off);
+    if (rlen < 0) {
+      if (errno == EINTR)
+	continue;
+      return -1;
     }
-    
-    if (f_zero && sbytes && buffer_zero_check((char *) cbp->aio_buf, sbytes)) {
-      holed = 1;
-      rc = lseek(dst_fd, sbytes, SEEK_CUR);
-      if (rc < 0) {
-	fprintf(stderr, "%s: Error: %s: lseek(%ld): %s\n", argv0, dstpath, sbytes, strerror(errno));
-	rc = -1;
-	goto End;
+    if (rlen == 0)
+      break; /* File shrunk */
+
+    if (!buffer_zero_check(bp->data, rlen)) {
+      for (tlen = 0; tlen < rlen; tlen += wlen) {
+	wlen = pwrite(dst_fd, bp->data+tlen, rlen-tlen, off+tlen);
+	if (wlen < 0) {
+	  if (errno == EINTR) {
+	    wlen = 0;
+	    continue;
+	  }
+	  return -1;
+	}
       }
     }
-    else {
-      rc = write(dst_fd, (const void *) cbp->aio_buf, sbytes);
-      if (rc < 0) {
+    
+    off += rlen;
+    len -= rlen;
+    iopace_update(wp, off);
+    if (f_verbose > 1)
+      copy_progress(off);
+  }
+
+  return 0;
+}
+
+
+/*
+ * Copy a sparse file by walking the data extents in the source
+ * (SEEK_DATA/SEEK_HOLE) - holes are never read.
+ *
+ * Returns: 1 if done, 0 if not supported or the file has no holes and -1 on errors.
+ */
+static int
+file_copy_sparse(int src_fd,
+		 int dst_fd,
+		 struct stat *sp,
+		 off_t *tbytes,
+		 IOWINDOW *wp) {
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+  off_t data, hole;
+  BUFFER *bp;
+  int cfr_f = 1;
+
+
+  if (!S_ISREG(sp->st_mode) || sp->st_size == 0)
+    return 0;
+  
+  data = lseek(src_fd, 0, SEEK_DATA);
+  if (data < 0) {
+    if (errno != ENXIO)
+      return 0; /* Not supported */
+    
+    /* Just one big hole */
+    *tbytes = sp->st_size;
+    return 1;
+  }
+
+  hole = lseek(src_fd, data, SEEK_HOLE);
+  if (hole < 0 || (data == 0 && hole >= sp->st_size)) {
+    /* No holes - use the normal copy */
+    if (lseek(src_fd, 0, SEEK_SET) < 0)
+      return -1;
+    return 0;
+  }
+
+  bp = buffer_get();
+  if (!bp)
+    return -1;
+
+  while (data < sp->st_size) {
+    hole = lseek(src_fd, data, SEEK_HOLE);
+    if (hole < 0)
+      goto Fail;
+    if (hole > sp->st_size)
+      hole = sp->st_size;
+
+    if (file_copy_extent(src_fd, dst_fd, data, hole-data, bp, &cfr_f, wp) < 0)
+      goto Fail;
+    
+    data = lseek(src_fd, hole, SEEK_DATA);
+    if (data < 0) {
+      if (errno == ENXIO)
+	break; /* Only a hole left */
+      goto Fail;
+    }
+  }
+
+  buffer_put(bp);
+  *tbytes = sp->st_size;
+  return 1;
+
+ Fail:
+  buffer_put(bp);
+  return -1;
+#else
+  (void) wp;
+  return 0;
+#endif
+}
+
+
+#if defined(HAVE_URING)
+#define URING_DEPTH_MAX 64
+
+/*
+ * Per-thread io_uring state. The ring and its (registered) buffers
+ * are set up once and then reused for all files copied by the thread.
+ */
+typedef struct uringctx {
+  URING ring;
+  int nbuf;
+  int fixed;		/* Buffers registered with the kernel */
+  BUFFER *bufv[URING_DEPTH_MAX];
+} URINGCTX;
+
+#define SLOT_IDLE  0
+#define SLOT_READ  1
+#define SLOT_WRITE 2
+
+typedef struct uringslot {
+  int state;
+  off_t off;		/* File offset of the chunk */
+  size_t len;		/* Chunk length */
+  size_t got;		/* Bytes read */
+  size_t put;		/* Bytes written */
+  struct iovec iov;	/* For non-registered buffers */
+} URINGSLOT;
+
+
+#if defined(HAVE_PTHREAD_H)
+static pthread_key_t uring_key;
+static pthread_once_t uring_once = PTHREAD_ONCE_INIT;
+#else
+static URINGCTX *uring_ctx = NULL;
+#endif
+
+
+static void
+uringctx_free(void *vp) {
+  URINGCTX *ucp = (URINGCTX *) vp;
+  int i;
+
+  if (!ucp)
+    return;
+
+  if (ucp->ring.fd >= 0)
+    uring_destroy(&ucp->ring);
+  for (i = 0; i < ucp->nbuf; i++)
+    buffer_put(ucp->bufv[i]);
+  free(ucp);
+}
+
+
+#if defined(HAVE_PTHREAD_H)
+static void
+uring_key_init(void) {
+  pthread_key_create(&uring_key, uringctx_free);
+}
+#endif
+
+
+/*
+ * Get (or set up) the io_uring state for the current thread.
+ * Returns NULL if io_uring isn't usable.
+ */
+static URINGCTX *
+uringctx_get(void) {
+  URINGCTX *ucp;
+  struct iovec iov[URING_DEPTH_MAX];
+  int i;
+
+
+#if defined(HAVE_PTHREAD_H)
+  pthread_once(&uring_once, uring_key_init);
+  ucp = pthread_getspecific(uring_key);
+#else
+  ucp = uring_ctx;
+#endif
+  if (ucp)
+    return ucp->ring.fd < 0 ? NULL : ucp;
+
+  ucp = calloc(1, sizeof(*ucp));
+  if (!ucp)
+    return NULL;
+  ucp->ring.fd = -1;
+  
+#if defined(HAVE_PTHREAD_H)
+  pthread_setspecific(uring_key, ucp);
+#else
+  uring_ctx = ucp;
+#endif
+
+  /* At most one request per slot is in flight */
+  if (uring_init(&ucp->ring, f_qdepth) < 0) {
+    if (f_debug)
+      fprintf(stderr, "*** uringctx_get: uring_init(%d): %s\n", f_qdepth, strerror(errno));
+    return NULL;
+  }
+  
+  for (i = 0; i < f_qdepth; i++) {
+    ucp->bufv[i] = buffer_get();
+    if (!ucp->bufv[i]) {
+      uring_destroy(&ucp->ring);
+      return NULL;
+    }
+    ucp->nbuf++;
+    
+    iov[i].iov_base = ucp->bufv[i]->data;
+    iov[i].iov_len  = ucp->bufv[i]->size;
+  }
+
+  /* Might fail due to RLIMIT_MEMLOCK - then use normal buffers */
+  if (uring_register_buffers(&ucp->ring, iov, ucp->nbuf) == 0)
+    ucp->fixed = 1;
+  else if (f_debug)
+    fprintf(stderr, "*** uringctx_get: uring_register_buffers: %s\n", strerror(errno));
+
+  return ucp;
+}
+
+
+static void
+uring_slot_submit(URINGCTX *ucp,
+		  URINGSLOT *sl,
+		  int i,
+		  int fd) {
+  struct io_uring_sqe *sqe;
+  unsigned char *buf;
+  size_t len;
+
+
+  /* Can't fail - the ring has room for one request per slot */
+  sqe = uring_get_sqe(&ucp->ring);
+
+  if (sl->state == SLOT_READ) {
+    buf = ucp->bufv[i]->data + sl->got;
+    len = sl->len - sl->got;
+    sqe->off = sl->off + sl->got;
+  } else {
+    buf = ucp->bufv[i]->data + sl->put;
+    len = sl->got - sl->put;
+    sqe->off = sl->off + sl->put;
+  }
+  
+  sqe->fd = fd;
+  sqe->user_data = i;
+  if (ucp->fixed) {
+    sqe->opcode = (sl->state == SLOT_READ ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED);
+    sqe->addr = (uintptr_t) buf;
+    sqe->len = len;
+    sqe->buf_index = i;
+  } else {
+    sqe->opcode = (sl->state == SLOT_READ ? IORING_OP_READV : IORING_OP_WRITEV);
+    sl->iov.iov_base = buf;
+    sl->iov.iov_len = len;
+    sqe->addr = (uintptr_t) &sl->iov;
+    sqe->len = 1;
+  }
+}
+
+
+/*
+ * Copy file contents with io_uring, keeping up to f_qdepth reads
+ * and writes in flight at the same time.
+ *
+ * Returns: 1 if done, 0 if io_uring isn't available and -1 on errors
+ */
+static int
+file_copy_uring(int src_fd,
+		int dst_fd,
+		struct stat *sp,
+		off_t *tbytes,
+		int *holed,
+		IOWINDOW *wp) {
+  URINGCTX *ucp;
+  URINGSLOT slot[URING_DEPTH_MAX];
+  struct io_uring_cqe *cqe;
+  off_t next;
+  int i, res, active, err;
+
+
+  ucp = uringctx_get();
+  if (!ucp)
+    return 0;
+
+  next = *tbytes;
+  active = 0;
+  err = 0;
+  
+  memset(slot, 0, sizeof(slot));
+  for (i = 0; i < ucp->nbuf && next < sp->st_size; i++) {
+    slot[i].state = SLOT_READ;
+    slot[i].off = next;
+    slot[i].len = ucp->bufv[i]->size;
+    if (slot[i].len > sp->st_size - next)
+      slot[i].len = sp->st_size - next;
+    next += slot[i].len;
+    
+    iopace_align(wp, slot[i].off, slot[i].len);
+    uring_slot_submit(ucp, &slot[i], i, src_fd);
+    active++;
+  }
+
+  while (active > 0) {
+    if (uring_submit(&ucp->ring, 1) < 0) {
+      /* Can't reap the requests in flight - the ring is unusable */
+      err = errno;
+      uring_destroy(&ucp->ring);
+      errno = err;
+      return -1;
+    }
+    
+    while ((cqe = uring_peek_cqe(&ucp->ring)) != NULL) {
+      URINGSLOT *sl;
+      
+      i = cqe->user_data;
+      res = cqe->res;
+      uring_cqe_seen(&ucp->ring);
+
+      sl = &slot[i];
+      if (res < 0) {
+	if ((res == -EINTR || res == -EAGAIN) && !err) {
+	  uring_slot_submit(ucp, sl, i, sl->state == SLOT_READ ? src_fd : dst_fd);
+	  continue;
+	}
+	if (!err)
+	  err = -res;
+	sl->state = SLOT_IDLE;
+	active--;
+	continue;
+      }
+
+      if (err) {
+	/* Just drain the requests in flight */
+	sl->state = SLOT_IDLE;
+	active--;
+	continue;
+      }
+      
+      if (sl->state == SLOT_READ) {
+	sl->got += res;
+	if (res > 0 && sl->got < sl->len) {
+	  /* Short read */
+	  iopace_align(wp, sl->off + sl->got, sl->len - sl->got);
+	  uring_slot_submit(ucp, sl, i, src_fd);
+	  continue;
+	}
+
+	/* Chunk read (or the file shrunk) */
+	sl->len = sl->got;
+	if (sl->got > 0 && !(f_zero && buffer_zero_check(ucp->bufv[i]->data, sl->got))) {
+	  sl->state = SLOT_WRITE;
+	  uring_slot_submit(ucp, sl, i, dst_fd);
+	  continue;
+	}
+	
+	if (sl->got > 0)
+	  *holed = 1;
+      } else {
+	sl->put += res;
+	if (res > 0 && sl->put < sl->got) {
+	  /* Short write */
+	  uring_slot_submit(ucp, sl, i, dst_fd);
+	  continue;
+	}
+	if (res == 0) {
+	  err = EIO;
+	  sl->state = SLOT_IDLE;
+	  active--;
+	  continue;
+	}
+      }
+
+      /* Chunk done - start on the next one */
+      *tbytes += sl->got;
+      iopace_update(wp, *tbytes);
+      if (f_verbose > 1)
+	copy_progress(*tbytes);
+      
+      if (next < sp->st_size) {
+	sl->state = SLOT_READ;
+	sl->off = next;
+	sl->len = ucp->bufv[i]->size;
+	if (sl->len > sp->st_size - next)
+	  sl->len = sp->st_size - next;
+	sl->got = sl->put = 0;
+	next += sl->len;
+	
+	iopace_align(wp, sl->off, sl->len);
+	uring_slot_submit(ucp, sl, i, src_fd);
+      } else {
+	sl->state = SLOT_IDLE;
+	active--;
+      }
+    }
+  }
+
+  if (err) {
+    errno = err;
+    return -1;
+  }
+  
+  return 1;
+}
+#endif
+
+
+/*
+ * Read up to 'size' bytes at 'off', retrying short reads. Returns the
+ * number of bytes read (less than size only at end of file) or -1.
+ */
+static ssize_t
+pread_full(int fd,
+	   void *buf,
+	   size_t size,
+	   off_t off) {
+  size_t got = 0;
+  ssize_t len;
+
+  while (got < size) {
+    len = pread(fd, (char *) buf + got, size - got, off + got);
+    if (len < 0) {
+      if (errno == EINTR)
+	continue;
+      return -1;
+    }
+    if (len == 0)
+      break;
+    got += len;
+  }
+  return got;
+}
+
+static ssize_t
+pwrite_full(int fd,
+	    const void *buf,
+	    size_t size,
+	    off_t off) {
+  size_t done = 0;
+  ssize_t len;
+
+  while (done < size) {
+    len = pwrite(fd, (const char *) buf + done, size - done, off + done);
+    if (len < 0) {
+      if (errno == EINTR)
+	continue;
+      return -1;
+    }
+    done += len;
+  }
+  return done;
+}
+
+
+/*
+ * In-place delta update (-I): Compare the source with the existing
+ * destination one buffer at a time and only write the blocks that
+ * differ, then truncate to the new size. The source contents are
+ * digested into dp (if set) on the way.
+ *
+ * Returns: 1 if all done, 0 if not applicable (empty destination)
+ * and -1 on errors
+ */
+static int
+file_copy_delta(int src_fd,
+		int dst_fd,
+		off_t *tbytes,
+		off_t *wbytes,
+		DIGEST *dp,
+		IOWINDOW *wp) {
+  BUFFER *sbp = NULL, *dbp = NULL;
+  struct stat db;
+  ssize_t slen, dlen;
+  int rc = -1;
+
+  
+  *tbytes = 0;
+  *wbytes = 0;
+  
+  if (fstat(dst_fd, &db) < 0)
+    return -1;
+  if (!S_ISREG(db.st_mode) || db.st_size == 0)
+    return 0;
+  
+  sbp = buffer_get();
+  dbp = buffer_get();
+  if (!sbp || !dbp)
+    goto End;
+
+  while ((slen = pread_full(src_fd, sbp->data, sbp->size, *tbytes)) > 0) {
+    if (dp)
+      copy_digest_update(dp, sbp->data, slen);
+
+    if (*tbytes < db.st_size) {
+      dlen = pread_full(dst_fd, dbp->data, slen, *tbytes);
+      if (dlen < 0)
+	goto End;
+    } else
+      dlen = 0;
+    
+    if (memcmp(sbp->data, dbp->data, dlen) != 0) {
+      if (pwrite_full(dst_fd, sbp->data, slen, *tbytes) < 0)
+	goto End;
+      *wbytes += slen;
+    } else if (dlen < slen) {
+      /* Destination ends here - just append the rest */
+      if (pwrite_full(dst_fd, sbp->data + dlen, slen - dlen, *tbytes + dlen) < 0)
+	goto End;
+      *wbytes += slen - dlen;
+    }
+    
+    *tbytes += slen;
+    iopace_update(wp, *tbytes);
+  }
+  if (slen < 0)
+    goto End;
+
+  if (db.st_size != *tbytes && ftruncate(dst_fd, *tbytes) < 0)
+    goto End;
+  
+  rc = 1;
+
+ End:
+  buffer_put(dbp);
+  buffer_put(sbp);
+  return rc;
+}
+
+
+/*
+ * Copy file contents
+ *
+ * If dbuf is set then a digest of the contents is calculated while
+ * copying (using the plain read/write loop) and returned in dbuf/dlenp.
+ * With -VV the destination is then also re-read and checked against it.
+ *
+ * If dst_fdp is set then the destination is left open and returned in
+ * it (or -1 if there is no descriptor, e.g. after a clonefile()).
+ */
+int
+file_copy(NODE *src_nip,
+	  int dstfd,
+	  const char *dstname,
+	  const char *dstpath,
+	  unsigned char *dbuf,
+	  size_t *dlenp,
+	  int *dst_fdp) {
+  const char *srcpath = src_nip->p;
+  mode_t mode = src_nip->s.st_mode;
+  off_t sbytes, tbytes;
+  int src_fd = -1, dst_fd = -1, rc = -1;
+  int holed = 0, inplace = 0;
+  struct stat sb;
+  DIGEST d;
+  IOWINDOW iw;
+#if defined(HAVE_AIO_WAITCOMPLETE)
+  BUFFER *bufv[2] = { NULL, NULL };
+  struct aiocb cb[2], *cbp;
+  int ap;
+#else
+  BUFFER *bp = NULL;
+#endif
+
+  
+  if (dst_fdp)
+    *dst_fdp = -1;
+  
+  stats_syscall(STATS_S_OPEN);
+  src_fd = openat(src_nip->dfd, src_nip->n, O_RDONLY|O_NOFOLLOW);
+  if (src_fd < 0) {
+    fprintf(stderr, "%s: Error: %s: open(O_RDONLY): %s\n",
+	    argv0, srcpath, strerror(errno));
+    rc = -1;
+    goto End;
+  }
+  iopace_start(&iw, src_fd, -1, 0);
+
+  if (fstat(src_fd, &sb) < 0) {
+    fprintf(stderr, "%s: Error: %s: fstat: %s\n",
+	    argv0, srcpath, strerror(errno));
+    rc = -1;
+    goto End;
+  }
+
+  if (dbuf && digest_init(&d, f_digest) < 0) {
+    fprintf(stderr, "%s: Error: %s: digest_init(%s): %s\n",
+	    argv0, srcpath, digest_type2str(f_digest), strerror(errno));
+    rc = -1;
+    goto End;
+  }
+  
+#if defined(HAVE_CLONEFILE)
+  /* APFS clone - only possible if the destination doesn't exist */
+  if (!dbuf && clonefile(srcpath, dstpath, CLONE_NOFOLLOW) == 0) {
+    if (f_verbose > 1)
+      printf("  cloned\n");
+    rc = 0;
+    goto End;
+  }
+#endif
+  
+  /* An existing destination is kept (not truncated) for a delta update */
+  dst_fd = openat(dstfd, dstname,
+		  (f_inplace ? O_RDWR : O_WRONLY|O_TRUNC)|O_CREAT|O_NOFOLLOW, mode);
+  if (dst_fd < 0) {
+    fprintf(stderr, "%s: Error: %s: open(O_WRONLY|O_CREAT, 0x%x): %s\n",
+	    argv0, dstpath, mode, strerror(errno));
+    rc = -1;
+    goto End;
+  }
+  iw.dst_fd = dst_fd;
+  
+  sbytes = 0;
+  tbytes = 0;
+
+  if (f_inplace) {
+    off_t wbytes;
+    
+    rc = file_copy_delta(src_fd, dst_fd, &tbytes, &wbytes, dbuf ? &d : NULL, &iw);
+    if (rc < 0) {
+      fprintf(stderr, "%s: Error: %s -> %s: In-place update failed: %s\n",
+	      argv0, srcpath, dstpath, strerror(errno));
+      goto End;
+    }
+    if (rc > 0) {
+      if (f_verbose > 1)
+	printf("  %lld bytes compared, %lld bytes written in place\n",
+	       (long long) tbytes, (long long) wbytes);
+      inplace = 1;
+      goto Done;
+    }
+  }
+
+  /* The contents must pass through our buffers in order to be digested */
+  if (dbuf)
+    goto Loop;
+  
+  rc = file_copy_kernel(src_fd, dst_fd, &sb, &tbytes, &iw);
+  if (rc < 0) {
+    fprintf(stderr, "%s: Error: %s -> %s: copy_file_range: %s\n",
+	    argv0, srcpath, dstpath, strerror(errno));
+    goto End;
+  }
+  if (rc > 0)
+    goto Done;
+
+  if (f_zero) {
+    rc = file_copy_sparse(src_fd, dst_fd, &sb, &tbytes, &iw);
+    if (rc < 0) {
+      fprintf(stderr, "%s: Error: %s -> %s: Sparse copy failed: %s\n",
+	      argv0, srcpath, dstpath, strerror(errno));
+      goto End;
+    }
+    if (rc > 0) {
+      holed = 1;
+      goto Done;
+    }
+  }
+
+#if defined(HAVE_URING)
+  /* Not worth it unless the file needs more than one buffer */
+  if (f_qdepth > 1 && sb.st_size > f_bufsize) {
+    rc = file_copy_uring(src_fd, dst_fd, &sb, &tbytes, &holed, &iw);
+    if (rc < 0) {
+      fprintf(stderr, "%s: Error: %s -> %s: io_uring copy failed: %s\n",
+	      argv0, srcpath, dstpath, strerror(errno));
+      goto End;
+    }
+    if (rc > 0)
+      goto Done;
+  }
+#endif
+
+ Loop:
+#if defined(HAVE_AIO_WAITCOMPLETE)
+  bufv[0] = buffer_get();
+  bufv[1] = buffer_get();
+  if (!bufv[0] || !bufv[1]) {
+    fprintf(stderr, "%s: Error: %s: buffer_get: %s\n",
+	    argv0, srcpath, strerror(errno));
+    rc = -1;
+    goto End;
+  }
+  
+  /* Start first read */
+  memset(&cb, 0, sizeof(cb));
+  cb[0].aio_fildes = src_fd;
+  cb[1].aio_fildes = src_fd;
+  cb[0].aio_buf = bufv[0]->data;
+  cb[1].aio_buf = bufv[1]->data;
+  cb[0].aio_nbytes = bufv[0]->size;
+  cb[1].aio_nbytes = bufv[1]->size;
+  
+  ap = 0;
+  cb[ap].aio_offset = tbytes;
+  if (aio_read(&cb[ap]) < 0) {
+    fprintf(stderr, "%s: Error: %s: aio_read(): %s\n", argv0, srcpath, strerror(errno));
+    exit(1);
+  }
+  
+  cbp = NULL;
+  while ((rc = aio_waitcomplete(&cbp, NULL)) > 0) {
+    sbytes = rc;
+    
+    /* Start next read immediately in order to keep interleave reading & writing */
+    ap = !ap;
+    cb[ap].aio_offset = tbytes+sbytes;
+    if (aio_read(&cb[ap]) < 0) {
+      fprintf(stderr, "%s: Error: aio_read(): %s\n", argv0, strerror(errno));
+      exit(1);
+    }
+    
+    if (dbuf)
+      copy_digest_update(&d, (unsigned char *) cbp->aio_buf, sbytes);
+    
+    if (f_zero && sbytes && buffer_zero_check((const void *) cbp->aio_buf, sbytes)) {
+      holed = 1;
+      rc = lseek(dst_fd, sbytes, SEEK_CUR);
+      if (rc < 0) {
+	fprintf(stderr, "%s: Error: %s: lseek(%ld): %s\n", argv0, dstpath, sbytes, strerror(errno));
+	rc = -1;
+	goto End;
+      }
+    }
+    else {
+      rc = write(dst_fd, (const void *) cbp->aio_buf, sbytes);
+      if (rc < 0) {
 	fprintf(stderr, "%s: Error: %s: write(%ld): %s\n", argv0, dstpath, sbytes, strerror(errno));
 	rc = -1;
 	goto End;
@@ -295,8 +1479,9 @@ file_copy(const char *srcpath,
     }
     
     tbytes += sbytes;
+    iopace_update(&iw, tbytes);
     if (f_verbose > 1)
-      printf("  %ld bytes copied\r", tbytes);
+      copy_progress(tbytes);
     
     cbp = NULL;
   }
@@ -307,9 +1492,20 @@ file_copy(const char *srcpath,
     goto End;
   }
 #else
-  while ((rc = read(src_fd, buf, sizeof(buf))) > 0) {
+  bp = buffer_get();
+  if (!bp) {
+    fprintf(stderr, "%s: Error: %s: buffer_get: %s\n",
+	    argv0, srcpath, strerror(errno));
+    rc = -1;
+    goto End;
+  }
+  
+  while ((rc = read(src_fd, bp->data, bp->size)) > 0) {
     sbytes = rc;
-    if (f_zero && buffer_zero_check(buf, sbytes)) {
+    if (dbuf)
+      copy_digest_update(&d, bp->data, sbytes);
+    
+    if (f_zero && buffer_zero_check(bp->data, sbytes)) {
       holed = 1;
       rc = lseek(dst_fd, sbytes, SEEK_CUR);
       if (rc < 0) {
@@ -320,7 +1516,7 @@ file_copy(const char *srcpath,
       }
     }
     else {
-      rc = write(dst_fd, buf, sbytes);
+      rc = write(dst_fd, bp->data, sbytes);
       if (rc < 0) {
 	fprintf(stderr, "%s: Error: %s: write(%lld): %s\n",
 		argv0, dstpath, (long long) sbytes, strerror(errno));
@@ -329,8 +1525,9 @@ file_copy(const char *srcpath,
       }
     }
     tbytes += sbytes;
+    iopace_update(&iw, tbytes);
     if (f_verbose > 1)
-      printf("  %lld bytes copied\r", (long long) tbytes);
+      copy_progress(tbytes);
   }
   if (rc < 0) {
     fprintf(stderr, "%s: Error: %s: read(): %s\n",
@@ -342,31 +1539,95 @@ file_copy(const char *srcpath,
   rc = sbytes;
 #endif
   
+ Done:
   if (holed) {
-    /* Must write atleast one byte at the end of the file */
-    char z = 0;
-    
-    if (lseek(dst_fd, -1, SEEK_CUR) < 0) {
-      fprintf(stderr, "%s: Error: %s: lseek(-1, SEEK_CUR): %s\n",
-	      argv0, dstpath, strerror(errno));
+    /* Set the final size in case the file ends with a hole */
+    if (ftruncate(dst_fd, tbytes) < 0) {
+      fprintf(stderr, "%s: Error: %s: ftruncate(%lld): %s\n",
+	      argv0, dstpath, (long long) tbytes, strerror(errno));
       rc = -1;
       goto End;
     }
-    if (write(dst_fd, &z, 1) < 0) {
-      fprintf(stderr, "%s: Error: %s: write(NUL, 1): %s\n",
-	      argv0, dstpath, strerror(errno));
+  }
+  
+  if (f_verbose > 1 && !inplace)
+    printf("  %lld bytes copied\n", (long long) tbytes);
+
+  if (dbuf) {
+    ssize_t len;
+    
+    len = digest_final(&d, dbuf, DIGEST_BUFSIZE_MAX);
+    stats_call(STATS_T_DIGEST);
+    if (len < 0) {
+      fprintf(stderr, "%s: Error: %s: digest_final: %s\n",
+	      argv0, srcpath, strerror(errno));
       rc = -1;
       goto End;
     }
+    *dlenp = len;
+    
+    if (f_verify > 1) {
+      unsigned char vbuf[DIGEST_BUFSIZE_MAX];
+      ssize_t vlen;
+      int fd;
+      uint64_t t0;
+
+      /* Flush the copy to storage and drop it from the cache so we read back what was written */
+      if (fsync(dst_fd) < 0) {
+	fprintf(stderr, "%s: Error: %s: fsync: %s\n",
+		argv0, dstpath, strerror(errno));
+	rc = -1;
+	goto End;
+      }
+      
+      fd = openat(dstfd, dstname, O_RDONLY|O_NOFOLLOW);
+      if (fd < 0) {
+	fprintf(stderr, "%s: Error: %s: open(O_RDONLY): %s\n",
+		argv0, dstpath, strerror(errno));
+	rc = -1;
+	goto End;
+      }
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_DONTNEED)
+      (void) posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+      t0 = stats_start();
+      vlen = fd_digest(fd, vbuf, sizeof(vbuf));
+      close(fd);
+      stats_stop(STATS_T_DIGEST, t0);
+      if (vlen < 0) {
+	fprintf(stderr, "%s: Error: %s: Reading back copy: %s\n",
+		argv0, dstpath, strerror(errno));
+	rc = -1;
+	goto End;
+      }
+      stats_count(STATS_C_DBYTES, tbytes);
+      if (vlen != len || memcmp(vbuf, dbuf, len) != 0) {
+	fprintf(stderr, "%s: Error: %s: Verification failed: Contents differ from %s\n",
+		argv0, dstpath, srcpath);
+	errno = EIO;
+	rc = -1;
+	goto End;
+      }
+      if (f_verbose > 1)
+	printf("  verified\n");
+    }
   }
   
-  tbytes += sbytes;
-  if (f_verbose > 1)
-    printf("  %lld bytes copied\n", (long long) tbytes);
-  
  End:
-  if (dst_fd >= 0)
-    close(dst_fd);
+  if (src_fd >= 0)
+    iopace_end(&iw);
+#if defined(HAVE_AIO_WAITCOMPLETE)
+  buffer_put(bufv[1]);
+  buffer_put(bufv[0]);
+#else
+  buffer_put(bp);
+#endif
+  if (dst_fd >= 0) {
+    if (rc >= 0 && dst_fdp)
+      *dst_fdp = dst_fd;
+    else
+      close(dst_fd);
+  }
   if (src_fd >= 0)
     close(src_fd);
   
@@ -394,6 +1655,8 @@ attr_update(const char *key,
       return 0; /* Already exists, and is identical */
   }
 
+  if (aup->fd >= 0)
+    return attr_fset(aup->fd, aup->ns, key, aip->buf, aip->len);
   return attr_set(aup->pn, aup->ns, key, aip->buf, aip->len, ATTR_FLAG_NOFOLLOW);
 }
 
@@ -418,91 +1681,303 @@ attr_remove(const char *key,
   }
 
   /* Nope - so delete it */
+  if (aup->fd >= 0)
+    return attr_fdelete(aup->fd, aup->ns, key);
   return attr_delete(aup->pn, aup->ns, key, ATTR_FLAG_NOFOLLOW);
 }
 
 
 
+
+#if defined(ACL_TYPE_NFS4) || defined(ACL_TYPE_ACCESS) || defined(ACL_TYPE_DEFAULT)
+static unsigned long
+acl_intern_hash(const void *obj) {
+  return acl_hash((acl_t) obj);
+}
+
+static int
+acl_intern_cmp(const void *a,
+	       const void *b) {
+  return acl_compare((acl_t) a, (acl_t) b);
+}
+
+static void
+acl_intern_free(void *obj) {
+  acl_free(obj);
+}
+
+static acl_t
+node_acl_intern(acl_t ap,
+		int *errp) {
+  acl_t iap;
+
+  
+  /* Called with the result of each acl_get_*() */
+  stats_syscall(STATS_S_ACL);
+  iap = (acl_t) intern_get(acl_intern, ap);
+  if (ap && !iap)
+    *errp = errno;
+  return iap;
+}
+#endif
+
+
+#if defined(ACL_TYPE_NFS4) || defined(ACL_TYPE_ACCESS) || defined(ACL_TYPE_DEFAULT)
 /*
- * Update node metadata 
+ * Compare one type of ACL of two nodes. If both are trivial then
+ * only the permission bits need to be checked.
  */
-int
-node_update(NODE *src_nip,
-	    NODE *dst_nip,
-	    const char *dstpath) {
-  int rc = 0, xrc;
+static int
+node_acl_compare(NODE *a,
+		 NODE *b,
+		 acl_type_t type) {
+  /* The ACLs are interned (see node_acl_intern) - equal ones are the same object */
+  switch (type) {
+#if defined(ACL_TYPE_NFS4)
+  case ACL_TYPE_NFS4:
+    if (a->a->t & b->a->t & NODE_ACL_NFS4_TRIVIAL)
+      return (a->s.st_mode & (S_IRWXU|S_IRWXG|S_IRWXO)) != (b->s.st_mode & (S_IRWXU|S_IRWXG|S_IRWXO));
+    return a->a->nfs != b->a->nfs;
+#endif
+#if defined(ACL_TYPE_ACCESS)
+  case ACL_TYPE_ACCESS:
+    if (a->a->t & b->a->t & NODE_ACL_ACC_TRIVIAL)
+      return (a->s.st_mode & (S_IRWXU|S_IRWXG|S_IRWXO)) != (b->s.st_mode & (S_IRWXU|S_IRWXG|S_IRWXO));
+    return a->a->acc != b->a->acc;
+#endif
+#if defined(ACL_TYPE_DEFAULT)
+  case ACL_TYPE_DEFAULT:
+    return a->a->def != b->a->def;
+#endif
+  }
+  return -1;
+}
+#endif
 
 
-  if (f_owner) {
-    if (!dst_nip ||
-        src_nip->s.st_uid != dst_nip->s.st_uid ||
-	src_nip->s.st_gid != dst_nip->s.st_gid) {
-      if (src_nip->s.st_uid == getuid() || geteuid() == 0) {
-	xrc = lchown(dstpath, src_nip->s.st_uid, src_nip->s.st_gid);
-        if (xrc < 0 && errno != EPERM) {
-	  fprintf(stderr, "%s: Error: %s: lchown: %s\n",
-		  argv0, dstpath, strerror(errno));
-          if (!f_ignore)
-            return xrc;
-          rc = xrc;
-	}
-      }
-    }
+/*
+ * Metadata operations needed to bring a destination node up to date
+ */
+#define NODE_UPDATE_OWNER 0x0001
+#define NODE_UPDATE_MODE  0x0002
+#define NODE_UPDATE_ATTRS 0x0004
+#define NODE_UPDATE_ACLS  0x0008
+#define NODE_UPDATE_TIMES 0x0010
+#define NODE_UPDATE_FLAGS 0x0020
+
+#if defined(HAVE_LCHFLAGS)
+/* XXX: Should we care about the UF_ARCHIVE flag here? */
+# ifdef UF_ARCHIVE
+#  define XUF_ARCHIVE UF_ARCHIVE
+# else
+#  define XUF_ARCHIVE 0
+# endif
+#endif
+
+
+/*
+ * Work out which operations are needed. 'cur' is the current state
+ * of the destination object (NULL if unknown) and dst_nip the
+ * destination node, if there was one before.
+ */
+static int
+node_update_plan(NODE *src_nip,
+		 NODE *dst_nip,
+		 NSTAT *cur) {
+  int plan = 0;
+
+
+  if (f_owner &&
+      (!cur || src_nip->s.st_uid != cur->st_uid || src_nip->s.st_gid != cur->st_gid) &&
+      (src_nip->s.st_uid == getuid() || geteuid() == 0))
+    plan |= NODE_UPDATE_OWNER;
+
+  /* A chown may have cleared the setuid/setgid bits */
+  if (f_perms &&
+      (!cur || src_nip->s.st_mode != cur->st_mode ||
+       ((plan & NODE_UPDATE_OWNER) && (src_nip->s.st_mode & (S_ISUID|S_ISGID)))))
+    plan |= NODE_UPDATE_MODE;
+
+  /* Interned attribute sets are the same object if equal */
+  if (f_attrs) {
+    if (!dst_nip || f_force)
+      plan |= NODE_UPDATE_ATTRS;
+#if defined(ATTR_NAMESPACE_USER)
+    else if (src_nip->x->usr != dst_nip->x->usr)
+      plan |= NODE_UPDATE_ATTRS;
+#endif
+#if defined(ATTR_NAMESPACE_SYSTEM)
+    else if (src_nip->x->sys != dst_nip->x->sys)
+      plan |= NODE_UPDATE_ATTRS;
+#endif
   }
+
+  /* The ACL types are compared one by one when applied */
+  if (f_acls)
+    plan |= NODE_UPDATE_ACLS;
+
+  if (f_times > 1) {
+    if (!cur ||
+#if defined(HAVE_UTIMENSAT)
+#if defined(__APPLE__)
+        timespec_compare(&src_nip->s.st_mtimespec, &cur->st_mtimespec) ||
+        timespec_compare(&src_nip->s.st_atimespec, &cur->st_atimespec)
+#else
+        timespec_compare(&src_nip->s.st_mtim, &cur->st_mtim) ||
+	timespec_compare(&src_nip->s.st_atim, &cur->st_atim)
+#endif
+#else
+        difftime(src_nip->s.st_mtime, cur->st_mtime) ||
+        difftime(src_nip->s.st_atime, cur->st_atime)
+#endif
+	)
+      plan |= NODE_UPDATE_TIMES;
+  }
+
+#if defined(HAVE_LCHFLAGS)
+  if (f_flags &&
+      (!cur || (src_nip->s.st_flags & ~XUF_ARCHIVE) != (cur->st_flags & ~XUF_ARCHIVE)))
+    plan |= NODE_UPDATE_FLAGS;
+#endif
+
+  return plan;
+}
+
+
+/*
+ * fchmodat() that never follows a symlink in the last component. Older
+ * C libraries don't support AT_SYMLINK_NOFOLLOW here at all - then
+ * check that it isn't a symlink first.
+ */
+static int
+fchmodat_nofollow(int dfd,
+		  const char *name,
+		  mode_t mode) {
+  struct stat sb;
+
   
-  if (f_perms) {
+  if (fchmodat(dfd, name, mode, AT_SYMLINK_NOFOLLOW) == 0)
+    return 0;
+  if (errno != EOPNOTSUPP && errno != ENOTSUP)
+    return -1;
+
+  if (fstatat(dfd, name, &sb, AT_SYMLINK_NOFOLLOW) < 0)
+    return -1;
+  if (S_ISLNK(sb.st_mode)) {
+    errno = ELOOP;
+    return -1;
+  }
+  return fchmodat(dfd, name, mode, 0);
+}
+
+
+/*
+ * Update node metadata. If fd is an open descriptor for the
+ * destination (from file_copy) then the updates are done through it.
+ */
+static int
+node_update_apply(NODE *src_nip,
+		  NODE *dst_nip,
+		  int fd,
+		  int dstfd,
+		  const char *dstname,
+		  const char *dstpath) {
+  int rc = 0, xrc, plan;
+  NSTAT cur, *curp = NULL;
+  struct stat sb;
+
+
+  /*
+   * Find out what the destination looks like now. A freshly created
+   * object often already has the right owner and mode.
+   */
+  if (fd >= 0) {
+    if (fstat(fd, &sb) == 0) {
+      nstat_set(&cur, &sb);
+      curp = &cur;
+    }
+  } else if (dst_nip) {
+    curp = &dst_nip->s;
+  } else if (f_owner || f_perms || f_times > 1 || f_flags) {
+    if (fstatat(dstfd, dstname, &sb, AT_SYMLINK_NOFOLLOW) == 0) {
+      nstat_set(&cur, &sb);
+      curp = &cur;
+    }
+  }
+
+  plan = node_update_plan(src_nip, dst_nip, curp);
+  if (f_debug)
+    fprintf(stderr, "*** node_update: %s: plan=0x%x\n", dstpath, plan);
+
+  if (plan & NODE_UPDATE_OWNER) {
+    if (fd >= 0)
+      xrc = fchown(fd, src_nip->s.st_uid, src_nip->s.st_gid);
+    else
+      xrc = fchownat(dstfd, dstname, src_nip->s.st_uid, src_nip->s.st_gid, AT_SYMLINK_NOFOLLOW);
+    if (xrc < 0 && errno != EPERM) {
+      fprintf(stderr, "%s: Error: %s: fchownat: %s\n",
+	      argv0, dstpath, strerror(errno));
+      if (!f_ignore)
+	return xrc;
+      rc = xrc;
+    }
+  }
+
+  if (plan & NODE_UPDATE_MODE) {
     /* Must be done after lchown() in case it clears setuid/setgid bits */
-    if (!dst_nip ||
-        src_nip->s.st_mode != dst_nip->s.st_mode) {
-      if (S_ISLNK(src_nip->s.st_mode)) {
+    if (S_ISLNK(src_nip->s.st_mode)) {
 #if HAVE_LCHMOD
-        xrc = lchmod(dstpath, src_nip->s.st_mode);
+      xrc = lchmod(dstpath, src_nip->s.st_mode);
 #else
-        xrc = -1;
-        errno = ENOSYS;
-#endif
-        if (xrc < 0) {
-          fprintf(stderr, "%s: Error: %s: lchmod: %s\n",
-                  argv0, dstpath, strerror(errno));
-	  if (!f_ignore)
-	    return xrc;
-	  rc = xrc;
-	}
-      } else {
-        xrc = chmod(dstpath, src_nip->s.st_mode);
-	if (xrc < 0) {
-          fprintf(stderr, "%s: Error: %s: chmod: %s\n",
-                  argv0, dstpath, strerror(errno));
-	  if (!f_ignore)
-	    return xrc;
-	  rc = xrc;
-	}
+      xrc = -1;
+      errno = ENOSYS;
+#endif
+      /* Symlink permissions can't be changed (and don't matter) on some systems */
+      if (xrc < 0 && errno != EOPNOTSUPP) {
+	fprintf(stderr, "%s: Error: %s: lchmod: %s\n",
+		argv0, dstpath, strerror(errno));
+	if (!f_ignore)
+	  return xrc;
+	rc = xrc;
+      }
+    } else {
+      if (fd >= 0)
+	xrc = fchmod(fd, src_nip->s.st_mode);
+      else
+	xrc = fchmodat_nofollow(dstfd, dstname, src_nip->s.st_mode);
+      if (xrc < 0) {
+	fprintf(stderr, "%s: Error: %s: fchmodat: %s\n",
+		argv0, dstpath, strerror(errno));
+	if (!f_ignore)
+	  return xrc;
+	rc = xrc;
       }
     }
   }
-  
-  if (f_attrs) {
+
+  if (plan & NODE_UPDATE_ATTRS) {
     ATTRUPDATE aub;
 
     aub.pn = dstpath;
-    
+    aub.fd = fd;
+
 #if defined(ATTR_NAMESPACE_USER)
-    if (src_nip->x.usr) {
+    if (src_nip->x->usr) {
       aub.ns = ATTR_NAMESPACE_USER;
-      aub.attrs = dst_nip ? dst_nip->x.usr : NULL;
-      
-      xrc = btree_foreach(src_nip->x.usr, attr_update, &aub);
+      aub.attrs = dst_nip ? dst_nip->x->usr : NULL;
+
+      xrc = btree_foreach(src_nip->x->usr, attr_update, &aub);
       if (xrc < 0) {
         if (!f_ignore)
           return xrc;
         rc = xrc;
       }
     }
-    if (dst_nip && dst_nip->x.usr) {
+    if (dst_nip && dst_nip->x->usr) {
       aub.ns = ATTR_NAMESPACE_USER;
-      aub.attrs = src_nip ? src_nip->x.usr : NULL;
-      
-      xrc = btree_foreach(dst_nip->x.usr, attr_remove, &aub);
+      aub.attrs = src_nip ? src_nip->x->usr : NULL;
+
+      xrc = btree_foreach(dst_nip->x->usr, attr_remove, &aub);
       if (xrc < 0) {
 	if (!f_ignore)
 	  return xrc;
@@ -511,22 +1986,22 @@ node_update(NODE *src_nip,
     }
 #endif
 #if defined(ATTR_NAMESPACE_SYSTEM)
-    if (src_nip->x.sys) {
+    if (src_nip->x->sys) {
       aub.ns = ATTR_NAMESPACE_SYSTEM;
-      aub.attrs = dst_nip ? dst_nip->x.sys : NULL;
-      
-      xrc = btree_foreach(src_nip->x.sys, attr_update, &aub);
+      aub.attrs = dst_nip ? dst_nip->x->sys : NULL;
+
+      xrc = btree_foreach(src_nip->x->sys, attr_update, &aub);
       if (xrc < 0) {
         if (!f_ignore)
           return xrc;
         rc = xrc;
       }
     }
-    if (dst_nip && dst_nip->x.sys) {
+    if (dst_nip && dst_nip->x->sys) {
       aub.ns = ATTR_NAMESPACE_SYSTEM;
-      aub.attrs = src_nip ? src_nip->x.sys : NULL;
-      
-      xrc = btree_foreach(dst_nip->x.sys, attr_remove, &aub);
+      aub.attrs = src_nip ? src_nip->x->sys : NULL;
+
+      xrc = btree_foreach(dst_nip->x->sys, attr_remove, &aub);
       if (xrc < 0) {
 	if (!f_ignore)
 	  return xrc;
@@ -535,17 +2010,17 @@ node_update(NODE *src_nip,
     }
 #endif
   }
-  
-  if (f_acls) {
+
+  if (plan & NODE_UPDATE_ACLS) {
 #if defined(ACL_TYPE_NFS4)
-    if (f_nfsonly == 0 || (f_nfsonly == 1 && !src_nip->a.nfs)) {
+    if (f_nfsonly == 0 || (f_nfsonly == 1 && !src_nip->a->nfs)) {
 #endif
 #if defined(ACL_TYPE_ACCESS)
-      if (src_nip->a.acc) {
-        if (!dst_nip || acl_compare(src_nip->a.acc, dst_nip->a.acc) != 0) {
+      if (src_nip->a->acc) {
+        if (!dst_nip || node_acl_compare(src_nip, dst_nip, ACL_TYPE_ACCESS) != 0) {
           if (S_ISLNK(src_nip->s.st_mode)) {
 #if HAVE_ACL_SET_LINK_NP
-            xrc = acl_set_link_np(dstpath, ACL_TYPE_ACCESS, src_nip->a.acc);
+            xrc = acl_set_link_np(dstpath, ACL_TYPE_ACCESS, src_nip->a->acc);
 #else
             errno = ENOSYS;
             xrc = -1;
@@ -558,7 +2033,12 @@ node_update(NODE *src_nip,
               rc = xrc;
             }
           } else {
-            xrc = acl_set_file(dstpath, ACL_TYPE_ACCESS, src_nip->a.acc);
+#if HAVE_ACL_SET_FD
+	    if (fd >= 0)
+	      xrc = acl_set_fd(fd, src_nip->a->acc);
+	    else
+#endif
+	      xrc = acl_set_file(dstpath, ACL_TYPE_ACCESS, src_nip->a->acc);
             if (xrc < 0) {
               fprintf(stderr, "%s: Error: %s: acl_set_file(ACL_TYPE_ACCESS): %s\n",
                       argv0, dstpath, strerror(errno));
@@ -570,13 +2050,13 @@ node_update(NODE *src_nip,
         }
       }
 #endif
-      
+
 #if defined(ACL_TYPE_DEFAULT)
-      if (src_nip->a.def) {
-        if (!dst_nip || acl_compare(src_nip->a.def, dst_nip->a.def) != 0) {
+      if (src_nip->a->def) {
+        if (!dst_nip || node_acl_compare(src_nip, dst_nip, ACL_TYPE_DEFAULT) != 0) {
           if (S_ISLNK(src_nip->s.st_mode)) {
 #if HAVE_ACL_SET_LINK_NP
-            xrc = acl_set_link_np(dstpath, ACL_TYPE_DEFAULT, src_nip->a.def);
+            xrc = acl_set_link_np(dstpath, ACL_TYPE_DEFAULT, src_nip->a->def);
 #else
             errno = ENOSYS;
             xrc = -1;
@@ -589,7 +2069,7 @@ node_update(NODE *src_nip,
               rc = xrc;
             }
           } else {
-            xrc = acl_set_file(dstpath, ACL_TYPE_DEFAULT, src_nip->a.def);
+            xrc = acl_set_file(dstpath, ACL_TYPE_DEFAULT, src_nip->a->def);
             if (xrc < 0) {
               fprintf(stderr, "%s: Error: %s: acl_set_link_np(ACL_TYPE_DEFAULT): %s\n",
                       argv0, dstpath, strerror(errno));
@@ -604,14 +2084,14 @@ node_update(NODE *src_nip,
 #if defined(ACL_TYPE_NFS4)
     } /* Ignore Posix ACL if we've already got NFS ACL */
 #endif
-    
+
     /* Set NFSv4/ZFS/Extended ACLs after POSIX ACLs in of both */
 #if defined(ACL_TYPE_NFS4)
-    if (src_nip->a.nfs) {
-      if (!dst_nip || acl_compare(src_nip->a.nfs, dst_nip->a.nfs) != 0) {
+    if (src_nip->a->nfs) {
+      if (!dst_nip || node_acl_compare(src_nip, dst_nip, ACL_TYPE_NFS4) != 0) {
         if (S_ISLNK(src_nip->s.st_mode)) {
 #if defined(HAVE_ACL_SET_LINK_NP)
-          xrc = acl_set_link_np(dstpath, ACL_TYPE_NFS4, src_nip->a.nfs);
+          xrc = acl_set_link_np(dstpath, ACL_TYPE_NFS4, src_nip->a->nfs);
 #else
           errno = ENOSYS;
           xrc = -1;
@@ -624,9 +2104,15 @@ node_update(NODE *src_nip,
             rc = xrc;
           }
         } else {
-	  fprintf(stderr, "setting ACL on file '%s'\n", dstpath);
-	  
-	  xrc = acl_set_file(dstpath, ACL_TYPE_NFS4, src_nip->a.nfs);
+	  if (f_debug)
+	    fprintf(stderr, "setting ACL on file '%s'\n", dstpath);
+
+#if defined(HAVE_ACL_SET_FD_NP)
+	  if (fd >= 0)
+	    xrc = acl_set_fd_np(fd, src_nip->a->nfs, ACL_TYPE_NFS4);
+	  else
+#endif
+	    xrc = acl_set_file(dstpath, ACL_TYPE_NFS4, src_nip->a->nfs);
 	  if (xrc < 0) {
 	    fprintf(stderr, "%s: Error: %s: acl_set_file(ACL_TYPE_NFS4): %s\n",
 		    argv0, dstpath, strerror(errno));
@@ -639,84 +2125,73 @@ node_update(NODE *src_nip,
     }
 #endif
   }
-  
-  if (f_times > 1) {
+
+  if (plan & NODE_UPDATE_TIMES) {
 #if defined(HAVE_UTIMENSAT)
-    if (!dst_nip ||
+    struct timespec times[2];
+
 #if defined(__APPLE__)
-        timespec_compare(&src_nip->s.st_mtimespec, &dst_nip->s.st_mtimespec) ||
-        timespec_compare(&src_nip->s.st_atimespec, &dst_nip->s.st_atimespec)
+    times[0] = src_nip->s.st_atimespec;
+    times[1] = src_nip->s.st_mtimespec;
 #else
-        timespec_compare(&src_nip->s.st_mtim, &dst_nip->s.st_mtim) ||
-	timespec_compare(&src_nip->s.st_atim, &dst_nip->s.st_atim)
+    times[0] = src_nip->s.st_atim;
+    times[1] = src_nip->s.st_mtim;
 #endif
-        ) {
-      struct timespec times[2];
-      
-#if defined(__APPLE__)
-      times[0] = src_nip->s.st_atimespec;
-      times[1] = src_nip->s.st_mtimespec;
-#else
-      times[0] = src_nip->s.st_atim;
-      times[1] = src_nip->s.st_mtim;
+
+#if defined(HAVE_FUTIMENS)
+    if (fd >= 0)
+      xrc = futimens(fd, times);
+    else
 #endif
-      
-      xrc = utimensat(AT_FDCWD, dstpath, times, AT_SYMLINK_NOFOLLOW);
-      if (xrc < 0) {
-	fprintf(stderr, "%s: Error: utimensat(%s): %s\n",
-		argv0, dstpath, strerror(errno));
-        if (!f_ignore)
-          return xrc;
-        rc = xrc;
-      }
+      xrc = utimensat(dstfd, dstname, times, AT_SYMLINK_NOFOLLOW);
+    if (xrc < 0) {
+      fprintf(stderr, "%s: Error: utimensat(%s): %s\n",
+	      argv0, dstpath, strerror(errno));
+      if (!f_ignore)
+	return xrc;
+      rc = xrc;
     }
 #else
-    if (!dst_nip ||
-        difftime(src_nip->s.st_mtime, dst_nip->s.st_mtime) ||
-        difftime(src_nip->s.st_mtime, dst_nip->s.st_mtime)) {
-      struct timeval times[2];
-      
-      times[0].tv_sec = src_nip->s.st_atime;
-      times[1].tv_sec = src_nip->s.st_mtime;
-
-      if (S_ISLNK(dst_nip->s.st_mode)) {
-	xrc = lutimes(dstpath, times);
-        if (xrc < 0)
-          fprintf(stderr, "%s: Error: lutimens(%s): %s\n",
-                  argv0, dstpath, strerror(errno));
-      } else {
-	xrc = utimes(dstpath, times);
-        if (xrc < 0)
-          fprintf(stderr, "%s: Error: utimens(%s): %s\n",
-                  argv0, dstpath, strerror(errno));
-      }
-      if (xrc < 0) {
-        if (!f_ignore)
-          return xrc;
-        rc = xrc;
-      }
+    struct timeval times[2];
+
+    times[0].tv_sec = src_nip->s.st_atime;
+    times[0].tv_usec = 0;
+    times[1].tv_sec = src_nip->s.st_mtime;
+    times[1].tv_usec = 0;
+
+    if (S_ISLNK(src_nip->s.st_mode)) {
+      xrc = lutimes(dstpath, times);
+      if (xrc < 0)
+	fprintf(stderr, "%s: Error: lutimens(%s): %s\n",
+		argv0, dstpath, strerror(errno));
+    } else {
+      xrc = utimes(dstpath, times);
+      if (xrc < 0)
+	fprintf(stderr, "%s: Error: utimens(%s): %s\n",
+		argv0, dstpath, strerror(errno));
+    }
+    if (xrc < 0) {
+      if (!f_ignore)
+	return xrc;
+      rc = xrc;
     }
 #endif
   }
-  
+
 #if defined(HAVE_LCHFLAGS)
-  /* XXX: Should we care about the UF_ARCHIVE flag here? */
-# ifdef UF_ARCHIVE
-#  define XUF_ARCHIVE UF_ARCHIVE
-# else
-#  define XUF_ARCHIVE 0
-# endif
-  if (f_flags) {
-    if (!dst_nip ||
-        (src_nip->s.st_flags & ~XUF_ARCHIVE) != (dst_nip->s.st_flags & ~XUF_ARCHIVE)) {
+  if (plan & NODE_UPDATE_FLAGS) {
+#if defined(HAVE_FCHFLAGS)
+    if (fd >= 0)
+      xrc = fchflags(fd, (src_nip->s.st_flags & ~XUF_ARCHIVE));
+    else
+#endif
       xrc = lchflags(dstpath, (src_nip->s.st_flags & ~XUF_ARCHIVE));
-      if (xrc < 0) {
-	fprintf(stderr, "%s: Error: %s: lchflags: %s\n",
-		argv0, dstpath, strerror(errno));
-        if (!f_ignore)
-          return xrc;
-        rc = xrc;
-      }
+    if (xrc < 0) {
+      fprintf(stderr, "%s: Error: %s: lchflags: %s\n",
+	      argv0, dstpath, strerror(errno));
+      if (!f_ignore)
+	return xrc;
+      rc = xrc;
     }
   }
 
@@ -736,7 +2211,24 @@ node_update(NODE *src_nip,
   }
 #endif
 #endif
+
+  return rc;
+}
+
+
+int
+node_update(NODE *src_nip,
+	    NODE *dst_nip,
+	    int fd,
+	    int dstfd,
+	    const char *dstname,
+	    const char *dstpath) {
+  uint64_t t0 = stats_start();
+  int rc;
+
   
+  rc = node_update_apply(src_nip, dst_nip, fd, dstfd, dstname, dstpath);
+  stats_stop(STATS_T_UPDATE, t0);
   return rc;
 }
 
@@ -745,13 +2237,18 @@ node_update(NODE *src_nip,
  * Allocate an empty node
  */
 NODE *
-node_alloc(void) {
-  NODE *nip = malloc(sizeof(*nip));
+node_alloc(ARENA *ap) {
+  NODE *nip = ap ? arena_alloc(ap, sizeof(*nip)) : malloc(sizeof(*nip));
 
   if (!nip)
     return NULL;
 
   memset(nip, 0, sizeof(*nip));
+  nip->arena = ap;
+  nip->dfd = AT_FDCWD;
+  nip->a = &node_noacls;
+  nip->x = &node_noattrs;
+  nip->d = &node_nodigest;
   return nip;
 }
 
@@ -767,7 +2264,8 @@ node_free(void *vp) {
     return;
 
   if (nip->p) {
-    free(nip->p);
+    if (!nip->arena)
+      free(nip->p);
     nip->p = NULL;
   }
   
@@ -777,39 +2275,70 @@ node_free(void *vp) {
   }
 
 #if defined(ACL_TYPE_NFS4)
-  if (nip->a.nfs) {
-    acl_free(nip->a.nfs);
-    nip->a.nfs = NULL;
+  if (nip->a->nfs) {
+    intern_release(acl_intern, nip->a->nfs);
+    nip->a->nfs = NULL;
   }
 #endif
 #if defined(ACL_TYPE_ACCESS)
-  if (nip->a.acc) {
-    acl_free(nip->a.acc);
-    nip->a.acc = NULL;
+  if (nip->a->acc) {
+    intern_release(acl_intern, nip->a->acc);
+    nip->a->acc = NULL;
   }
 #endif
 #if defined(ACL_TYPE_DEFAULT)
-  if (nip->a.def) {
-    acl_free(nip->a.def);
-    nip->a.def = NULL;
+  if (nip->a->def) {
+    intern_release(acl_intern, nip->a->def);
+    nip->a->def = NULL;
   }
 #endif
 
 #if defined(ATTR_NAMESPACE_USER)
-  if (nip->x.usr) {
-    btree_destroy(nip->x.usr);
-    nip->x.usr = NULL;
+  if (nip->x->usr) {
+    intern_release(attrs_intern, nip->x->usr);
+    nip->x->usr = NULL;
   }
 #endif
 #if defined(ATTR_NAMESPACE_SYSTEM)
-  if (nip->x.sys) {
-    btree_destroy(nip->x.sys);
-    nip->x.sys = NULL;
+  if (nip->x->sys) {
+    intern_release(attrs_intern, nip->x->sys);
+    nip->x->sys = NULL;
   }
 #endif
+
+  if (nip->a != &node_noacls)
+    free(nip->a);
+  if (nip->x != &node_noattrs)
+    free(nip->x);
+  if (nip->d != &node_nodigest)
+    free(nip->d);
   
-  free(nip);
+  if (!nip->arena)
+    free(nip);
+}
+
+
+#if defined(HAVE_STATX)
+/*
+ * Only ask statx() for what the enabled checks will look at
+ */
+static unsigned int
+node_statx_mask(void) {
+  unsigned int mask = STATX_TYPE|STATX_MODE|STATX_INO|STATX_SIZE|STATX_MTIME;
+
+  if (f_verbose > 1)
+    return mask|STATX_BASIC_STATS;
+  if (f_owner)
+    mask |= STATX_UID|STATX_GID;
+  if (f_times > 1)
+    mask |= STATX_ATIME;
+  if (f_dcache)
+    mask |= STATX_CTIME;
+  if (f_hardlinks)
+    mask |= STATX_NLINK;
+  return mask;
 }
+#endif
 
 
 /*
@@ -818,21 +2347,38 @@ node_free(void *vp) {
 int
 node_get(NODE *nip,
 	 const char *path) {
+#if defined(HAVE_STATX)
+  struct statx sx;
+#else
+  struct stat sb;
+#endif
+  uint64_t t0;
+  int rc, err = 0;
+
+
   if (f_debug)
     fprintf(stderr, "*** node_get(%s, %s)\n",
 	    nip->p ? nip->p : "<null>",
 	    path ? path : "<null>");
   
   if (path) {
-    if (nip->p)
-      free(nip->p);
-    nip->p = strdup(path);
+    if (nip->arena)
+      nip->p = arena_strdup(nip->arena, path);
+    else {
+      if (nip->p)
+	free(nip->p);
+      nip->p = strdup(path);
+    }
+    nip->dfd = AT_FDCWD;
+    nip->n = nip->p;
   }
 
   if (!nip->p) {
     errno = EINVAL;
     return -1;
   }
+  if (!nip->n)
+    nip->n = nip->p;
 
   if (nip->l) {
     free(nip->l);
@@ -840,106 +2386,269 @@ node_get(NODE *nip,
   }
 
 #if defined(ACL_TYPE_NFS4)
-  if (nip->a.nfs) {
-    acl_free(nip->a.nfs);
-    nip->a.nfs = NULL;
+  if (nip->a->nfs) {
+    intern_release(acl_intern, nip->a->nfs);
+    nip->a->nfs = NULL;
   }
 #endif
 #if defined(ACL_TYPE_ACCESS)
-  if (nip->a.acc) {
-    acl_free(nip->a.acc);
-    nip->a.acc = NULL;
+  if (nip->a->acc) {
+    intern_release(acl_intern, nip->a->acc);
+    nip->a->acc = NULL;
   }
 #endif
 #if defined(ACL_TYPE_DEFAULT)
-  if (nip->a.def) {
-    acl_free(nip->a.def); 
-    nip->a.def = NULL;
+  if (nip->a->def) {
+    intern_release(acl_intern, nip->a->def);
+    nip->a->def = NULL;
   }
 #endif
 
 #if defined(ATTR_NAMESPACE_USER)
-  if (nip->x.usr) {
-    btree_destroy(nip->x.usr);
-    nip->x.usr = NULL;
+  if (nip->x->usr) {
+    intern_release(attrs_intern, nip->x->usr);
+    nip->x->usr = NULL;
   }
 #endif
 #if defined(ATTR_NAMESPACE_SYSTEM)
-  if (nip->x.sys) {
-    btree_destroy(nip->x.sys);
-    nip->x.sys = NULL;
+  if (nip->x->sys) {
+    intern_release(attrs_intern, nip->x->sys);
+    nip->x->sys = NULL;
   }
 #endif
   
-  nip->d.len = 0;
+  if (nip->d != &node_nodigest) {
+    nip->d->len = 0;
+    nip->d->valid = 0;
+  }
 
-  if (lstat(nip->p, &nip->s) < 0)
+  t0 = stats_start();
+  stats_syscall(STATS_S_STAT);
+#if defined(HAVE_STATX)
+  rc = statx(nip->dfd, nip->n, AT_SYMLINK_NOFOLLOW, node_statx_mask(), &sx);
+  if (rc == 0)
+    nstat_set_statx(&nip->s, &sx);
+#else
+  rc = fstatat(nip->dfd, nip->n, &sb, AT_SYMLINK_NOFOLLOW);
+  if (rc == 0)
+    nstat_set(&nip->s, &sb);
+#endif
+  if (rc < 0) {
+    stats_stop(STATS_T_SCAN, t0);
     return -1;
+  }
   
   if (S_ISLNK(nip->s.st_mode)) {
     char buf[1024];
     ssize_t len;
     
-    len = readlink(nip->p, buf, sizeof(buf)-1);
+    stats_syscall(STATS_S_READLINK);
+    len = readlinkat(nip->dfd, nip->n, buf, sizeof(buf)-1);
     if (len < 0) {
+      stats_stop(STATS_T_SCAN, t0);
       if (f_verbose)
 	fprintf(stderr, "%s: Error: %s: readlink: %s\n",
 		argv0, nip->p, strerror(errno));
       return -1;
     } else {
       nip->l = strndup(buf, len);
-      if (!nip->l)
-	abort(); /* XXX: Better error handling */
+      if (!nip->l) {
+	stats_stop(STATS_T_SCAN, t0);
+	return -1;
+      }
     }
   }
-  
+  stats_stop(STATS_T_SCAN, t0);
+
+  t0 = (f_acls || f_attrs) ? stats_start() : 0;
   if (f_acls) {
+    if (nip->a == &node_noacls) {
+      nip->a = malloc(sizeof(*nip->a));
+      if (!nip->a)
+	abort(); /* XXX: Better error handling */
+      memset(nip->a, 0, sizeof(*nip->a));
+    }
+    
     if (S_ISLNK(nip->s.st_mode)) {
 #if defined(HAVE_ACL_GET_LINK_NP)
 #if defined(ACL_TYPE_NFS4)
-      nip->a.nfs = acl_get_link_np(nip->p, ACL_TYPE_NFS4);
+      nip->a->nfs = node_acl_intern(acl_get_link_np(nip->p, ACL_TYPE_NFS4), &err);
 #endif
 #if defined(ACL_TYPE_ACCESS)
-      nip->a.acc = acl_get_link_np(nip->p, ACL_TYPE_ACCESS);
+      nip->a->acc = node_acl_intern(acl_get_link_np(nip->p, ACL_TYPE_ACCESS), &err);
 #endif
 #if defined(ACL_TYPE_DEFAULT)
-      nip->a.def = acl_get_link_np(nip->p, ACL_TYPE_DEFAULT);
+      nip->a->def = node_acl_intern(acl_get_link_np(nip->p, ACL_TYPE_DEFAULT), &err);
 #endif
 #else
-      errno = ENOSYS;
-      return -1;
+      /* No way to get them (Linux doesn't have ACLs on symlinks) */
 #endif
     } else {
 #if defined(ACL_TYPE_NFS4)
-      nip->a.nfs = acl_get_file(nip->p, ACL_TYPE_NFS4);
+      nip->a->nfs = node_acl_intern(acl_get_file(nip->p, ACL_TYPE_NFS4), &err);
 #endif
 #if defined(ACL_TYPE_ACCESS)
-      nip->a.acc = acl_get_file(nip->p, ACL_TYPE_ACCESS);
+      nip->a->acc = node_acl_intern(acl_get_file(nip->p, ACL_TYPE_ACCESS), &err);
 #endif
 #if defined(ACL_TYPE_DEFAULT)
-      nip->a.def = acl_get_file(nip->p, ACL_TYPE_DEFAULT);
+      nip->a->def = node_acl_intern(acl_get_file(nip->p, ACL_TYPE_DEFAULT), &err);
 #endif
     }
+
+    /* ACLs that the mode bits describe completely are compared by the mode */
+    nip->a->t = 0;
+#if defined(ACL_TYPE_NFS4)
+    if (acl_is_trivial(nip->a->nfs))
+      nip->a->t |= NODE_ACL_NFS4_TRIVIAL;
+#endif
+#if defined(ACL_TYPE_ACCESS)
+    if (acl_is_trivial(nip->a->acc))
+      nip->a->t |= NODE_ACL_ACC_TRIVIAL;
+#endif
   }
   
-  if (f_attrs) {
+  /*
+   * An ACL or attribute set that couldn't be interned (out of memory)
+   * fails the node - it must not be compared as if it had none
+   */
+  if (f_attrs && !err) {
+    if (nip->x == &node_noattrs) {
+      nip->x = malloc(sizeof(*nip->x));
+      if (!nip->x)
+	abort(); /* XXX: Better error handling */
+      memset(nip->x, 0, sizeof(*nip->x));
+    }
+    
 #if defined(ATTR_NAMESPACE_USER)
-    nip->x.usr = attr_list(nip->p, ATTR_NAMESPACE_USER,
+    stats_syscall(STATS_S_XATTR);
+    nip->x->usr = attr_list(nip->p, ATTR_NAMESPACE_USER,
 			   ATTR_FLAG_GETDATA | (S_ISLNK(nip->s.st_mode) ? ATTR_FLAG_NOFOLLOW : 0));
+    if (nip->x->usr && f_dattr)
+      /* Cached digests are private to each side - never compare or copy them */
+      btree_delete(nip->x->usr, DCACHE_ATTR_NAME);
+    if (nip->x->usr && !(nip->x->usr = intern_get(attrs_intern, nip->x->usr)))
+      err = errno;
 #endif
 #if defined(ATTR_NAMESPACE_SYSTEM)
-    nip->x.sys = attr_list(nip->p, ATTR_NAMESPACE_SYSTEM,
+    stats_syscall(STATS_S_XATTR);
+    nip->x->sys = attr_list(nip->p, ATTR_NAMESPACE_SYSTEM,
 			   ATTR_FLAG_GETDATA | (S_ISLNK(nip->s.st_mode) ? ATTR_FLAG_NOFOLLOW : 0));
+    if (nip->x->sys && !(nip->x->sys = intern_get(attrs_intern, nip->x->sys)))
+      err = errno;
 #endif
   }
+  stats_stop(STATS_T_META, t0);
+
+  if (err) {
+    errno = err;
+    return -1;
+  }
+
+  /* Only now is everything loaded - else node_load() must try again */
+  nip->f &= ~NODE_F_TYPEONLY;
+  return 0;
+}
+
+
+/*
+ * Make sure all metadata is available for a node that was added with
+ * just the file type from readdir()
+ */
+int
+node_load(NODE *nip) {
+  if (!nip || !(nip->f & NODE_F_TYPEONLY))
+    return 0;
 
-  if (f_digest && S_ISREG(nip->s.st_mode))
-    file_digest(nip);
+  if (node_get(nip, NULL) < 0) {
+    fprintf(stderr, "%s: Error: %s: node_get: %s\n", argv0, nip->p, strerror(errno));
+    return -1;
+  }
   
   return 0;
 }
 
 
+/*
+ * Metadata prefetch job. Errors are ignored here - the node is left
+ * marked NODE_F_TYPEONLY so node_load() retries and reports it.
+ */
+static int
+node_prefetch(void *vp) {
+  NODE *nip = (NODE *) vp;
+
+  (void) node_get(nip, NULL);
+  return 0;
+}
+
+
+/*
+ * Check if the file type alone is enough to compare two nodes
+ * (see node_compare)
+ */
+static int
+node_typeonly_ok(mode_t mode) {
+  if (f_perms || f_owner || f_times || f_acls || f_attrs || f_flags || f_verbose > 1)
+    return 0;
+
+  if (S_ISREG(mode))
+    return !f_content && !f_hardlinks;
+
+  return !(S_ISLNK(mode) || S_ISBLK(mode) || S_ISCHR(mode));
+}
+
+
+/*
+ * Get the path relative to the source (or destination) root,
+ * or NULL if outside of both
+ */
+static const char *
+change_rel(const char *path) {
+  const char *rel = NULL, *root;
+  size_t len, best = 0;
+  int i;
+
+
+  for (i = 0; i < 2; i++) {
+    root = i ? changes_dst : changes_src;
+    len = strlen(root);
+    if (len >= best && strncmp(path, root, len) == 0 &&
+	(path[len] == '/' || path[len] == '\0')) {
+      rel = path[len] ? path+len+1 : path+len;
+      best = len;
+    }
+  }
+  return rel;
+}
+
+
+/*
+ * Should a node be looked at in incremental mode?
+ */
+static int
+change_wanted(const char *path) {
+  const char *rel = change_rel(path);
+
+  return !rel || changes_match(changes, rel) != 0;
+}
+
+
+/*
+ * Are the nodes in a directory to be filtered by the change list?
+ * (not if the directory itself is listed, then all its nodes are checked)
+ */
+static int
+change_partial(const char *dirpath) {
+  const char *rel;
+
+
+  if (!changes)
+    return 0;
+  
+  rel = dirpath ? change_rel(dirpath) : "";
+  return rel && !(changes_match(changes, rel) & CHANGES_F_PATH);
+}
+
+
 /*
  * Allocate empty directory node
  */
@@ -953,17 +2662,85 @@ dirnode_alloc(const char *path) {
     abort();
 
   memset(dnp, 0, sizeof(*dnp));
+  dnp->fd = -1;
 
   if (path) {
     dnp->path = strdup(path);
   }
   
+  dnp->arena = arena_create(0);
   dnp->nodes = btree_create(NULL, node_free);
+  if (!dnp->arena || !dnp->nodes)
+    abort();
+  btree_arena(dnp->nodes, dnp->arena);
 
   return dnp;
 }
 
 
+static int
+dirnode_move_node(const char *key,
+		  void *val,
+		  void *extra) {
+  DIRNODE *dnp = (DIRNODE *) extra;
+  NODE *nip = (NODE *) val;
+  NODE *nnp;
+  char *nkey;
+
+
+  nnp = node_alloc(dnp->arena);
+  if (!nnp)
+    return -1;
+
+  *nnp = *nip;
+  nnp->arena = dnp->arena;
+  if (nip->p) {
+    nnp->p = arena_strdup(dnp->arena, nip->p);
+    if (!nnp->p)
+      return -1;
+    if (nip->n)
+      nnp->n = nnp->p + (nip->n - nip->p);
+  }
+  /* The side storage now belongs to the new node */
+  nip->l = NULL;
+  nip->a = &node_noacls;
+  nip->x = &node_noattrs;
+  nip->d = &node_nodigest;
+  
+  nkey = arena_strdup(dnp->arena, key);
+  if (!nkey) {
+    node_free(nnp);
+    return -1;
+  }
+  return btree_insert(dnp->nodes, nkey, nnp);
+}
+
+
+/*
+ * Move the nodes that are left (the directories) to a new arena and
+ * release the old one, with the nodes that have been handled already.
+ * Only the directories are then kept in memory while descending.
+ */
+static int
+dirnode_compact(DIRNODE *dnp) {
+  DIRNODE old = *dnp;
+  int rc;
+
+
+  dnp->arena = arena_create(0);
+  dnp->nodes = btree_create(NULL, node_free);
+  if (!dnp->arena || !dnp->nodes)
+    abort();
+  btree_arena(dnp->nodes, dnp->arena);
+
+  rc = btree_foreach(old.nodes, dirnode_move_node, dnp);
+  
+  btree_destroy(old.nodes);
+  arena_destroy(old.arena);
+  return rc;
+}
+
+
 /*
  * Free directory node data
  */
@@ -973,6 +2750,13 @@ dirnode_free(DIRNODE *dnp) {
     btree_destroy(dnp->nodes);
     dnp->nodes = NULL;
   }
+  arena_destroy(dnp->arena);
+  dnp->arena = NULL;
+  if (dnp->fd >= 0) {
+    close(dnp->fd);
+    dnp->fd = -1;
+    --dirfd_cnt;
+  }
   if (dnp->path) {
     free((void *) dnp->path);
     dnp->path = NULL;
@@ -988,19 +2772,46 @@ dirnode_free(DIRNODE *dnp) {
  *    add contents of 'dir' to DIRNODE
  * 2. path/node
  *    add 'node' to DIRNODE
+ *
+ * If pfd is an open directory then 'dir' is opened relative to it
+ * (path must then be <path of pfd>/dir). The directory is kept open
+ * in the DIRNODE so the nodes can be accessed with *at() calls.
+ *
+ * If gp is set (and there is a prefetch pool) then the node metadata is
+ * fetched in parallel and gp must be waited for before the nodes are used.
  */
+static struct dirent *
+dirnode_readdir(DIR *dp) {
+  struct dirent *dep;
+  uint64_t t0;
+
+
+  t0 = stats_start();
+  dep = readdir(dp);
+  stats_stop(STATS_T_SCAN, t0);
+  if (dep)
+    stats_count(STATS_C_ENTRIES, 1);
+  return dep;
+}
+
+
 int
 dirnode_add(DIRNODE *dnp,
 	    const char *path,
-	    int dir_contents_f) {
+	    int pfd,
+	    int dir_contents_f,
+	    JOBGROUP *gp) {
   DIR *dp;
   struct dirent *dep;
-  int len, rc;
+  int len, rc = 0, fd, kfd, partial, queued = 0;
   int n_trail;
-  char *pbuf, *dirname, *nodename;
+  char *pbuf, *dirname = NULL, *nodename;
   
 
+  dp = NULL;
   pbuf = strdup(path);
+  if (!pbuf)
+    return -1;
   len = strlen(pbuf);
 
   /* Remove and count trailing '/' */
@@ -1024,44 +2835,100 @@ dirnode_add(DIRNODE *dnp,
   }
   
   if (dir_contents_f || n_trail > 0) {
-    dp = opendir(pbuf);
-    if (!dp)
-      return -1;
+    size_t plen = strlen(pbuf);
+    
+    if (pfd != AT_FDCWD)
+      fd = openat(pfd, nodename, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+    else
+      fd = open(pbuf, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if (fd < 0) {
+      rc = -1;
+      goto End;
+    }
+
+    stats_syscall(STATS_S_OPENDIR);
+    stats_count(STATS_C_DIRS, 1);
+    dp = fdopendir(fd);
+    if (!dp) {
+      close(fd);
+      rc = -1;
+      goto End;
+    }
+
+    /* Don't prefetch nodes that won't be looked at (incremental mode) */
+    partial = !dnp->all && change_partial(pbuf);
+    
+    /* Keep a descriptor for the *at() calls (if we have one to spare) */
+    kfd = -1;
+    if (dnp->fd < 0 && dirfd_cnt < dirfd_max) {
+      kfd = dnp->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+      if (kfd >= 0)
+	++dirfd_cnt;
+    }
     
     if (dp) {
-      while ((dep = readdir(dp)) != NULL) {
+      while ((dep = dirnode_readdir(dp)) != NULL) {
 	if (strcmp(dep->d_name, ".") != 0 &&
 	    strcmp(dep->d_name, "..") != 0) {
-	  char *tmppath = strdupcat(pbuf, "/", dep->d_name, NULL);
-	  NODE *nip = node_alloc();
+	  NODE *nip = node_alloc(dnp->arena);
+	  
+	  if (!nip) {
+	    rc = -1;
+	    goto End;
+	  }
+
+	  /* The node name (key) is the tail of the path */
+	  nip->p = arena_strdupcat(dnp->arena, pbuf, "/", dep->d_name, NULL);
+	  if (!nip->p) {
+	    rc = -1;
+	    goto End;
+	  }
+	  if (kfd >= 0) {
+	    nip->dfd = kfd;
+	    nip->n = nip->p + plen + 1;
+	  }
+
+#if defined(HAVE_STRUCT_DIRENT_D_TYPE) && defined(DTTOIF)
+	  if (dep->d_type != DT_UNKNOWN) {
+	    /* Defer the full node_get() until the node is compared or updated */
+	    nip->s.st_mode = DTTOIF(dep->d_type);
+	    nip->f |= NODE_F_TYPEONLY;
+	  }
+#endif
 
-	  if (node_get(nip, tmppath) < 0) {
+	  if (gp && statpool &&
+	      (!(nip->f & NODE_F_TYPEONLY) || !node_typeonly_ok(nip->s.st_mode)) &&
+	      (!(nip->f & NODE_F_TYPEONLY) || !partial || change_wanted(nip->p))) {
+	    /* Most likely needed - fetch it in the background */
+	    nip->f |= NODE_F_TYPEONLY;
+	    if (jobpool_add(statpool, gp, node_prefetch, NULL, nip) < 0) {
+	      rc = -1;
+	      goto End;
+	    }
+	    ++queued;
+	  } else if (!(nip->f & NODE_F_TYPEONLY) && node_get(nip, NULL) < 0) {
 	    if (f_verbose)
-	      fprintf(stderr, "%s: Error: %s: node_get: %s\n", argv0, tmppath, strerror(errno));
-	    free(tmppath);
+	      fprintf(stderr, "%s: Error: %s: node_get: %s\n", argv0, nip->p, strerror(errno));
 	    node_free(nip);
-	    return -1;
+	    rc = -1;
+	    goto End;
 	  }
 	  
-	  if (btree_insert(dnp->nodes, strdup(dep->d_name), (void *) nip) < 0) {
+	  if (btree_insert(dnp->nodes, nip->p + plen + 1, (void *) nip) < 0) {
 	    if (f_ignore && errno == EEXIST) {
 	      if (f_verbose)
-		fprintf(stderr, "%s: Ignoring duplicate node name\n", tmppath);
+		fprintf(stderr, "%s: Ignoring duplicate node name\n", nip->p);
 	    } else {
 	      fprintf(stderr, "%s: Error: %s: btree_insert: %s\n",
-		      argv0, tmppath, strerror(errno));
+		      argv0, nip->p, strerror(errno));
 	      exit(1);
 	    }
 	  }
-
-	  free(tmppath);
 	}
       }
     }
-    
-    closedir(dp);
   } else {
-    NODE *nip = node_alloc();
+    NODE *nip = node_alloc(dnp->arena);
 
     fprintf(stderr, "node_get(%s)\n", path);
     
@@ -1070,34 +2937,139 @@ dirnode_add(DIRNODE *dnp,
       if (f_debug)
 	fprintf(stderr, "%s: Error: %s: node_get: %s\n", argv0, path, strerror(errno));
       node_free(nip);
-      return -1;
+      goto End;
     }
     
-    rc = btree_insert(dnp->nodes, strdup(nodename), (void *) nip);
+    rc = btree_insert(dnp->nodes, arena_strdup(dnp->arena, nodename), (void *) nip);
     if (rc < 0) {
       if (f_ignore && errno == EEXIST) {
 	if (f_verbose)
 	  fprintf(stderr, "%s: Ignoring duplicate node name\n", path);
+	rc = 0;
       } else {
 	fprintf(stderr, "%s: Error: %s: btree_insert: %s\n",
 		argv0, path, strerror(errno));
-	return rc;
       }
     }
   }
 
+ End:
+  if (dp)
+    closedir(dp);
+  if (rc < 0 && queued) {
+    int err = errno;
+    
+    /* The caller may free the nodes the prefetch jobs are working on */
+    (void) jobgroup_wait(gp);
+    errno = err;
+  }
   free(dirname);
+  free(pbuf);
+  return rc;
+}
+
+
+/*
+ * Add the entries of a directory in the manifest (-R) to a directory node
+ */
+static int
+dirnode_add_manifest(DIRNODE *dnp,
+		     const char *path,
+		     const MANIFEST_REC *dir) {
+  const MANIFEST_REC *rp;
+  const unsigned char *dbuf;
+  size_t plen;
+  uint64_t i;
+  char *pbuf;
+
+
+  pbuf = strdup(path);
+  if (!pbuf)
+    return -1;
+  plen = strlen(pbuf);
+  while (plen > 1 && pbuf[plen-1] == '/')
+    pbuf[--plen] = '\0';
+  
+  for (i = 0; i < dir->nchild; i++) {
+    NODE *nip;
+
+    rp = manifest_rec(mread, dir->child + i);
+    if (!rp)
+      break;
+    
+    nip = node_alloc(dnp->arena);
+    if (!nip)
+      return -1;
+    
+    nip->p = arena_strdupcat(dnp->arena, pbuf, "/", manifest_str(mread, rp->name), NULL);
+    if (!nip->p)
+      return -1;
+    nip->n = nip->p;
+    nip->m = rp;
+    nip->f = NODE_F_MANIFEST;
+    manifest_nstat(rp, &nip->s);
+    if (rp->link)
+      nip->l = strdup(manifest_str(mread, rp->link));
+
+    if (rp->dlen && rp->dlen <= DIGEST_BUFSIZE_MAX && mread->digest == f_digest &&
+	(dbuf = manifest_blob(mread, rp->digest, rp->dlen)) != NULL) {
+      NODEDIGEST *dp = node_digest(nip);
+
+      memcpy(dp->buf, dbuf, rp->dlen);
+      dp->len = rp->dlen;
+      dp->valid = 1;
+    }
+
+    /* Hard link identity can only be checked on the real object */
+    if (f_hardlinks && S_ISREG(nip->s.st_mode) && nip->s.st_nlink > 1)
+      nip->f = NODE_F_TYPEONLY;
+    
+    if (btree_insert(dnp->nodes, nip->p + plen + 1, (void *) nip) < 0) {
+      fprintf(stderr, "%s: Error: %s: btree_insert: %s\n",
+	      argv0, nip->p, strerror(errno));
+      exit(1);
+    }
+  }
+
   free(pbuf);
   return 0;
 }
 
 
+/*
+ * Add the contents of a destination directory - from the manifest if
+ * it has the directory listed, else from the file system
+ */
+static int
+dirnode_add_dst(DIRNODE *dnp,
+		const char *path,
+		int pfd,
+		JOBGROUP *gp) {
+  if (mread) {
+    size_t len = strlen(mread_root);
+
+    if (strncmp(path, mread_root, len) == 0 && (path[len] == '/' || path[len] == '\0')) {
+      const char *rel = path+len;
+      const MANIFEST_REC *rp;
+
+      while (*rel == '/')
+	++rel;
+      rp = manifest_rec(mread, manifest_lookup(mread, rel));
+      if (rp && S_ISDIR(rp->mode) && (rp->f & MANIFEST_F_LISTED))
+	return dirnode_add_manifest(dnp, path, rp);
+    }
+  }
+  
+  return dirnode_add(dnp, path, pfd, 1, gp);
+}
+
+
 /*
  * Return a string representing the node type
  */
 char *
 mode2str(NODE *nip) {
-  struct stat *sp;
+  NSTAT *sp;
 
   if (!nip)
     return "-";
@@ -1151,376 +3123,934 @@ print_hex(const unsigned char *buf,
 	  size_t len) {
   int i;
 
-  for (i = 0; i < len; i++)
-    printf("%s%02x", i ? " " : "", buf[i]);
+  for (i = 0; i < len; i++)
+    printf("%s%02x", i ? " " : "", buf[i]);
+
+  return 0;
+}
+
+
+/*
+ * Print Extended Attribute
+ */
+int
+attr_print(const char *key,
+	   void *val,
+	   void *extra) {
+  ATTR *aip = (ATTR *) val;
+
+  if (aip) {
+    printf("      %s = ", key);
+    if (is_printable(aip->buf, aip->len))
+      printf("\"%s\"\n", aip->buf);
+    else {
+      print_hex(aip->buf, aip->len);
+      puts(" [hex]");
+    }
+  } else
+    printf("      %s\n", key);
+  
+  return 0;
+}
+
+
+int
+node_print(const char *key,
+	   void *val,
+	   void *extra) {
+  NODE *nip = (NODE *) val;
+  int verbose = 0;
+
+  if (extra)
+    verbose = * (int *) extra;
+  
+  printf("%s%s",
+	 key ? nip->p : "",
+	 (nip && S_ISDIR(nip->s.st_mode)) ? "/" : "");
+  
+  if (S_ISLNK(nip->s.st_mode))
+    printf(" -> %s", nip->l);
+    
+  printf(" [%s", mode2str(nip));
+
+#if defined(ACL_TYPE_NFS4)
+  if (nip->a->nfs)
+    putchar('N');
+#endif
+#if defined(ACL_TYPE_ACCESS)
+  if (nip->a->acc)
+    putchar('P');
+#endif
+#if defined(ACL_TYPE_DEFAULT)
+  if (nip->a->def)
+    putchar('D');
+#endif
+#if defined(ATTR_NAMESPACE_USER)
+  if (nip->x->usr && btree_entries(nip->x->usr) > 0)
+    putchar('U');
+#endif
+#if defined(ATTR_NAMESPACE_SYSTEM)
+  if (nip->x->sys && btree_entries(nip->x->sys) > 0)
+    putchar('S');
+#endif
+
+  putchar(']');
+
+#if defined(HAVE_LCHFLAGS)
+  if (nip->s.st_flags)
+    printf(" {%s}", fflagstostr(nip->s.st_flags));
+#endif
+  putchar('\n');
+  
+  if (verbose > 1) {
+    if (verbose > 2) {
+      char tmpbuf[80];
+      
+      puts("    General:");
+      printf("      Size  = %s\n", size2str(nip->s.st_size, tmpbuf, sizeof(tmpbuf), 0));
+      printf("      Uid   = %d\n", nip->s.st_uid);
+      printf("      Gid   = %d\n", nip->s.st_gid);
+      printf("      Atime = %s\n", time2str(nip->s.st_atime, tmpbuf, sizeof(tmpbuf), 1));
+      printf("      Ctime = %s\n", time2str(nip->s.st_ctime, tmpbuf, sizeof(tmpbuf), 1));
+      printf("      Mtime = %s\n", time2str(nip->s.st_mtime, tmpbuf, sizeof(tmpbuf), 1));
+    }
+    
+#if defined(ACL_TYPE_NFS4)
+    if (nip->a->nfs) {
+      puts("    NFSv4/ZFS ACL:");
+      char *t = acl_to_text(nip->a->nfs, NULL);
+      if (t)
+	fputs(t, stdout);
+      acl_free(t);
+    }
+#endif
+#if defined(ACL_TYPE_ACCESS)
+    if (nip->a->acc) {
+      puts("    POSIX ACL:");
+      char *t = acl_to_text(nip->a->acc, NULL);
+      if (t)
+	fputs(t, stdout);
+      acl_free(t);
+    }
+#endif
+#if defined(ACL_TYPE_DEFAULT)
+    if (nip->a->def) {
+      puts("    POSIX Default ACL:");
+      char *t = acl_to_text(nip->a->def, NULL);
+      if (t)
+	fputs(t, stdout);
+      acl_free(t);
+    }
+#endif
+#if defined(ATTR_NAMESPACE_USER)
+    if (nip->x->usr && btree_entries(nip->x->usr) > 0) {
+      puts("    User Attributes:");
+      btree_foreach(nip->x->usr, attr_print, NULL);
+    }
+#endif
+#if defined(ATTR_NAMESPACE_SYSTEM)
+    if (nip->x->sys && btree_entries(nip->x->sys) > 0) {
+      puts("    System Attributes:");
+      btree_foreach(nip->x->sys, attr_print, NULL);
+    }
+#endif
+    if (nip->d->len) {
+      int i;
+      printf("    %s Digest:", digest_type2str(f_digest));
+      for (i = 0; i < nip->d->len; i++) {
+	printf("%s%02x", ((i & 15) == 0 ? "\n      " : " "), nip->d->buf[i]);
+      }
+      putchar('\n');
+    }
+  }
+  
+  return 0;
+}
+
+
+
+int
+dirnode_print(DIRNODE *dnp) {
+  printf("Directory %s:\n", dnp->path ? dnp->path : "<null>");
+  return btree_foreach(dnp->nodes, node_print, &f_verbose);
+}
+
+
+int
+dir_compare(const char *srcpath,
+	    int src_pfd,
+	    const char *dstpath,
+	    int dst_pfd);
+
+
+int
+dirpair_recurse(DIRPAIR *dp,
+		const char *key) {
+  const char *nsrc, *ndst;
+  NODE *src_nip;
+  int rc, src_pfd, dst_pfd;
+
+
+  src_pfd = dst_pfd = AT_FDCWD;
+  
+  if (dp->src->path) {
+    nsrc = strdupcat(dp->src->path, "/", key, NULL);
+    if (dp->src->fd >= 0)
+      src_pfd = dp->src->fd;
+  } else {
+    /* Top level source nodes - use the path given on the command line */
+    src_nip = NULL;
+    btree_search(dp->src->nodes, key, (void **) &src_nip);
+    nsrc = src_nip ? src_nip->p : key;
+  }
+
+  if (dp->dst->path) {
+    ndst = strdupcat(dp->dst->path, "/", key, NULL);
+    if (dp->dst->fd >= 0)
+      dst_pfd = dp->dst->fd;
+  } else
+    ndst = key;
+  
+  rc = dir_compare(nsrc, src_pfd, ndst, dst_pfd);
+
+  if (dp->dst->path)
+    free((void *) ndst);
+  if (dp->src->path)
+    free((void *) nsrc);
+  
+  return rc;
+}
+
+
+
+int
+attrs_compare_handler(const char *key,
+		      void *vp,
+		      void *xp) {
+  ATTR *aip = (ATTR *) vp;
+  ATTR *bip = NULL;
+  BTREE *btp = (BTREE *) xp;
+  
+  
+  btree_search(btp, key, (void **) &bip);
+  if (!bip)
+    return -1;
+  
+  if (aip->len != bip->len)
+    return 1;
+  
+  if (memcmp(aip->buf, bip->buf, aip->len) != 0)
+    return 2;
+
+  return 0;
+}
+
+
+int
+attrs_compare(BTREE *a,
+	      BTREE *b) {
+  int rc;
+
+
+  if (f_debug)
+    fprintf(stderr, "*** attrs_compare a=%p, b=%p\n", a, b);
+  
+  rc = btree_foreach(a, attrs_compare_handler, (void *) b);
+  if (rc) {
+    if (f_debug)
+      fprintf(stderr, "ATTRS a->b differs: %d\n", rc);
+    return 1;
+  }
+
+  if (b) {
+    rc = btree_foreach(b, attrs_compare_handler, (void *) a);
+    if (rc) {
+      if (f_debug)
+	fprintf(stderr, "ATTRS b->a differs: %d\n", rc);
+      return -1;
+    }
+  }
+  
+  return 0;
+}
+
+
+static int
+attrs_hash_handler(const char *key,
+		   void *vp,
+		   void *xp) {
+  ATTR *aip = (ATTR *) vp;
+  unsigned long *hp = (unsigned long *) xp;
+  size_t i;
+
 
+  for (; *key; key++)
+    *hp = (*hp ^ (unsigned char) *key) * 16777619U;
+  *hp = (*hp ^ aip->len) * 16777619U;
+  for (i = 0; i < aip->len; i++)
+    *hp = (*hp ^ aip->buf[i]) * 16777619U;
   return 0;
 }
 
 
 /*
- * Print Extended Attribute
+ * Hash an Extended Attribute set (the tree is walked in key order)
  */
-int
-attr_print(const char *key,
-	   void *val,
-	   void *extra) {
-  ATTR *aip = (ATTR *) val;
+static unsigned long
+attrs_intern_hash(const void *obj) {
+  unsigned long h = 2166136261U;	/* FNV-1a */
 
-  if (aip) {
-    printf("      %s = ", key);
-    if (is_printable(aip->buf, aip->len))
-      printf("\"%s\"\n", aip->buf);
-    else {
-      print_hex(aip->buf, aip->len);
-      puts(" [hex]");
-    }
-  } else
-    printf("      %s\n", key);
-  
-  return 0;
+  btree_foreach((BTREE *) obj, attrs_hash_handler, &h);
+  return h;
 }
 
+static int
+attrs_intern_cmp(const void *a,
+		 const void *b) {
+  return attrs_compare((BTREE *) a, (BTREE *) b);
+}
 
-int
-node_print(const char *key,
-	   void *val,
-	   void *extra) {
-  NODE *nip = (NODE *) val;
-  int verbose = 0;
+static void
+attrs_intern_free(void *obj) {
+  btree_destroy((BTREE *) obj);
+}
+
+
+/*
+ * Compare interned Extended Attribute sets - equal sets are the same object
+ * (a missing set is equal to an empty one)
+ */
+static int
+node_attrs_compare(BTREE *a,
+		   BTREE *b) {
+  if (a == b)
+    return 0;
+  if (a && b)
+    return 1;
+  return attrs_compare(a, b);
+}
 
-  if (extra)
-    verbose = * (int *) extra;
-  
-  printf("%s%s",
-	 key ? nip->p : "",
-	 (nip && S_ISDIR(nip->s.st_mode)) ? "/" : "");
-  
-  if (S_ISLNK(nip->s.st_mode))
-    printf(" -> %s", nip->l);
-    
-  printf(" [%s", mode2str(nip));
+
+/*
+ * Hashes of the ACLs & Extended Attributes, as stored in manifests
+ * (0 if there are none - trivial ACLs & empty sets don't count)
+ */
+static uint64_t
+node_acls_hash(NODE *nip) {
+  uint64_t h = 0;
 
 #if defined(ACL_TYPE_NFS4)
-  if (nip->a.nfs)
-    putchar('N');
+  if (nip->a->nfs && !(nip->a->t & NODE_ACL_NFS4_TRIVIAL))
+    h ^= (uint64_t) acl_hash(nip->a->nfs) * 0x9E3779B97F4A7C15ULL;
 #endif
 #if defined(ACL_TYPE_ACCESS)
-  if (nip->a.acc)
-    putchar('P');
+  if (nip->a->acc && !(nip->a->t & NODE_ACL_ACC_TRIVIAL))
+    h ^= (uint64_t) acl_hash(nip->a->acc) * 0xC2B2AE3D27D4EB4FULL;
 #endif
 #if defined(ACL_TYPE_DEFAULT)
-  if (nip->a.def)
-    putchar('D');
+  if (nip->a->def)
+    h ^= (uint64_t) acl_hash(nip->a->def) * 0x165667B19E3779F9ULL;
 #endif
+  return h;
+}
+
+static uint64_t
+node_attrs_hash(NODE *nip) {
+  uint64_t h = 0;
+
 #if defined(ATTR_NAMESPACE_USER)
-  if (nip->x.usr && btree_entries(nip->x.usr) > 0)
-    putchar('U');
+  if (nip->x->usr && btree_entries(nip->x->usr))
+    h ^= (uint64_t) attrs_intern_hash(nip->x->usr) * 0x9E3779B97F4A7C15ULL;
 #endif
 #if defined(ATTR_NAMESPACE_SYSTEM)
-  if (nip->x.sys && btree_entries(nip->x.sys) > 0)
-    putchar('S');
+  if (nip->x->sys && btree_entries(nip->x->sys))
+    h ^= (uint64_t) attrs_intern_hash(nip->x->sys) * 0xC2B2AE3D27D4EB4FULL;
 #endif
+  return h;
+}
 
-  putchar(']');
 
-#if defined(HAVE_LCHFLAGS)
-  if (nip->s.st_flags)
-    printf(" {%s}", fflagstostr(nip->s.st_flags));
-#endif
-  putchar('\n');
+int
+node_compare(NODE *a,
+		 NODE *b) {
+  int d = 0;
+
+
+  if (!a && !b)
+    return 0;
   
-  if (verbose > 1) {
-    if (verbose > 2) {
-      char tmpbuf[80];
-      
-      puts("    General:");
-      printf("      Size  = %s\n", size2str(nip->s.st_size, tmpbuf, sizeof(tmpbuf), 0));
-      printf("      Uid   = %d\n", nip->s.st_uid);
-      printf("      Gid   = %d\n", nip->s.st_gid);
-      printf("      Atime = %s\n", time2str(nip->s.st_atime, tmpbuf, sizeof(tmpbuf), 1));
-      printf("      Ctime = %s\n", time2str(nip->s.st_ctime, tmpbuf, sizeof(tmpbuf), 1));
-      printf("      Mtime = %s\n", time2str(nip->s.st_mtime, tmpbuf, sizeof(tmpbuf), 1));
+  if ((a && !b) || (!a && b))
+    return -1;
+
+
+  /* Check file type mode bits */
+  if ((a->s.st_mode & S_IFMT) != (b->s.st_mode & S_IFMT))
+    d |= 0x00000001;
+
+
+  if (f_owner) {
+    /* Check file ownership */
+    if (a->s.st_uid != b->s.st_uid) {
+      if (a->s.st_uid == getuid() || geteuid() == 0)
+	d |= 0x00000002;
     }
-    
-#if defined(ACL_TYPE_NFS4)
-    if (nip->a.nfs) {
-      puts("    NFSv4/ZFS ACL:");
-      char *t = acl_to_text(nip->a.nfs, NULL);
-      if (t)
-	fputs(t, stdout);
-      acl_free(t);
+
+    if (a->s.st_gid != b->s.st_gid) {
+      if (geteuid() == 0 || in_gidset(a->s.st_gid)) /* Allow if root or one of our groups */
+	d |= 0x00000004;
+    }
+  }
+
+  /* Check permission bits */
+  if (f_perms && (a->s.st_mode & ~S_IFMT) != (b->s.st_mode & ~S_IFMT))
+    d |= 0x00000008;
+
+  /* Check symbolic link content */
+  if (S_ISLNK(a->s.st_mode)) {
+    if ((a->l && !b->l) || (!a->l && b->l) || (a->l && b->l && strcmp(a->l, b->l) != 0))
+      d |= 0x00000010;
+  }
+
+  /* Check block & character devices */
+  if (S_ISBLK(a->s.st_mode) || S_ISCHR(a->s.st_mode)) {
+    if (a->s.st_dev != b->s.st_dev)
+      d |= 0x00000020;
+  }
+
+  if (f_times) {
+    if (f_times < 2) {
+      if (a->s.st_mtime > b->s.st_mtime)
+	/* Check file modification times - newer */
+	d |= 0x00000100;
+    }
+    else {
+      if (a->s.st_mtime != b->s.st_mtime)
+	/* Check file modification times - exact */      
+	d |= 0x00000100;
     }
+  }
+  
+  if (f_content && S_ISREG(a->s.st_mode)) {
+    /* Check filesize */
+    if (a->s.st_size != b->s.st_size)
+      d |= 0x00001000;
+  }
+
+  /* Check ACLs */
+  if (f_acls && (b->f & NODE_F_MANIFEST)) {
+    if (node_acls_hash(a) != b->m->acls)
+      d |= 0x00100000;
+  } else if (f_acls) {
+#if defined(ACL_TYPE_NFS4)
+    if (node_acl_compare(a, b, ACL_TYPE_NFS4))
+      d |= 0x00100000;
 #endif
 #if defined(ACL_TYPE_ACCESS)
-    if (nip->a.acc) {
-      puts("    POSIX ACL:");
-      char *t = acl_to_text(nip->a.acc, NULL);
-      if (t)
-	fputs(t, stdout);
-      acl_free(t);
-    }
+    if (node_acl_compare(a, b, ACL_TYPE_ACCESS))
+      d |= 0x00200000;
 #endif
 #if defined(ACL_TYPE_DEFAULT)
-    if (nip->a.def) {
-      puts("    POSIX Default ACL:");
-      char *t = acl_to_text(nip->a.def, NULL);
-      if (t)
-	fputs(t, stdout);
-      acl_free(t);
-    }
+    if (node_acl_compare(a, b, ACL_TYPE_DEFAULT))
+      d |= 0x00400000;
 #endif
+  }
+
+  if (f_attrs && (b->f & NODE_F_MANIFEST)) {
+    if (node_attrs_hash(a) != b->m->attrs)
+      d |= 0x01000000;
+  } else if (f_attrs) {
+    /* Check Extended Attributes */
 #if defined(ATTR_NAMESPACE_USER)
-    if (nip->x.usr && btree_entries(nip->x.usr) > 0) {
-      puts("    User Attributes:");
-      btree_foreach(nip->x.usr, attr_print, NULL);
-    }
+    if (a->x->usr && node_attrs_compare(a->x->usr, b->x->usr))
+      d |= 0x01000000;
 #endif
 #if defined(ATTR_NAMESPACE_SYSTEM)
-    if (nip->x.sys && btree_entries(nip->x.sys) > 0) {
-      puts("    System Attributes:");
-      btree_foreach(nip->x.sys, attr_print, NULL);
-    }
+    if (a->x->sys && node_attrs_compare(a->x->sys, b->x->sys))
+      d |= 0x02000000;
 #endif
-    if (nip->d.len) {
-      int i;
-      printf("    %s Digest:", digest_type2str(f_digest));
-      for (i = 0; i < nip->d.len; i++) {
-	printf("%s%02x", ((i & 15) == 0 ? "\n      " : " "), nip->d.buf[i]);
-      }
-      putchar('\n');
+  }
+
+#if defined(UF_ARCHIVE)
+  if (f_flags) {
+    if ((a->s.st_flags & ~UF_ARCHIVE) != (b->s.st_flags & ~UF_ARCHIVE))
+      d |= 0x10000000;
+    if (f_flags > 1 && a->s.st_flags & UF_ARCHIVE)
+      d |= 0x20000000;
+  }
+#endif
+
+  /* 
+   * Check digest - last, and only if the cheap checks didn't already
+   * decide that the contents must be copied (Type, Archive, Mtime, Size)
+   */
+  if (f_digest && f_content && S_ISREG(a->s.st_mode) &&
+      !(d & (0x00000001|0x200fff00))) {
+    if (file_digest(a, 1) == 0 && a->d->len) {
+      if (file_digest(b, 0) < 0 || a->d->len != b->d->len)
+	d |= 0x00010000;
+      else if (memcmp(a->d->buf, b->d->buf, a->d->len))
+	d |= 0x00020000;
     }
   }
   
-  return 0;
+  return d;
 }
 
 
-
+/*
+ * Copy the contents of a regular file. With -V the source digest is
+ * picked up during the copy, and checked against the digest from
+ * the comparison (if there was one) in case the source was modified.
+ */
 int
-dirnode_print(DIRNODE *dnp) {
-  printf("Directory %s:\n", dnp->path ? dnp->path : "<null>");
-  return btree_foreach(dnp->nodes, node_print, &f_verbose);
+node_copy(NODE *src_nip,
+	  int dstfd,
+	  const char *dstname,
+	  const char *dstpath,
+	  int *dst_fdp) {
+  unsigned char dbuf[DIGEST_BUFSIZE_MAX];
+  size_t dlen = 0;
+  NODEDIGEST *dp;
+  uint64_t t0;
+  int rc;
+
+  
+  t0 = stats_start();
+  if (!f_verify) {
+    rc = file_copy(src_nip, dstfd, dstname, dstpath, NULL, NULL, dst_fdp);
+    goto End;
+  }
+
+  rc = file_copy(src_nip, dstfd, dstname, dstpath, dbuf, &dlen, dst_fdp);
+  if (rc < 0)
+    goto End;
+
+  if (src_nip->d->valid &&
+      (src_nip->d->len != dlen || memcmp(src_nip->d->buf, dbuf, dlen) != 0)) {
+    fprintf(stderr, "%s: Error: %s: Source modified during copy\n",
+	    argv0, src_nip->p);
+    if (dst_fdp && *dst_fdp >= 0) {
+      close(*dst_fdp);
+      *dst_fdp = -1;
+    }
+    errno = EAGAIN;
+    rc = -1;
+    goto End;
+  }
+  
+  dp = node_digest(src_nip);
+  memcpy(dp->buf, dbuf, dlen);
+  dp->len = dlen;
+  dp->valid = 1;
+
+  file_digest_save(src_nip, 1);
+
+ End:
+  stats_stop(STATS_T_COPY, t0);
+  if (rc >= 0) {
+    stats_count(STATS_C_FILES, 1);
+    stats_count(STATS_C_BYTES, src_nip->s.st_size);
+  }
+  return rc;
 }
 
 
-int
-dir_compare(const char *srcpath,
-	    const char *dstpath);
+/*
+ * A source node couldn't be synced. Returns the error to pass on
+ * (0 with -i).
+ */
+static int
+node_failed(NODE *nip,
+	    int rc) {
+  nip->f |= NODE_F_FAILED;
+  return f_ignore ? 0 : rc;
+}
 
 
+/*
+ * Copy a regular file and update the metadata
+ */
 int
-dirpair_recurse(DIRPAIR *dp,
-		const char *key) {
-  const char *nsrc, *ndst;
-  int rc;
+file_sync(void *vp) {
+  FILEJOB *fjp = (FILEJOB *) vp;
+  NODE *src_nip = fjp->src_nip;
+  NODE *dst_nip = fjp->dst_nip;
+  int rc, fd = -1;
 
 
-  if (dp->src->path)
-    nsrc = strdupcat(dp->src->path, "/", key, NULL);
-  else
-    nsrc = key;
+  /* Get the disks going on the next file while this one is copied */
+  if (fjp->next)
+    iopace_willneed(fjp->next->dfd, fjp->next->n, fjp->next->s.st_size);
+  
+  if (fjp->copy_f && f_content) {
+    rc = node_copy(src_nip, fjp->dstfd, fjp->dstname, fjp->dstpath, &fd);
+    if (rc < 0) {
+      if (f_debug)
+	fprintf(stderr, "file_sync: node_copy(%s, %s, 0x%x) -> %d\n",
+		src_nip->p, fjp->dstpath, src_nip->s.st_mode, rc);
+      return node_failed(src_nip, rc);
+    }
+  }
 
-  if (dp->dst->path)
-    ndst = strdupcat(dp->dst->path, "/", key, NULL);
-  else
-    ndst = key;
+  /* Update the metadata through the descriptor of the copy, if any */
+  rc = node_update(src_nip, dst_nip, fd, fjp->dstfd, fjp->dstname, fjp->dstpath);
+  if (fd >= 0)
+    close(fd);
+  if (rc < 0) {
+    if (f_debug)
+      fprintf(stderr, "file_sync: node_update(%s, %s, %s): rc=%d\n",
+	      src_nip->p,
+	      dst_nip ? dst_nip->p : "<null>",
+	      fjp->dstpath, rc);
+    return node_failed(src_nip, rc);
+  }
+
+  if (dst_nip) {
+    /* Refresh dst node */
+    rc = node_get(dst_nip, NULL);
+    if (rc < 0) {
+      if (f_debug)
+	fprintf(stderr, "file_sync: node_get(%s) [refresh] rc=%d\n",
+		dst_nip->p, rc);
+      return node_failed(src_nip, rc);
+    }
+    
+    if (f_verify && fjp->copy_f && f_content && src_nip->d->valid) {
+      /* The destination has the contents we digested */
+      memcpy(node_digest(dst_nip), src_nip->d, sizeof(*dst_nip->d));
+      file_digest_save(dst_nip, 0);
+    }
+  }
+
+  return 0;
+}
+
+
+void
+filejob_free(void *vp) {
+  FILEJOB *fjp = (FILEJOB *) vp;
+
+  free(fjp->dstpath);
+  free(fjp);
+}
+
+
+/*
+ * Physical location of the start of the data in a file (-O disk).
+ * Returns -1 if the filesystem can't tell.
+ */
+static int
+file_location(NODE *nip,
+	      uint64_t *pos) {
+#if (defined(HAVE_LINUX_FIEMAP_H) && defined(FS_IOC_FIEMAP)) || defined(F_LOG2PHYS)
+  int fd, rc;
   
-  rc = dir_compare(nsrc, ndst);
 
-  if (dp->dst->path)
-    free((void *) ndst);
-  if (dp->src->path)
-    free((void *) nsrc);
+  fd = openat(nip->dfd, nip->n, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+  if (fd < 0)
+    return -1;
   
-  return rc;
+#if defined(HAVE_LINUX_FIEMAP_H) && defined(FS_IOC_FIEMAP)
+  {
+    uint64_t fbuf[(sizeof(struct fiemap)+sizeof(struct fiemap_extent))/sizeof(uint64_t)+1];
+    struct fiemap *fmp = (struct fiemap *) fbuf;
+
+    /* Only the first extent is needed */
+    memset(fbuf, 0, sizeof(fbuf));
+    fmp->fm_length = FIEMAP_MAX_OFFSET;
+    fmp->fm_extent_count = 1;
+    rc = ioctl(fd, FS_IOC_FIEMAP, fmp);
+    if (rc == 0 && (fmp->fm_mapped_extents < 1 ||
+		    (fmp->fm_extents[0].fe_flags & FIEMAP_EXTENT_UNKNOWN))) {
+      /* Empty, or not allocated yet */
+      errno = ENODATA;
+      rc = -1;
+    }
+    if (rc == 0)
+      *pos = fmp->fm_extents[0].fe_physical;
+  }
+#else
+  {
+    struct log2phys lp;
+
+    memset(&lp, 0, sizeof(lp));
+    rc = fcntl(fd, F_LOG2PHYS, &lp);
+    if (rc == 0)
+      *pos = (uint64_t) lp.l2p_devoffset;
+  }
+#endif
+  close(fd);
+  return rc < 0 ? -1 : 0;
+#else
+  (void) nip;
+  (void) pos;
+  errno = ENOSYS;
+  return -1;
+#endif
 }
 
 
+static int
+filejob_cmp(const void *a,
+	    const void *b) {
+  const FILEJOB *fa = *(const FILEJOB **) a;
+  const FILEJOB *fb = *(const FILEJOB **) b;
 
-int
-attrs_compare_handler(const char *key,
-		      void *vp,
-		      void *xp) {
-  ATTR *aip = (ATTR *) vp;
-  ATTR *bip = NULL;
-  BTREE *btp = (BTREE *) xp;
-  
-  
-  btree_search(btp, key, (void **) &bip);
-  if (!bip)
-    return -1;
-  
-  if (aip->len != bip->len)
-    return 1;
-  
-  if (memcmp(aip->buf, bip->buf, aip->len) != 0)
-    return 2;
 
-  return 0;
+  if (fa->pos != fb->pos)
+    return fa->pos < fb->pos ? -1 : 1;
+  if (fa->src_nip->s.st_ino != fb->src_nip->s.st_ino)
+    return fa->src_nip->s.st_ino < fb->src_nip->s.st_ino ? -1 : 1;
+  return strcmp(fa->dstpath, fb->dstpath);
 }
 
 
+/*
+ * Start the file jobs collected in a directory (-O), sorted by where
+ * the source data is, so the source disks see (mostly) sequential reads
+ * instead of seeking back and forth in name order.
+ */
 int
-attrs_compare(BTREE *a,
-	      BTREE *b) {
-  int rc;
+file_schedule(DIRPAIR *xd) {
+  size_t i;
+  int rc = 0;
 
 
-  if (f_debug)
-    fprintf(stderr, "*** attrs_compare a=%p, b=%p\n", a, b);
-  
-  rc = btree_foreach(a, attrs_compare_handler, (void *) b);
-  if (rc) {
-    if (f_debug)
-      fprintf(stderr, "ATTRS a->b differs: %d\n", rc);
-    return 1;
-  }
+  if (xd->fjc > 1)
+    qsort(xd->fjv, xd->fjc, sizeof(xd->fjv[0]), filejob_cmp);
 
-  if (b) {
-    rc = btree_foreach(b, attrs_compare_handler, (void *) a);
-    if (rc) {
-      if (f_debug)
-	fprintf(stderr, "ATTRS b->a differs: %d\n", rc);
-      return -1;
+  for (i = 0; i < xd->fjc; i++) {
+    if (rc < 0) {
+      filejob_free(xd->fjv[i]);
+      continue;
     }
+    if (i+1 < xd->fjc && xd->fjv[i+1]->copy_f && f_content)
+      xd->fjv[i]->next = xd->fjv[i+1]->src_nip;
+    if (f_debug)
+      fprintf(stderr, "*** file_schedule: %s @ %llu\n",
+	      xd->fjv[i]->src_nip->p, (unsigned long long) xd->fjv[i]->pos);
+    rc = jobpool_add(jobpool, &xd->jobs, file_sync, filejob_free, xd->fjv[i]);
+    if (rc < 0)
+      filejob_free(xd->fjv[i]);
   }
   
-  return 0;
+  free(xd->fjv);
+  xd->fjv = NULL;
+  xd->fjc = xd->fjs = 0;
+  return rc;
 }
 
 
+/*
+ * Queue a regular file copy to the worker pool (or run it directly
+ * if no pool). The directory pair must not be freed until the jobs
+ * in it are finished (see dirnode_compare). With -O the job is only
+ * collected here and started by file_schedule().
+ */
 int
-node_compare(NODE *a,
-		 NODE *b) {
-  int d = 0;
+file_dispatch(DIRPAIR *xd,
+	      NODE *src_nip,
+	      NODE *dst_nip,
+	      int dstfd,
+	      const char *dstname,
+	      const char *dstpath,
+	      int copy_f) {
+  FILEJOB *fjp;
+
+
+  fjp = malloc(sizeof(*fjp));
+  if (!fjp)
+    return -1;
 
+  fjp->src_nip = src_nip;
+  fjp->dst_nip = dst_nip;
+  fjp->dstfd   = dstfd;
+  fjp->dstpath = strdup(dstpath);
+  fjp->copy_f  = copy_f;
+  fjp->next    = NULL;
+  if (!fjp->dstpath) {
+    free(fjp);
+    return -1;
+  }
+  fjp->dstname = fjp->dstpath + strlen(dstpath) - strlen(dstname);
+
+  if (f_order != ORDER_NAME) {
+    if (xd->fjc >= xd->fjs) {
+      size_t ns = xd->fjs ? xd->fjs*2 : 64;
+      FILEJOB **nv = realloc(xd->fjv, ns*sizeof(*nv));
+      if (!nv) {
+	filejob_free(fjp);
+	return -1;
+      }
+      xd->fjv = nv;
+      xd->fjs = ns;
+    }
 
-  if (!a && !b)
+    /* Unknown locations go last, in inode order */
+    if (f_order == ORDER_INODE)
+      fjp->pos = (uint64_t) src_nip->s.st_ino;
+    else if (!fjp->copy_f || !f_content || file_location(src_nip, &fjp->pos) < 0)
+      fjp->pos = UINT64_MAX;
+    
+    xd->fjv[xd->fjc++] = fjp;
     return 0;
+  }
   
-  if ((a && !b) || (!a && b))
-    return -1;
-
-
-  /* Check file type mode bits */
-  if ((a->s.st_mode & S_IFMT) != (b->s.st_mode & S_IFMT))
-    d |= 0x00000001;
+  fjp->pos = 0;
+  return jobpool_add(jobpool, &xd->jobs, file_sync, filejob_free, fjp);
+}
 
 
-  if (f_owner) {
-    /* Check file ownership */
-    if (a->s.st_uid != b->s.st_uid) {
-      if (a->s.st_uid == getuid() || geteuid() == 0)
-	d |= 0x00000002;
-    }
+/*
+ * Make dstname another name for the destination of the first name of
+ * a hard linked file. An existing destination is replaced atomically
+ * via a temporary name. Returns 1 if linking isn't possible (e.g.
+ * EXDEV) and the file should be copied instead.
+ */
+static int
+node_link(LINK *lp,
+	  NODE *src_nip,
+	  NODE *dst_nip,
+	  int dstfd,
+	  const char *dstname,
+	  const char *dstpath) {
+  char *tmpname = NULL;
+  const char *lname = dstname;
+  int rc, fd;
 
-    if (a->s.st_gid != b->s.st_gid) {
-      if (geteuid() == 0 || in_gidset(a->s.st_gid)) /* Allow if root or one of our groups */
-	d |= 0x00000004;
-    }
+  
+  if (dst_nip) {
+    tmpname = strdupcat(dstname, ".pc-link", NULL);
+    if (!tmpname)
+      return -1;
+    lname = tmpname;
   }
 
-
-  /* Check symbolic link content */
-  if (S_ISLNK(a->s.st_mode)) {
-    if ((a->l && !b->l) || (!a->l && b->l) || (a->l && b->l && strcmp(a->l, b->l) != 0))
-      d |= 0x00000010;
+  rc = linkat(AT_FDCWD, lp->path, dstfd, lname, 0);
+  if (rc < 0 && errno == ENOENT) {
+    /* The copy of the first name hasn't started yet - create the inode for it */
+    fd = open(lp->path, O_WRONLY|O_CREAT|O_NOFOLLOW, src_nip->s.st_mode & ~S_IFMT);
+    if (fd >= 0) {
+      close(fd);
+      rc = linkat(AT_FDCWD, lp->path, dstfd, lname, 0);
+    }
   }
-
-  /* Check block & character devices */
-  if (S_ISBLK(a->s.st_mode) || S_ISCHR(a->s.st_mode)) {
-    if (a->s.st_dev != b->s.st_dev)
-      d |= 0x00000020;
+  if (rc < 0) {
+    if (f_debug)
+      fprintf(stderr, "*** node_link: %s -> %s: %s (copying instead)\n",
+	      lp->path, dstpath, strerror(errno));
+    free(tmpname);
+    return 1;
   }
 
-  if (f_times) {
-    if (f_times < 2) {
-      if (a->s.st_mtime > b->s.st_mtime)
-	/* Check file modification times - newer */
-	d |= 0x00000100;
-    }
-    else {
-      if (a->s.st_mtime != b->s.st_mtime)
-	/* Check file modification times - exact */      
-	d |= 0x00000100;
+  if (tmpname) {
+    rc = renameat(dstfd, tmpname, dstfd, dstname);
+    if (rc < 0) {
+      fprintf(stderr, "%s: Error: %s: rename: %s\n",
+	      argv0, dstpath, strerror(errno));
+      (void) unlinkat(dstfd, tmpname, 0);
+      free(tmpname);
+      return -1;
     }
+    free(tmpname);
   }
   
-  if (f_content && S_ISREG(a->s.st_mode)) {
-    /* Check filesize */
-    if (a->s.st_size != b->s.st_size)
-      d |= 0x00001000;
+  return 0;
+}
 
-    /* Check digest */
-    if (f_digest) {
-      if (a->d.len) {
-	if (a->d.len != b->d.len)
-	  d |= 0x00010000;
-	else if (memcmp(a->d.buf, b->d.buf, a->d.len))
-	  d |= 0x00020000;
-      }
+
+/*
+ * Check a multiply linked source file (-H). The first name seen is
+ * copied as usual and remembered, later names become links to it.
+ * Returns 1 if the node should be handled as usual, 0 if done.
+ */
+static int
+check_hardlink(NODE *src_nip,
+	       NODE *dst_nip,
+	       int dstfd,
+	       const char *dstname,
+	       const char *dstpath) {
+  LINK *lp;
+  struct stat sb;
+  int rc = 0;
+
+
+  lp = linkmap_lookup(linkmap, src_nip->s.st_dev, src_nip->s.st_ino);
+  if (!lp) {
+    lp = linkmap_add(linkmap, src_nip->s.st_dev, src_nip->s.st_ino, src_nip->s.st_nlink, dstpath);
+    if (lp && dst_nip && S_ISREG(dst_nip->s.st_mode)) {
+      /* Updated in place, so the destination inode stays the same */
+      lp->ddev = dst_nip->s.st_dev;
+      lp->dino = dst_nip->s.st_ino;
+      lp->dvalid = 1;
     }
+    return 1;
   }
 
-  /* Check ACLs */
-  if (f_acls) {
-#if defined(ACL_TYPE_NFS4)
-    if (acl_compare(a->a.nfs, b->a.nfs))
-      d |= 0x00100000;
-#endif
-#if defined(ACL_TYPE_ACCESS)
-    if (acl_compare(a->a.acc, b->a.acc))
-      d |= 0x00200000;
-#endif
-#if defined(ACL_TYPE_DEFAULT)
-    if (acl_compare(a->a.def, b->a.def))
-      d |= 0x00400000;
-#endif
+  if (dst_nip && !S_ISREG(dst_nip->s.st_mode)) {
+    linkmap_seen(linkmap, lp);
+    return 1;
   }
 
-  if (f_attrs) {
-    /* Check Extended Attributes */
-#if defined(ATTR_NAMESPACE_USER)
-    if (a->x.usr && attrs_compare(a->x.usr, b->x.usr))
-      d |= 0x01000000;
-#endif
-#if defined(ATTR_NAMESPACE_SYSTEM)
-    if (a->x.sys && attrs_compare(a->x.sys, b->x.sys))
-      d |= 0x02000000;
-#endif
+  if (dst_nip) {
+    if (!lp->dvalid && fstatat(AT_FDCWD, lp->path, &sb, AT_SYMLINK_NOFOLLOW) == 0) {
+      lp->ddev = sb.st_dev;
+      lp->dino = sb.st_ino;
+      lp->dvalid = 1;
+    }
+    
+    /* Already a link to the right inode - nothing to copy or compare */
+    if (lp->dvalid && dst_nip->s.st_dev == lp->ddev && dst_nip->s.st_ino == lp->dino) {
+      stats_count(STATS_C_UNCHANGED, 1);
+      linkmap_seen(linkmap, lp);
+      return 0;
+    }
   }
 
-#if defined(UF_ARCHIVE)
-  if (f_flags) {
-    if ((a->s.st_flags & ~UF_ARCHIVE) != (b->s.st_flags & ~UF_ARCHIVE))
-      d |= 0x10000000;
-    if (f_flags > 1 && a->s.st_flags & UF_ARCHIVE)
-      d |= 0x20000000;
-  }
-#endif
+  stats_count(dst_nip ? STATS_C_CHANGED : STATS_C_NEW, 1);
+  if (f_verbose)
+    printf("%s %s => %s\n", dst_nip ? "!" : "+", dstpath, lp->path);
+
+  if (f_update)
+    rc = node_link(lp, src_nip, dst_nip, dstfd, dstname, dstpath);
   
-  return d;
+  linkmap_seen(linkmap, lp);
+  return rc;
 }
 
 
 int
 check_new_or_updated(const char *key,
-		     void *val,
-		     void *extra) {
-  DIRPAIR *xd = (DIRPAIR *) extra;
-  NODE *src_nip = (NODE *) val;
-  NODE *dst_nip;
-  int rc;
-  const char *srcpath;
+		     NODE *src_nip,
+		     NODE *dst_nip,
+		     DIRPAIR *xd) {
+  int rc, dstfd;
+  const char *srcpath, *dstname;
   char *dstpath;
 
   
+  /* Everything but an unchanged node needs the full metadata */
+  if (!dst_nip ||
+      (src_nip->s.st_mode & S_IFMT) != (dst_nip->s.st_mode & S_IFMT) ||
+      !node_typeonly_ok(src_nip->s.st_mode)) {
+    if (node_load(src_nip) < 0 || node_load(dst_nip) < 0)
+      return node_failed(src_nip, -1);
+  }
+
   if (xd->dst && xd->dst->path)
     dstpath = strdupcat(xd->dst->path, "/", key, NULL);
   else
     dstpath = strdup(key);
 
+  /* Operate relative to the open destination directory if possible */
+  if (xd->dst && xd->dst->fd >= 0) {
+    dstfd = xd->dst->fd;
+    dstname = key;
+  } else {
+    dstfd = AT_FDCWD;
+    dstname = dstpath;
+  }
+
   srcpath = src_nip->p;
   
   if (f_debug)
@@ -1528,13 +4058,18 @@ check_new_or_updated(const char *key,
 	    srcpath,
 	    dstpath);
 
-  dst_nip = NULL;
-  if (xd->dst->nodes)
-    btree_search(xd->dst->nodes, key, (void **) &dst_nip);
+  if (linkmap && S_ISREG(src_nip->s.st_mode) && src_nip->s.st_nlink > 1) {
+    rc = check_hardlink(src_nip, dst_nip, dstfd, dstname, dstpath);
+    if (rc <= 0) {
+      free(dstpath);
+      return rc < 0 ? node_failed(src_nip, rc) : 0;
+    }
+  }
 
   if (!dst_nip) {
     /* New file or dir */
 
+    stats_count(STATS_C_NEW, 1);
     if (f_verbose) {
       printf("+ %s", dstpath);
       node_print(NULL, src_nip, &f_verbose);
@@ -1542,44 +4077,44 @@ check_new_or_updated(const char *key,
 
     if (f_update) {
       if (S_ISREG(src_nip->s.st_mode)) {
-	/* Regular file */
-	if (f_content) {
-	  rc = file_copy(srcpath, dstpath, src_nip->s.st_mode);
-	  if (rc < 0) {
-	    if (f_debug)
-	      fprintf(stderr, "check_new_or_updated: file_copy(%s, %s, 0x%x) -> %d\n", srcpath, dstpath, src_nip->s.st_mode, rc);
-	    return f_ignore ? 0 : rc;
-	  }
+	/* Regular file - copy contents & update metadata */
+	rc = file_dispatch(xd, src_nip, NULL, dstfd, dstname, dstpath, 1);
+	if (rc < 0) {
+	  if (f_debug)
+	    fprintf(stderr, "check_new_or_updated: file_dispatch(%s, %s) -> %d\n", srcpath, dstpath, rc);
+	  return node_failed(src_nip, rc);
 	}
+	free(dstpath);
+	return 0;
 	  
       } else if (S_ISDIR(src_nip->s.st_mode)) {
 	/* Directory */
-	rc = mkdir(dstpath, src_nip->s.st_mode);
+	rc = mkdirat(dstfd, dstname, src_nip->s.st_mode);
 	if (rc < 0) {
 	  fprintf(stderr, "%s: Error: %s: mkdir: %s\n",
 		  argv0, dstpath, strerror(errno));
-	  return f_ignore ? 0 : rc;
+	  return node_failed(src_nip, rc);
 	}
       } else if (S_ISLNK(src_nip->s.st_mode)) {
-	rc = symlink(src_nip->l, dstpath);
+	rc = symlinkat(src_nip->l, dstfd, dstname);
 	if (rc < 0) {
 	  fprintf(stderr, "%s: Error: %s: symlink: %s\n",
 		  argv0, dstpath, strerror(errno));
-	  return f_ignore ? 0 : -1;
+	  return node_failed(src_nip, -1);
 	}
       } else if (S_ISBLK(src_nip->s.st_mode) || S_ISCHR(src_nip->s.st_mode)) {
 	rc = mknod(dstpath, src_nip->s.st_mode, src_nip->s.st_dev);
 	if (rc < 0) {
 	  fprintf(stderr, "%s: Error: %s: mknod: %s\n",
 		  argv0, dstpath, strerror(errno));
-	  return f_ignore ? 0 : rc;
+	  return node_failed(src_nip, rc);
 	}
       } else if (S_ISFIFO(src_nip->s.st_mode)) {
 	rc = mkfifo(dstpath, src_nip->s.st_mode);
 	if (rc < 0) {
 	  fprintf(stderr, "%s: Error: %s: mkfifo: %s\n",
 		  argv0, dstpath, strerror(errno));
-	  return f_ignore ? 0 : rc;
+	  return node_failed(src_nip, rc);
 	}
       } else if (S_ISSOCK(src_nip->s.st_mode)) {
 	struct sockaddr_un su;
@@ -1588,7 +4123,7 @@ check_new_or_updated(const char *key,
 	if (fd < 0) {
 	  fprintf(stderr, "%s: Error: socket(AF_UNIX): %s\n",
 		  argv0, strerror(errno));
-	  return f_ignore ? 0 : -1;
+	  return node_failed(src_nip, -1);
 	}
 
 	memset(&su, 0, sizeof(su));
@@ -1598,7 +4133,7 @@ check_new_or_updated(const char *key,
 	  fprintf(stderr, "%s: Error: %s: bind(AF_UNIX): %s\n",
 		  argv0, dstpath, strerror(errno));
 	  close(fd);
-	  return f_ignore ? 0 : -1;
+	  return node_failed(src_nip, -1);
 	}
 	close(fd);
       }
@@ -1613,23 +4148,21 @@ check_new_or_updated(const char *key,
 		  xd->dst->path,
 		  key,
 		  rc);
-	return f_ignore ? 0 : rc;
+	return node_failed(src_nip, rc);
       }
     }
 
     /* Update after subdirectory has been traversed to preserve timestamps */
     if (f_update) {
-      /* Refresh dst node */
-      /* XXX: get dst_nip */
-      
-      rc = node_update(src_nip, NULL, dstpath);
+      /* node_update() looks at the new object itself to skip no-op updates */
+      rc = node_update(src_nip, NULL, -1, dstfd, dstname, dstpath);
       if (rc < 0) {
 	if (f_debug)
 	  fprintf(stderr, "check_new_or_updated: node_update(%s, NULL, %s) [refresh]: rc=%d\n",
 		  src_nip->p,
 		  dstpath,
 		  rc);
-	return f_ignore ? 0 : rc;
+	return node_failed(src_nip, rc);
       }
     }
   
@@ -1639,6 +4172,7 @@ check_new_or_updated(const char *key,
     if (S_ISDIR(src_nip->s.st_mode) && !S_ISDIR(dst_nip->s.st_mode)) {
       /* Changed from non-dir -> dir */
 
+      stats_count(STATS_C_CHANGED, 1);
       if (f_verbose) {
 	printf("- %s", dstpath);
 	node_print(NULL, dst_nip, NULL);
@@ -1648,18 +4182,18 @@ check_new_or_updated(const char *key,
       }
 
       if (f_update) {
-	rc = unlink(dstpath);
+	rc = unlinkat(dstfd, dstname, 0);
 	if (rc < 0) {
 	  fprintf(stderr, "%s: Error: %s: unlink: %s\n",
 		  argv0, dstpath, strerror(errno));
-	  return f_ignore ? 0 : rc;
+	  return node_failed(src_nip, rc);
 	}
 	
-	rc = mkdir(dstpath, src_nip->s.st_mode);
+	rc = mkdirat(dstfd, dstname, src_nip->s.st_mode);
 	if (rc < 0) {
 	  fprintf(stderr, "%s: Error: %s: mkdir: %s\n",
 		  argv0, dstpath, strerror(errno));
-	  return f_ignore ? 0 : rc;
+	  return node_failed(src_nip, rc);
 	}
 
 	/* Refresh dst node */
@@ -1667,7 +4201,7 @@ check_new_or_updated(const char *key,
 	if (rc < 0) {
 	  if (f_debug)
 	    fprintf(stderr, "check_new_or_updated: node_get(%s) [refresh]: rc=%d\n", dst_nip->p, rc);
-	  return f_ignore ? 0 : rc;
+	  return node_failed(src_nip, rc);
 	}
       }
 
@@ -1679,20 +4213,20 @@ check_new_or_updated(const char *key,
 		    xd->src->path ? xd->src->path : "<null>",
 		    xd->dst->path ? xd->dst->path : "<null",
 		    key, rc);
-	  return f_ignore ? 0 : rc;
+	  return node_failed(src_nip, rc);
 	}
       }
       
       /* Update after subdirectory has been traversed to preserve timestamps */
       if (f_update) {
-	rc = node_update(src_nip, dst_nip, dstpath);
+	rc = node_update(src_nip, dst_nip, -1, dstfd, dstname, dstpath);
 	if (rc < 0) {
 	  if (f_debug)
 	    fprintf(stderr, "check_new_or_updated: node_update(%s, %s, %s): rc=%d\n",
 		    src_nip->p,
 		    dst_nip->p,
 		    dstpath, rc);
-	  return f_ignore ? 0 : rc;
+	  return node_failed(src_nip, rc);
 	}
       }
       
@@ -1706,10 +4240,11 @@ check_new_or_updated(const char *key,
 		    xd->src->path ? xd->src->path : "<null>",
 		    xd->dst->path ? xd->dst->path : "<null",
 		    key, rc);
-	  return f_ignore ? 0 : rc;
+	  return node_failed(src_nip, rc);
 	}
       }
 
+      stats_count(STATS_C_CHANGED, 1);
       if (f_verbose) {
 	printf("- %s", dstpath);
 	node_print(NULL, dst_nip, NULL);
@@ -1718,43 +4253,43 @@ check_new_or_updated(const char *key,
       }
 
       if (f_update) {
-	rc = rmdir(dstpath);
+	rc = unlinkat(dstfd, dstname, AT_REMOVEDIR);
 	if (rc < 0) {
 	  fprintf(stderr, "%s: Error: %s: rmdir: %s\n",
 		  argv0, dstpath, strerror(errno));
-	  return f_ignore ? 0 : rc;
+	  return node_failed(src_nip, rc);
 	}
 	
 	if (S_ISREG(src_nip->s.st_mode)) {
 	  if (f_content) {
-	    rc = file_copy(srcpath, dstpath, src_nip->s.st_mode);
+	    rc = node_copy(src_nip, dstfd, dstname, dstpath, NULL);
 	    if (rc < 0) {
 	      if (f_debug)
-		fprintf(stderr, "check_new_or_updated: file_copy(%s, %s, 0x%x) -> %d\n",
+		fprintf(stderr, "check_new_or_updated: node_copy(%s, %s, 0x%x) -> %d\n",
 			srcpath, dstpath, src_nip->s.st_mode, rc);
-	      return f_ignore ? 0 : rc;
+	      return node_failed(src_nip, rc);
 	    }
 	  }
 	} else if (S_ISLNK(src_nip->s.st_mode)) {
-	  rc = symlink(src_nip->l, dstpath);
+	  rc = symlinkat(src_nip->l, dstfd, dstname);
 	  if (rc < 0) {
 	    fprintf(stderr, "%s: Error: %s: symlink: %s\n",
 		    argv0, dstpath, strerror(errno));
-	    return f_ignore ? 0 : rc;
+	    return node_failed(src_nip, rc);
 	  }
 	} else if (S_ISBLK(src_nip->s.st_mode) || S_ISCHR(src_nip->s.st_mode)) {
 	  rc = mknod(dstpath, src_nip->s.st_mode, src_nip->s.st_dev);
 	  if (rc < 0) {
 	    fprintf(stderr, "%s: Error: %s: mknod: %s\n",
 		    argv0, dstpath, strerror(errno));
-	    return f_ignore ? 0 : rc;
+	    return node_failed(src_nip, rc);
 	  }
 	} else if (S_ISFIFO(src_nip->s.st_mode)) {
 	  rc = mkfifo(dstpath, src_nip->s.st_mode);
 	  if (rc < 0) {
 	    fprintf(stderr, "%s: Error: %s: mkfifo: %s\n",
 		    argv0, dstpath, strerror(errno));
-	    return f_ignore ? 0 : rc;
+	    return node_failed(src_nip, rc);
 	  }
 	} else if (S_ISSOCK(src_nip->s.st_mode)) {
 	  struct sockaddr_un su;
@@ -1763,7 +4298,7 @@ check_new_or_updated(const char *key,
 	  if (fd < 0) {
 	    fprintf(stderr, "%s: Error: socket(AF_UNIX): %s\n",
 		    argv0, strerror(errno));
-	    return f_ignore ? 0 : -1;
+	    return node_failed(src_nip, -1);
 	  }
 	  
 	  memset(&su, 0, sizeof(su));
@@ -1773,19 +4308,19 @@ check_new_or_updated(const char *key,
 	    fprintf(stderr, "%s: Error: %s: bind(AF_UNIX): %s\n",
 		    argv0, dstpath, strerror(errno));
 	    close(fd);
-	    return f_ignore ? 0 : -1;
+	    return node_failed(src_nip, -1);
 	  }
 	  close(fd);
 	}
 	
-	rc = node_update(src_nip, dst_nip, dstpath);
+	rc = node_update(src_nip, dst_nip, -1, dstfd, dstname, dstpath);
 	if (rc < 0) {
 	  if (f_debug)
 	    fprintf(stderr, "check_new_or_updated: node_update(%s, %s, %s): rc=%d\n",
 		    src_nip->p,
 		    dst_nip->p,
 		    dstpath, rc);
-	  return f_ignore ? 0 : rc;
+	  return node_failed(src_nip, rc);
 	}
 
 	/* Refresh dst node */
@@ -1794,12 +4329,13 @@ check_new_or_updated(const char *key,
 	  if (f_debug)
 	    fprintf(stderr, "check_new_or_updated: node_get(%s) [refresh]: rc=%d\n",
 		    dst_nip->p, rc);
-	  return f_ignore ? 0 : rc;
+	  return node_failed(src_nip, rc);
 	}
       }
       
     } else {
       /* Changed from non-dir to non-dir */
+      stats_count(STATS_C_CHANGED, 1);
       
       if (f_verbose) {
 	printf("* %s", dstpath);
@@ -1807,44 +4343,44 @@ check_new_or_updated(const char *key,
       }
       
       if (f_update) {
-	rc = unlink(dstpath);
+	rc = unlinkat(dstfd, dstname, 0);
 	if (rc < 0) {
 	  fprintf(stderr, "%s: Error: %s: unlink: %s\n",
 		  argv0, dstpath, strerror(errno));
-	  return f_ignore ? 0 : rc;
+	  return node_failed(src_nip, rc);
 	}
 	
 	if (S_ISREG(src_nip->s.st_mode)) {
 	  if (f_content) {
-	    rc = file_copy(srcpath, dstpath, src_nip->s.st_mode);
+	    rc = node_copy(src_nip, dstfd, dstname, dstpath, NULL);
 	    if (rc < 0) {
 	      if (f_debug)
-		fprintf(stderr, "check_new_or_updated: file_copy(%s, %s, 0x%x) -> %d\n",
+		fprintf(stderr, "check_new_or_updated: node_copy(%s, %s, 0x%x) -> %d\n",
 			srcpath, dstpath, src_nip->s.st_mode, rc);
-	      return f_ignore ? 0 : rc;
+	      return node_failed(src_nip, rc);
 	    }
 	  }
 	  
 	} else if (S_ISLNK(src_nip->s.st_mode)) {
-	  rc = symlink(src_nip->l, dstpath);
+	  rc = symlinkat(src_nip->l, dstfd, dstname);
 	  if (rc < 0) {
 	    fprintf(stderr, "%s: Error: %s: symlink: %s\n",
 		    argv0, dstpath, strerror(errno));
-	    return f_ignore ? 0 : rc;
+	    return node_failed(src_nip, rc);
 	  }
 	} else if (S_ISBLK(src_nip->s.st_mode) || S_ISCHR(src_nip->s.st_mode)) {
 	  rc = mknod(dstpath, src_nip->s.st_mode, src_nip->s.st_dev);
 	  if (rc < 0) {
 	    fprintf(stderr, "%s: Error: %s: symlink: %s\n",
 		    argv0, dstpath, strerror(errno));
-	    return f_ignore ? 0 : rc;
+	    return node_failed(src_nip, rc);
 	  }
 	} else if (S_ISFIFO(src_nip->s.st_mode)) {
 	  rc = mkfifo(dstpath, src_nip->s.st_mode);
 	  if (rc < 0) {
 	    fprintf(stderr, "%s: Error: %s: mkfifo: %s\n",
 		    argv0, dstpath, strerror(errno));
-	    return f_ignore ? 0 : rc;
+	    return node_failed(src_nip, rc);
 	  }
 	} else if (S_ISSOCK(src_nip->s.st_mode)) {
 	  struct sockaddr_un su;
@@ -1853,7 +4389,7 @@ check_new_or_updated(const char *key,
 	  if (fd < 0) {
 	    fprintf(stderr, "%s: Error: socket(AF_UNIX): %s\n",
 		    argv0, strerror(errno));
-	    return f_ignore ? 0 : -1;
+	    return node_failed(src_nip, -1);
 	  }
 	  
 	  memset(&su, 0, sizeof(su));
@@ -1863,19 +4399,19 @@ check_new_or_updated(const char *key,
 	    fprintf(stderr, "%s: Error: %s: bind(AF_UNIX): %s\n",
 		    argv0, dstpath, strerror(errno));
 	    close(fd);
-	    return f_ignore ? 0 : -1;
+	    return node_failed(src_nip, -1);
 	  }
 	  close(fd);
 	}
 	
-	rc = node_update(src_nip, dst_nip, dstpath);
+	rc = node_update(src_nip, dst_nip, -1, dstfd, dstname, dstpath);
 	if (rc < 0) {
 	  if (f_debug)
 	    fprintf(stderr, "check_new_or_updated: node_update(%s, %s, %s): rc=%d\n",
 		    src_nip->p,
 		    dst_nip->p,
 		    dstpath, rc);
-	  return f_ignore ? 0 : rc;
+	  return node_failed(src_nip, rc);
 	}
 	
 	/* Refresh dst node */
@@ -1884,7 +4420,7 @@ check_new_or_updated(const char *key,
 	  if (f_debug)
 	    fprintf(stderr, "check_new_or_updated: node_get(%s) [refresh] rc=%d\n",
 		    dst_nip->p, rc);
-	  return f_ignore ? 0 : rc;
+	  return node_failed(src_nip, rc);
 	}
       }
     }
@@ -1900,7 +4436,7 @@ check_new_or_updated(const char *key,
 		  xd->src->path,
 		  xd->dst->path,
 		  key, rc);
-	return f_ignore ? 0 : rc;
+	return node_failed(src_nip, rc);
       }
     }
     
@@ -1912,61 +4448,64 @@ check_new_or_updated(const char *key,
 	fprintf(stderr, "check_new_or_updated: node_compare: rc=%d (0x%x) (errno=%s)\n",
 		d, d, strerror(errno));
       
+      stats_count(STATS_C_CHANGED, 1);
       if (f_verbose) {
 	printf("! %s", dstpath);
 	node_print(NULL, src_nip, &f_verbose);
       }
       
       if (f_update) {
-	if (S_ISREG(src_nip->s.st_mode) &&
-	    f_content &&
-	    (f_force || d < 0 || (d & 0x200fff00))) { /* Force, Not Found,  Archive, Digest, Mtime, Size */
-	  /* Regular file */
-	  int rc;
-
-	  rc = file_copy(srcpath, dstpath, src_nip->s.st_mode);
+	if (node_load(src_nip) < 0 || node_load(dst_nip) < 0)
+	  return node_failed(src_nip, -1);
+	
+	if (S_ISREG(src_nip->s.st_mode)) {
+	  /* Regular file - copy contents (if needed) & update metadata */
+	  rc = file_dispatch(xd, src_nip, dst_nip, dstfd, dstname, dstpath,
+			     (f_force || d < 0 || (d & 0x200fff00))); /* Force, Not Found,  Archive, Digest, Mtime, Size */
 	  if (rc < 0) {
 	    if (f_debug)
-	      fprintf(stderr, "file_copy(%s, %s, 0x%x) -> %d\n", srcpath, dstpath, src_nip->s.st_mode, rc);
-	    return f_ignore ? 0 : rc;
+	      fprintf(stderr, "check_new_or_updated: file_dispatch(%s, %s) -> %d\n", srcpath, dstpath, rc);
+	    return node_failed(src_nip, rc);
 	  }
+	  free(dstpath);
+	  return 0;
 	} else if (S_ISLNK(src_nip->s.st_mode) &&
 		   (f_force || d < 0 || (d & 0x000000f0))) { /* Force, Not Found, Content */
-	  rc = unlink(dstpath);
+	  rc = unlinkat(dstfd, dstname, 0);
 	  if (rc < 0) {
 	    fprintf(stderr, "%s: Error: %s: unlink: %s\n",
 		    argv0, dstpath, strerror(errno));
-	    return f_ignore ? 0 : rc;
+	    return node_failed(src_nip, rc);
 	  }
-	  rc = symlink(src_nip->l, dstpath);
+	  rc = symlinkat(src_nip->l, dstfd, dstname);
 	  if (rc < 0) {
 	    fprintf(stderr, "%s: Error: %s: symlink: %s\n",
 		    argv0, dstpath, strerror(errno));
-	    return f_ignore ? 0 : rc;
+	    return node_failed(src_nip, rc);
 	  }
 	} else if (S_ISBLK(src_nip->s.st_mode) || S_ISCHR(src_nip->s.st_mode)) {
-	  rc = unlink(dstpath);
+	  rc = unlinkat(dstfd, dstname, 0);
 	  if (rc < 0) {
 	    fprintf(stderr, "%s: Error: %s: unlink: %s\n",
 		    argv0, dstpath, strerror(errno));
-	    return f_ignore ? 0 : rc;
+	    return node_failed(src_nip, rc);
 	  }
 	  rc = mknod(dstpath, src_nip->s.st_mode, src_nip->s.st_dev);
 	  if (rc < 0) {
 	    fprintf(stderr, "%s: Error: %s: symlink: %s\n",
 		    argv0, dstpath, strerror(errno));
-	    return f_ignore ? 0 : rc;
+	    return node_failed(src_nip, rc);
 	  }
 	} /* else do nothing special for fifos or sockets */
 	
-	rc = node_update(src_nip, dst_nip, dstpath);
+	rc = node_update(src_nip, dst_nip, -1, dstfd, dstname, dstpath);
 	if (rc < 0) {
 	  if (f_debug)
 	    fprintf(stderr, "check_new_or_updated: node_update(%s, %s, %s): rc=%d\n",
 		    src_nip->p,
 		    dst_nip->p,
 		    dstpath, rc);
-	  return f_ignore ? 0 : rc;
+	  return node_failed(src_nip, rc);
 	}
 	
 	/* Refresh dst node */
@@ -1975,10 +4514,11 @@ check_new_or_updated(const char *key,
 	  if (f_debug)
 	    fprintf(stderr, "check_new_or_updated: node_get(%s) [refresh] rc=%d\n",
 		    dst_nip->p, rc);
-	  return f_ignore ? 0 : rc;
+	  return node_failed(src_nip, rc);
 	}
       }
-    }
+    } else
+      stats_count(STATS_C_UNCHANGED, 1);
   }
   
   free(dstpath);
@@ -1988,21 +4528,19 @@ check_new_or_updated(const char *key,
 
 int
 check_removed(const char *key,
-	      void *val,
-	      void *extra) {
-  NODE *dst_nip = (NODE *) val;
-  DIRPAIR *xd = (DIRPAIR *) extra;
+	      NODE *dst_nip,
+	      DIRPAIR *xd) {
   char *dstpath = dst_nip->p;
-  NODE *src_nip;
   int rc = -1;
   
 
-  src_nip = NULL;
-  btree_search(xd->src->nodes, key, (void **) &src_nip);
-  if (src_nip)
-    return 0;
+  /* Object not found in source - the type is enough unless printing or caching */
+  if ((f_verbose || (dcache_flags() & DCACHE_FLAG_FILE)) && node_load(dst_nip) < 0)
+    return f_ignore ? 0 : -1;
   
-  /* Object not found in source */
+  /* Don't expunge the digest cache if it is stored in the destination */
+  if (dcache_self(&dst_nip->s))
+    return 0;
 
   /* First we recurse down */
   if (f_recurse && S_ISDIR(dst_nip->s.st_mode)) {
@@ -2017,6 +4555,7 @@ check_removed(const char *key,
     }
   }
   
+  stats_count(STATS_C_REMOVED, 1);
   if (f_verbose) {
     printf("- %s", dstpath);
     node_print(NULL, dst_nip, NULL);
@@ -2024,7 +4563,7 @@ check_removed(const char *key,
   
   if (f_update) {
     if (S_ISDIR(dst_nip->s.st_mode)) {
-      rc = rmdir(dstpath);
+      rc = unlinkat(dst_nip->dfd, dst_nip->n, AT_REMOVEDIR);
       if (rc < 0) {
 	fprintf(stderr, "%s: Error: %s: rmdir: %s\n",
 		argv0, dstpath, strerror(errno));
@@ -2032,7 +4571,7 @@ check_removed(const char *key,
       }
     }
     else {
-      rc = unlink(dstpath);
+      rc = unlinkat(dst_nip->dfd, dst_nip->n, 0);
       if (rc < 0) {
 	fprintf(stderr, "%s: Error: %s: unlink: %s\n",
 		argv0, dstpath, strerror(errno));
@@ -2041,7 +4580,146 @@ check_removed(const char *key,
     }
   }
   
-  return 0;
+  return 0;
+}
+
+
+/*
+ * Handle one name from the merged source & destination directory listings
+ */
+static int
+dirpair_check(const char *key,
+	      void *src_val,
+	      void *dst_val,
+	      void *extra) {
+  DIRPAIR *xd = (DIRPAIR *) extra;
+
+  
+  /* Not in the change list - assumed to be unchanged */
+  if (xd->filter &&
+      !change_wanted(src_val ? ((NODE *) src_val)->p : ((NODE *) dst_val)->p))
+    return 0;
+  
+  if (src_val)
+    return check_new_or_updated(key, (NODE *) src_val, (NODE *) dst_val, xd);
+  
+  if (f_remove)
+    return check_removed(key, (NODE *) dst_val, xd);
+
+  return 0;
+}
+
+
+/*
+ * First pass - handle everything that doesn't need a descent
+ */
+static int
+dirpair_check_nodirs(const char *key,
+		     void *src_val,
+		     void *dst_val,
+		     void *extra) {
+  DIRPAIR *xd = (DIRPAIR *) extra;
+  NODE *src_nip = (NODE *) src_val;
+  NODE *dst_nip = (NODE *) dst_val;
+  char *name;
+  int rc;
+
+  
+  if (f_recurse &&
+      ((src_nip && S_ISDIR(src_nip->s.st_mode)) ||
+       (dst_nip && S_ISDIR(dst_nip->s.st_mode))))
+    return 0;
+
+  rc = dirpair_check(key, src_val, dst_val, extra);
+  
+  /* Remember it so the nodes can be freed */
+  name = strdup(key);
+  if (name) {
+    if (xd->donec >= xd->dones) {
+      size_t ns = xd->dones ? xd->dones*2 : 64;
+      char **nv = realloc(xd->donev, ns*sizeof(*nv));
+      if (!nv) {
+	free(name);
+	return rc;
+      }
+      xd->donev = nv;
+      xd->dones = ns;
+    }
+    xd->donev[xd->donec++] = name;
+  }
+  
+  return rc;
+}
+
+
+typedef struct manifestdir {
+  int64_t idx;		/* Next record */
+  const char *path;	/* Destination directory */
+} MANIFESTDIR;
+
+
+static int
+manifest_put_node(const char *key,
+		  void *val,
+		  void *extra) {
+  MANIFESTDIR *mdp = (MANIFESTDIR *) extra;
+  NODE *nip = (NODE *) val;
+  int rc;
+
+
+  /* Not in the destination - the next -R run must look again */
+  if (nip->f & NODE_F_FAILED)
+    return 0;
+  
+  (void) node_load(nip);
+  
+  rc = manifest_put(mwrite, mdp->idx, key, &nip->s, nip->l,
+		    nip->d->valid ? nip->d->buf : NULL, nip->d->len,
+		    node_acls_hash(nip), node_attrs_hash(nip));
+  if (rc == 0 && S_ISDIR(nip->s.st_mode)) {
+    char *path = strdupcat(mdp->path, "/", key, NULL);
+
+    rc = path ? manifest_pending(mwrite, path, mdp->idx) : -1;
+    free(path);
+  }
+  
+  mdp->idx++;
+  return rc;
+}
+
+
+static int
+manifest_count_failed(const char *key,
+		      void *val,
+		      void *extra) {
+  (void) key;
+  
+  if (((NODE *) val)->f & NODE_F_FAILED)
+    ++*(size_t *) extra;
+  return 0;
+}
+
+
+/*
+ * Record the source directory entries in the manifest (-W). 'path' is
+ * where the directory goes (the manifest is of the destination-to-be).
+ * Entries that failed to sync are left out.
+ */
+static int
+manifest_put_dir(DIRNODE *src,
+		 const char *path) {
+  MANIFESTDIR md;
+  size_t nfailed = 0;
+
+
+  btree_foreach(src->nodes, manifest_count_failed, &nfailed);
+  
+  md.path = path;
+  md.idx = manifest_dir(mwrite, path, btree_entries(src->nodes) - nfailed);
+  if (md.idx < 0)
+    return errno == ENOENT ? 0 : -1;
+  
+  return btree_foreach(src->nodes, manifest_put_node, &md);
 }
 
 
@@ -2049,39 +4727,103 @@ int
 dirnode_compare(DIRNODE *src,
 		DIRNODE *dst) {
   DIRPAIR dat;
-  int rc;
+  size_t i;
+  int rc, jrc;
   
 
   dat.src = src;
   dat.dst = dst;
+  dat.donev = NULL;
+  dat.donec = dat.dones = 0;
+  dat.fjv = NULL;
+  dat.fjc = dat.fjs = 0;
+  jobgroup_init(&dat.jobs);
+
+  /* Everything is new if the destination is empty */
+  dat.filter = btree_entries(dst->nodes) > 0 && change_partial(src->path);
 
   if (f_debug)
     fprintf(stderr, "*** dirnode_compare: src=%s vs dst=%s\n",
 	    src->path ? src->path : "<null>",
 	    dst->path ? dst->path : "<null>");
   
-  rc = btree_foreach(dat.src->nodes, check_new_or_updated, &dat);
-  if (f_remove)
-    btree_foreach(dat.dst->nodes, check_removed, &dat);
+  /*
+   * Both listings are sorted the same way, so a single merged pass finds
+   * new, changed & removed objects. Non-directories are handled (and freed)
+   * first so only the directory nodes are kept in memory while descending.
+   */
+  rc = btree_merge(dat.src->nodes, dat.dst->nodes, dirpair_check_nodirs, &dat);
+
+  jrc = file_schedule(&dat);
+  if (jrc < 0 && rc == 0 && !f_ignore)
+    rc = jrc;
+  
+  /* Wait for file copies in this directory before the nodes are freed */
+  jrc = jobgroup_wait(&dat.jobs);
+  if (jrc < 0 && rc == 0)
+    rc = jrc;
+
+  /* After an error not all entries were looked at - leave them all out */
+  if (mwrite && rc == 0 && manifest_put_dir(src, dst->path) < 0) {
+    fprintf(stderr, "%s: Error: %s: Writing manifest: %s\n",
+	    argv0, f_wmanifest, strerror(errno));
+    exit(1);
+  }
 
+  for (i = 0; i < dat.donec; i++) {
+    btree_delete(dat.src->nodes, dat.donev[i]);
+    btree_delete(dat.dst->nodes, dat.donev[i]);
+    free(dat.donev[i]);
+  }
+  free(dat.donev);
+  
+  if (rc == 0 && (dirnode_compact(src) < 0 || dirnode_compact(dst) < 0)) {
+    fprintf(stderr, "%s: Error: %s: Compacting directory nodes: %s\n",
+	    argv0, src->path ? src->path : ".", strerror(errno));
+    exit(1);
+  }
+  
+  if (rc == 0) {
+    rc = btree_merge(dat.src->nodes, dat.dst->nodes, dirpair_check, &dat);
+    
+    jrc = file_schedule(&dat);
+    if (jrc < 0 && rc == 0 && !f_ignore)
+      rc = jrc;
+    
+    jrc = jobgroup_wait(&dat.jobs);
+    if (jrc < 0 && rc == 0)
+      rc = jrc;
+  }
+  
+  jobgroup_destroy(&dat.jobs);
   return rc;
 }
 
 
 int
 dir_compare(const char *srcpath,
-	    const char *dstpath) {
+	    int src_pfd,
+	    const char *dstpath,
+	    int dst_pfd) {
   DIRNODE *src;
   DIRNODE *dst;
+  JOBGROUP jg;
   int rc;
   
 
-  src = dirnode_alloc(srcpath);
-  dirnode_add(src, srcpath, 1);
-
+  /* Fetch the metadata for both listings at the same time */
+  jobgroup_init(&jg);
+  
   dst = dirnode_alloc(dstpath);
-  dirnode_add(dst, dstpath, 1);
+  dirnode_add_dst(dst, dstpath, dst_pfd, &jg);
+
+  src = dirnode_alloc(srcpath);
+  src->all = (btree_entries(dst->nodes) == 0);
+  dirnode_add(src, srcpath, src_pfd, 1, &jg);
 
+  jobgroup_wait(&jg);
+  jobgroup_destroy(&jg);
+  
   rc = dirnode_compare(src, dst);
   
   dirnode_free(dst);
@@ -2091,6 +4833,105 @@ dir_compare(const char *srcpath,
 }
 
 
+
+static int
+scan_digest(void *vp) {
+  NODE *nip = (NODE *) vp;
+
+  
+  if (node_load(nip) < 0 || file_digest(nip, 1) < 0)
+    fprintf(stderr, "%s: Error: %s: Digest: %s\n", argv0, nip->p, strerror(errno));
+  return 0;
+}
+
+static int
+scan_file_digest(const char *key,
+		 void *val,
+		 void *extra) {
+  NODE *nip = (NODE *) val;
+  JOBGROUP *gp = (JOBGROUP *) extra;
+
+
+  (void) key;
+  
+  if (!S_ISREG(nip->s.st_mode))
+    return 0;
+  
+  if (jobpool)
+    return jobpool_add(jobpool, gp, scan_digest, NULL, nip);
+  return scan_digest(nip);
+}
+
+static int
+scan_subdir(const char *key,
+	    void *val,
+	    void *extra);
+
+/*
+ * Scan a tree into the manifest only (-W without a destination) - for
+ * example on a file server, to be used with -R by a pc elsewhere
+ */
+static int
+tree_scan(const char *path,
+	  int pfd) {
+  DIRNODE *dnp;
+  JOBGROUP jg;
+  int rc;
+
+
+  jobgroup_init(&jg);
+  dnp = dirnode_alloc(path);
+  rc = dirnode_add(dnp, path, pfd, 1, &jg);
+  jobgroup_wait(&jg);
+  if (rc < 0) {
+    fprintf(stderr, "%s: Error: %s: %s\n", argv0, path, strerror(errno));
+    if (!f_ignore) {
+      jobgroup_destroy(&jg);
+      dirnode_free(dnp);
+      return -1;
+    }
+  }
+
+  /* Digests (in parallel if -j) so they are in the manifest */
+  if (f_digest) {
+    btree_foreach(dnp->nodes, scan_file_digest, &jg);
+    jobgroup_wait(&jg);
+  }
+  jobgroup_destroy(&jg);
+
+  if (manifest_put_dir(dnp, path) < 0) {
+    fprintf(stderr, "%s: Error: %s: Writing manifest: %s\n",
+	    argv0, f_wmanifest, strerror(errno));
+    exit(1);
+  }
+
+  rc = btree_foreach(dnp->nodes, scan_subdir, dnp);
+  dirnode_free(dnp);
+  return rc;
+}
+
+static int
+scan_subdir(const char *key,
+	    void *val,
+	    void *extra) {
+  NODE *nip = (NODE *) val;
+  DIRNODE *dnp = (DIRNODE *) extra;
+  char *path;
+  int rc;
+
+  
+  if (!S_ISDIR(nip->s.st_mode))
+    return 0;
+
+  path = strdupcat(dnp->path, "/", key, NULL);
+  if (!path)
+    return -1;
+  rc = tree_scan(path, dnp->fd >= 0 ? dnp->fd : AT_FDCWD);
+  free(path);
+  return (rc < 0 && f_ignore) ? 0 : rc;
+}
+
+
  
 #define OPT_NONE 0
 #define OPT_INT  1
@@ -2118,8 +4959,10 @@ OPTION opts[] = {
   { 'o', "owner",          NULL,        "Check and preserve owner & group", 0, NULL },
   { 't', "times",          NULL,        "Check mtime (and preserve mtime & atime if -tt)", 0, NULL },
   { 'x', "expunge",        NULL,        "Remove/replace deleted/changed objects", 0, NULL },
+  { 'H', "hard-links",     NULL,        "Preserve hard links", 0, NULL },
   { 'u', "no-copy",        NULL,        "Do not copy file contents", 0, NULL },
   { 'z', "zero-fill",      NULL,        "Try to generate zero-holed files", 0, NULL },
+  { 'I', "in-place",       NULL,        "Update changed files in place (only write differing blocks)", 0, NULL },
 #if defined(HAVE_ACL_GET_FILE) || defined(HAVE_ACL)
   { 'A', "acls",           NULL,        "Copy ACLs", 0, NULL },
   { 'N', "no-posix-acls",  NULL,        "Ignore POSIX ACLs (-NN = ignore if NFS ACL exist)", 0, NULL },
@@ -2136,7 +4979,27 @@ OPTION opts[] = {
   { 'a', "archive",        NULL,        "Archive mode (equal to '-rpottAXFU')", 0, NULL },
   { 'M', "mirror",         NULL,        "Mirror mode (equal to '-ax')", 0, NULL },
   { 'B', "buffer-size", "<size>",       "Set copy buffer size", OPT_SIZE, &f_bufsize },
+  { 'E', "no-cache",       NULL,        "Keep copied data out of the page cache (-EE: and use direct I/O)", 0, NULL },
+  { 'L', "bandwidth",   "<size>",       "Limit the I/O bandwidth to <size> per second", 0, NULL },
+  { 'S', "stats",          NULL,        "Print statistics at the end (-SS or --stats=json: as JSON)", 0, NULL },
+#if defined(HAVE_PTHREAD_H)
+  { 'j', "jobs",        "<n>",          "Number of parallel file copies", OPT_INT, &f_jobs },
+  { 'P', "prefetch",    "<n>",          "Number of parallel metadata lookups", OPT_INT, &f_prefetch },
+  { 'T', "digest-threads", "<n>",       "Number of threads per file digest (CRC32C, CRC32 & ADLER32)", OPT_INT, &f_dthreads },
+#endif
+#if defined(HAVE_URING)
+  { 'Q', "queue-depth", "<n>",          "Number of I/O requests in flight per copy", OPT_INT, &f_qdepth },
+#endif
+  { 'O', "order",       "<order>",      "Order file copies in a directory by name, inode or disk location [name]", 0, NULL },
   { 'D', "digest",      "<digest>",     "Set file content digest algorithm", 0, NULL },
+  { 'V', "verify",         NULL,        "Digest contents while copying (-VV: and verify destination)", 0, NULL },
+  { 'C', "digest-cache", "<path>",      "Cache file digests in <path> (file or directory)", 0, NULL },
+#if defined(HAVE_GETXATTR) || defined(HAVE_EXTATTR_GET_FILE)
+  { 'K', "digest-attr",    NULL,        "Cache file digests in extended attributes (-KK: also on source files)", 0, NULL },
+#endif
+  { 'c', "changes",     "<file>",       "Only check the paths listed in <file> (incremental mode)", 0, NULL },
+  { 'W', "write-manifest", "<path>",    "Write a manifest of the source tree to <path>", 0, NULL },
+  { 'R', "read-manifest", "<path>",     "Use the manifest in <path> instead of reading the destination", 0, NULL },
   { 0, NULL, NULL, NULL },
 };
 
@@ -2173,11 +5036,13 @@ get_option(const char *s,
 int
 main(int argc,
      char *argv[]) {
-  int i, j, k, n, rc;
-  char *ds;
+  int i, j, k, n, rc, scan;
+  char *ds, *js;
   const char *bs;
+  char tmpbuf[80];
   DIRNODE *src;
   DIRNODE *dst;
+  struct rlimit rl;
 
   if (geteuid() != 0) {
     int rc;
@@ -2259,6 +5124,10 @@ main(int argc,
 	++f_zero;
 	break;
 
+      case 'I':
+	++f_inplace;
+	break;
+
       case 'p':
 	++f_perms;
 	break;
@@ -2275,6 +5144,10 @@ main(int argc,
 	++f_remove;
 	break;
 
+      case 'H':
+	++f_hardlinks;
+	break;
+
       case 'N':
 	++f_nfsonly;
 	break;
@@ -2283,6 +5156,30 @@ main(int argc,
 	++f_acls;
 	break;
         
+      case 'V':
+	++f_verify;
+	break;
+
+      case 'E':
+	++f_nocache;
+	break;
+
+      case 'S':
+	if (strcmp(argv[i]+j+1, "json") == 0) {
+	  f_stats = 2;
+	  goto NextArg;
+	}
+	if (sscanf(argv[i]+j+1, "%d", &f_stats) == 1)
+	  goto NextArg;
+	++f_stats;
+	break;
+        
+#if defined(HAVE_GETXATTR) || defined(HAVE_EXTATTR_GET_FILE)
+      case 'K':
+	++f_dattr;
+	break;
+#endif
+        
 #if defined(HAVE_GETXATTR) || defined(HAVE_EXTATTR_GET_FILE)
       case 'X':
 	++f_attrs;
@@ -2312,6 +5209,25 @@ main(int argc,
 	f_aflag   = 1; /* UF_ARCHIVE handling */
 	break;
 
+      case 'O':
+	ds = NULL;
+	if (argv[i][j+1])
+	  ds = argv[i]+j+1;
+	else if (argv[i+1])
+	  ds = argv[++i];
+	if (ds && strcmp(ds, "name") == 0)
+	  f_order = ORDER_NAME;
+	else if (ds && strcmp(ds, "inode") == 0)
+	  f_order = ORDER_INODE;
+	else if (ds && strcmp(ds, "disk") == 0)
+	  f_order = ORDER_DISK;
+	else {
+	  fprintf(stderr, "%s: Error: %s: Invalid copy order (name, inode or disk)\n",
+		  argv0, ds ? ds : "<null>");
+	  exit(1);
+	}
+	goto NextArg;
+	
       case 'D':
 	ds = NULL;
 	if (argv[i][j+1])
@@ -2326,6 +5242,58 @@ main(int argc,
 	}
 	goto NextArg;
 	
+      case 'C':
+	f_dcache = NULL;
+	if (argv[i][j+1])
+	  f_dcache = argv[i]+j+1;
+	else if (argv[i+1])
+	  f_dcache = argv[++i];
+	if (!f_dcache || !*f_dcache) {
+	  fprintf(stderr, "%s: Error: Missing digest cache path\n",
+		  argv0);
+	  exit(1);
+	}
+	goto NextArg;
+
+      case 'c':
+	f_changes = NULL;
+	if (argv[i][j+1])
+	  f_changes = argv[i]+j+1;
+	else if (argv[i+1])
+	  f_changes = argv[++i];
+	if (!f_changes || !*f_changes) {
+	  fprintf(stderr, "%s: Error: Missing change list path\n",
+		  argv0);
+	  exit(1);
+	}
+	goto NextArg;
+
+      case 'W':
+	f_wmanifest = NULL;
+	if (argv[i][j+1])
+	  f_wmanifest = argv[i]+j+1;
+	else if (argv[i+1])
+	  f_wmanifest = argv[++i];
+	if (!f_wmanifest || !*f_wmanifest) {
+	  fprintf(stderr, "%s: Error: Missing manifest path\n",
+		  argv0);
+	  exit(1);
+	}
+	goto NextArg;
+
+      case 'R':
+	f_rmanifest = NULL;
+	if (argv[i][j+1])
+	  f_rmanifest = argv[i]+j+1;
+	else if (argv[i+1])
+	  f_rmanifest = argv[++i];
+	if (!f_rmanifest || !*f_rmanifest) {
+	  fprintf(stderr, "%s: Error: Missing manifest path\n",
+		  argv0);
+	  exit(1);
+	}
+	goto NextArg;
+	
       case 'B':
 	bs = NULL;
 	if (argv[i][j+1])
@@ -2339,6 +5307,75 @@ main(int argc,
 	}
 	goto NextArg;
 	
+      case 'L':
+	bs = NULL;
+	if (argv[i][j+1])
+	  bs = argv[i]+j+1;
+	else if (argv[i+1])
+	  bs = argv[++i];
+	if (str2size(&bs, &f_bwlimit) < 0) {
+	  fprintf(stderr, "%s: Error: %s: Invalid bandwidth limit\n",
+		  argv0, bs);
+	  exit(1);
+	}
+	goto NextArg;
+	
+#if defined(HAVE_PTHREAD_H)
+      case 'j':
+	js = NULL;
+	if (argv[i][j+1])
+	  js = argv[i]+j+1;
+	else if (argv[i+1])
+	  js = argv[++i];
+	if (!js || sscanf(js, "%d", &f_jobs) != 1 || f_jobs < 1) {
+	  fprintf(stderr, "%s: Error: %s: Invalid number of jobs\n",
+		  argv0, js ? js : "<null>");
+	  exit(1);
+	}
+	goto NextArg;
+
+      case 'P':
+	js = NULL;
+	if (argv[i][j+1])
+	  js = argv[i]+j+1;
+	else if (argv[i+1])
+	  js = argv[++i];
+	if (!js || sscanf(js, "%d", &f_prefetch) != 1 || f_prefetch < 1) {
+	  fprintf(stderr, "%s: Error: %s: Invalid number of metadata lookups\n",
+		  argv0, js ? js : "<null>");
+	  exit(1);
+	}
+	goto NextArg;
+
+      case 'T':
+	js = NULL;
+	if (argv[i][j+1])
+	  js = argv[i]+j+1;
+	else if (argv[i+1])
+	  js = argv[++i];
+	if (!js || sscanf(js, "%d", &f_dthreads) != 1 || f_dthreads < 1) {
+	  fprintf(stderr, "%s: Error: %s: Invalid number of digest threads\n",
+		  argv0, js ? js : "<null>");
+	  exit(1);
+	}
+	goto NextArg;
+#endif
+
+#if defined(HAVE_URING)
+      case 'Q':
+	js = NULL;
+	if (argv[i][j+1])
+	  js = argv[i]+j+1;
+	else if (argv[i+1])
+	  js = argv[++i];
+	if (!js || sscanf(js, "%d", &f_qdepth) != 1 || f_qdepth < 1 || f_qdepth > URING_DEPTH_MAX) {
+	  fprintf(stderr, "%s: Error: %s: Invalid queue depth (1-%d)\n",
+		  argv0, js ? js : "<null>", URING_DEPTH_MAX);
+	  exit(1);
+	}
+	goto NextArg;
+#endif
+
       case '-':
 	++i;
 	goto EndArg;
@@ -2384,7 +5421,8 @@ main(int argc,
 	puts("  Options may be specified multiple times (-vv), or values may be specified");
 	puts("  (-v2 or --verbose=2). A single '-' ends option parsing. If no Digest is ");
 	puts("  selected then only mtime & file size will be used to detect file");
-	puts("  content changes.");
+	puts("  content changes. With -W and only a single <dir> argument the tree is");
+	puts("  just scanned into the manifest (for use with -R elsewhere, '-' = stdout).");
 	printf("\nVersion:\n  %s\n", version);
 	printf("\nAuthor:\n");
 	puts("  Peter Eriksson <pen@lysator.liu.se>");
@@ -2402,33 +5440,261 @@ main(int argc,
  EndArg:
   argv0 = argv[0];
 
+  /* -W with only a directory: just scan it into the manifest */
+  scan = (f_wmanifest && i+1 == argc);
+  
+  if ((f_verbose || f_stats) && f_wmanifest && strcmp(f_wmanifest, "-") == 0) {
+    fprintf(stderr, "%s: Error: Verbose output (-v, -S) and a manifest on stdout (-W -) do not mix\n",
+	    argv0);
+    exit(1);
+  }
+
+  if (f_stats)
+    stats_init();
+  
   if (f_verbose)
     printf("[%s, v%s - Peter Eriksson <pen@lysator.liu.se> (%s)]\n", PACKAGE_NAME, version, url);
   
-  if (i+2 > argc) {
+  if (!scan && i+2 > argc) {
     fprintf(stderr, "%s: Error: Missing required arguments: <src-1> [.. <src-N>] <dst>\n",
 	    argv0);
     exit(1);
   }
 
-  src = dirnode_alloc(NULL);
-  for (j = i; j < argc-1; j++) {
-    rc = dirnode_add(src, argv[j], 0);
+  if (scan && (f_changes || f_rmanifest)) {
+    fprintf(stderr, "%s: Error: Scanning (-W without a destination) does not use -c or -R\n",
+	    argv0);
+    exit(1);
+  }
+
+  if (f_verify && !f_digest) {
+    fprintf(stderr, "%s: Error: Verification requires a digest algorithm (-D)\n",
+	    argv0);
+    exit(1);
+  }
+  
+  if (buffer_pool_init(f_bufsize) < 0) {
+    fprintf(stderr, "%s: Error: %s: Invalid buffer size\n",
+	    argv0, size2str(f_bufsize, tmpbuf, sizeof(tmpbuf), 0));
+    exit(1);
+  }
+  f_bufsize = buffer_pool_size();
+
+  iopace_init(f_bwlimit,
+	      (f_nocache ? IOPACE_F_NOCACHE : 0) | (f_nocache > 1 ? IOPACE_F_DIRECT : 0));
+  
+  /*
+   * Directories are kept open while descending. Deeper levels fall back
+   * to full paths so there are descriptors left for the file copies.
+   */
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+    dirfd_max = (int) rl.rlim_cur - 16 - 4*f_jobs;
+    if (dirfd_max < 0)
+      dirfd_max = 0;
+  }
+  
+  if (f_jobs > 1) {
+    jobpool = jobpool_create(f_jobs);
+    if (!jobpool) {
+      fprintf(stderr, "%s: Error: jobpool_create(%d): %s\n",
+	      argv0, f_jobs, strerror(errno));
+      exit(1);
+    }
+  }
+
+#if defined(ACL_TYPE_NFS4) || defined(ACL_TYPE_ACCESS) || defined(ACL_TYPE_DEFAULT)
+  if (f_acls)
+    acl_intern = intern_create(acl_intern_hash, acl_intern_cmp, acl_intern_free);
+#endif
+  if (f_attrs)
+    attrs_intern = intern_create(attrs_intern_hash, attrs_intern_cmp, attrs_intern_free);
+
+  if (f_hardlinks) {
+    linkmap = linkmap_create();
+    if (!linkmap) {
+      fprintf(stderr, "%s: Error: linkmap_create: %s\n",
+	      argv0, strerror(errno));
+      exit(1);
+    }
+  }
+  
+  if (f_prefetch > 1) {
+    statpool = jobpool_create(f_prefetch);
+    if (!statpool) {
+      fprintf(stderr, "%s: Error: jobpool_create(%d): %s\n",
+	      argv0, f_prefetch, strerror(errno));
+      exit(1);
+    }
+  }
+
+  if (f_dthreads > 1 && digest_combinable(f_digest)) {
+    digestpool = jobpool_create(f_dthreads);
+    if (!digestpool) {
+      fprintf(stderr, "%s: Error: jobpool_create(%d): %s\n",
+	      argv0, f_dthreads, strerror(errno));
+      exit(1);
+    }
+  }
+
+  if (f_dcache || f_dattr) {
+    if (!f_digest) {
+      fprintf(stderr, "%s: Error: Digest caching requires a digest algorithm (-D)\n",
+	      argv0);
+      exit(1);
+    }
+    if (dcache_open(f_dcache,
+		    (f_dcache ? DCACHE_FLAG_FILE : 0) | (f_dattr ? DCACHE_FLAG_ATTR : 0) |
+		    (f_update ? 0 : DCACHE_FLAG_RDONLY)) < 0) {
+      fprintf(stderr, "%s: Error: %s: Loading digest cache: %s\n",
+	      argv0, f_dcache, strerror(errno));
+      exit(1);
+    }
+  }
+
+  if (f_changes) {
+    char *rpath;
+    size_t len;
+    
+    if (i+2 != argc) {
+      fprintf(stderr, "%s: Error: Incremental mode (-c) requires a single source\n",
+	      argv0);
+      exit(1);
+    }
+
+    /* The source root and where it goes (like in dirnode_add) */
+    len = strlen(argv[i]);
+    while (len > 1 && argv[i][len-1] == '/')
+      --len;
+    changes_src = strndup(argv[i], len);
+    
+    len = strlen(argv[i+1]);
+    while (len > 1 && argv[i+1][len-1] == '/')
+      --len;
+    if (argv[i][strlen(argv[i])-1] == '/')
+      changes_dst = strndup(argv[i+1], len);
+    else {
+      char *base = strrchr(changes_src, '/');
+      char *dbuf = strndup(argv[i+1], len);
+
+      changes_dst = strdupcat(dbuf, "/", base ? base+1 : changes_src, NULL);
+      free(dbuf);
+    }
+    
+    rpath = realpath(changes_src, NULL);
+    changes = changes_create(rpath ? rpath : changes_src);
+    free(rpath);
+    if (!changes) {
+      fprintf(stderr, "%s: Error: changes_create: %s\n",
+	      argv0, strerror(errno));
+      exit(1);
+    }
+    if (changes_load(changes, f_changes) < 0) {
+      fprintf(stderr, "%s: Error: %s: Loading change list: %s\n",
+	      argv0, f_changes, strerror(errno));
+      exit(1);
+    }
+  }
+
+  if (f_rmanifest) {
+    size_t len;
+    
+    mread = manifest_open(f_rmanifest);
+    if (!mread) {
+      fprintf(stderr, "%s: Error: %s: Loading manifest: %s\n",
+	      argv0, f_rmanifest, strerror(errno));
+      exit(1);
+    }
+    
+    len = strlen(argv[argc-1]);
+    while (len > 1 && argv[argc-1][len-1] == '/')
+      --len;
+    mread_root = strndup(argv[argc-1], len);
+  }
+  
+  /* A dry-run doesn't bring the destination in sync with the source */
+  if (f_wmanifest && (scan || f_update)) {
+    mwrite = manifest_create(f_wmanifest, f_digest);
+    if (!mwrite) {
+      fprintf(stderr, "%s: Error: %s: Creating manifest: %s\n",
+	      argv0, f_wmanifest, strerror(errno));
+      exit(1);
+    }
+  }
+  
+  if (scan) {
+    rc = (tree_scan(argv[i], AT_FDCWD) < 0);
+    jobpool_destroy(jobpool);
+  } else {
+    src = dirnode_alloc(NULL);
+    for (j = i; j < argc-1; j++) {
+      rc = dirnode_add(src, argv[j], AT_FDCWD, 0, NULL);
+      if (rc < 0) {
+	fprintf(stderr, "%s: Error: %s: %s\n", argv0, argv[j], strerror(errno));
+	exit(1);
+      }
+    }
+    
+    dst = dirnode_alloc(argv[argc-1]);
+    /* XXX - Handle dst being non-dir */
+    rc = dirnode_add_dst(dst, argv[argc-1], AT_FDCWD, NULL);
     if (rc < 0) {
       fprintf(stderr, "%s: Error: %s: %s\n", argv0, argv[j], strerror(errno));
       exit(1);
     }
+    
+    rc = dirnode_compare(src, dst);
+    
+    jobpool_destroy(jobpool);
+    
+    /* Drops the references to the shared ACLs & attributes */
+    dirnode_free(dst);
+    dirnode_free(src);
+  }
+
+  jobpool_destroy(statpool);
+  jobpool_destroy(digestpool);
+  intern_destroy(attrs_intern);
+  intern_destroy(acl_intern);
+  linkmap_destroy(linkmap);
+  changes_destroy(changes);
+  free(changes_src);
+  free(changes_dst);
+
+  if (f_verbose || f_stats) {
+    struct rusage ru;
+    size_t maxrss = 0;
+
+    if (getrusage(RUSAGE_SELF, &ru) == 0) {
+#if defined(__APPLE__)
+      maxrss = ru.ru_maxrss;		/* Bytes */
+#else
+      maxrss = ru.ru_maxrss * 1024;	/* Kilobytes */
+#endif
+      if (f_verbose)
+	printf("[Peak memory usage: %s]\n", size2str(maxrss, tmpbuf, sizeof(tmpbuf), 0));
+    }
+    if (f_stats)
+      stats_print(stdout, f_stats > 1, maxrss);
   }
   
-  dst = dirnode_alloc(argv[argc-1]);
-  /* XXX - Handle dst being non-dir */
-  rc = dirnode_add(dst, argv[argc-1], 1);
-  if (rc < 0) {
-    fprintf(stderr, "%s: Error: %s: %s\n", argv0, argv[j], strerror(errno));
-    exit(1);
+  if (manifest_close(mwrite) < 0) {
+    fprintf(stderr, "%s: Error: %s: Saving manifest: %s\n",
+	    argv0, f_wmanifest, strerror(errno));
+    if (rc == 0)
+      rc = 1;
+  }
+  manifest_close(mread);
+  free(mread_root);
+  
+  if (dcache_close() < 0) {
+    fprintf(stderr, "%s: Error: %s: Saving digest cache: %s\n",
+	    argv0, f_dcache, strerror(errno));
+    if (rc == 0)
+      rc = 1;
   }
   
-  return dirnode_compare(src, dst);
+  buffer_pool_destroy();
+  return rc;
 }
 
 
@@ -0,0 +1,186 @@
+/*
+ * stats.c - Counters & timers (-S)
+ * 
+ * Copyright (c) 2021, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+
+int stats_enabled = 0;
+
+static uint64_t stats_t0 = 0;
+static uint64_t stats_tns[STATS_T_LAST+1];
+static uint64_t stats_tcalls[STATS_T_LAST+1];
+static uint64_t stats_cv[STATS_C_LAST+1];
+static uint64_t stats_sv[STATS_S_LAST+1];
+
+static const char *stats_tnames[STATS_T_LAST+1] = {
+  "scan", "meta", "digest", "copy", "update"
+};
+
+static const char *stats_cnames[STATS_C_LAST+1] = {
+  "new", "changed", "unchanged", "removed",
+  "files_copied", "bytes_copied", "bytes_digested",
+  "dirs_read", "entries_read"
+};
+
+static const char *stats_snames[STATS_S_LAST+1] = {
+  "stat", "readlink", "acl_get", "xattr_list", "opendir", "open"
+};
+
+
+
+/*
+ * Monotonic time in nanoseconds
+ */
+uint64_t
+stats_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+void
+stats_init(void) {
+  stats_enabled = 1;
+  stats_t0 = stats_now();
+}
+
+
+/*
+ * Start timing something. Returns 0 (and costs nothing more) if the
+ * statistics are disabled.
+ */
+uint64_t
+stats_start(void) {
+  return stats_enabled ? stats_now() : 0;
+}
+
+
+void
+stats_stop(int timer,
+	   uint64_t t0) {
+  if (!t0)
+    return;
+  
+  __atomic_fetch_add(&stats_tns[timer], stats_now() - t0, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&stats_tcalls[timer], 1, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Add time to a timer without counting a call - for work done in
+ * pieces (digesting while copying). See stats_call().
+ */
+void
+stats_add(int timer,
+	  uint64_t t0) {
+  if (t0)
+    __atomic_fetch_add(&stats_tns[timer], stats_now() - t0, __ATOMIC_RELAXED);
+}
+
+
+void
+stats_call(int timer) {
+  if (stats_enabled)
+    __atomic_fetch_add(&stats_tcalls[timer], 1, __ATOMIC_RELAXED);
+}
+
+
+void
+stats_count(int counter,
+	    uint64_t n) {
+  if (stats_enabled)
+    __atomic_fetch_add(&stats_cv[counter], n, __ATOMIC_RELAXED);
+}
+
+
+void
+stats_syscall(int sc) {
+  if (stats_enabled)
+    __atomic_fetch_add(&stats_sv[sc], 1, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Print the statistics, as text or as a JSON object. The timer
+ * seconds are wall clock time summed over all threads.
+ */
+void
+stats_print(FILE *fp,
+	    int json,
+	    size_t maxrss) {
+  double elapsed = (stats_now() - stats_t0) / 1e9;
+  int i;
+
+
+  if (json) {
+    fprintf(fp, "{\"elapsed\": %.6f, \"peak_rss\": %lu", elapsed, (unsigned long) maxrss);
+    
+    fputs(", \"counters\": {", fp);
+    for (i = 0; i <= STATS_C_LAST; i++)
+      fprintf(fp, "%s\"%s\": %llu", i ? ", " : "",
+	      stats_cnames[i], (unsigned long long) stats_cv[i]);
+    
+    fputs("}, \"timers\": {", fp);
+    for (i = 0; i <= STATS_T_LAST; i++)
+      fprintf(fp, "%s\"%s\": {\"calls\": %llu, \"seconds\": %.6f}", i ? ", " : "",
+	      stats_tnames[i], (unsigned long long) stats_tcalls[i], stats_tns[i] / 1e9);
+    
+    fputs("}, \"syscalls\": {", fp);
+    for (i = 0; i <= STATS_S_LAST; i++)
+      fprintf(fp, "%s\"%s\": %llu", i ? ", " : "",
+	      stats_snames[i], (unsigned long long) stats_sv[i]);
+    fputs("}}\n", fp);
+    return;
+  }
+
+  fprintf(fp, "[Statistics: %.3f s elapsed, %lu bytes peak memory]\n", elapsed, (unsigned long) maxrss);
+  for (i = 0; i <= STATS_C_LAST; i++)
+    fprintf(fp, "  %-16s %12llu\n", stats_cnames[i], (unsigned long long) stats_cv[i]);
+  fputs("  Wall time (summed over threads):\n", fp);
+  for (i = 0; i <= STATS_T_LAST; i++)
+    fprintf(fp, "    %-14s %12llu calls %12.3f s\n", stats_tnames[i],
+	    (unsigned long long) stats_tcalls[i], stats_tns[i] / 1e9);
+  fputs("  System calls:\n", fp);
+  for (i = 0; i <= STATS_S_LAST; i++)
+    fprintf(fp, "    %-14s %12llu\n", stats_snames[i], (unsigned long long) stats_sv[i]);
+}
@@ -0,0 +1,107 @@
+/*
+ * stats.h - Counters & timers (-S)
+ * 
+ * Copyright (c) 2021, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef STATS_H
+#define STATS_H 1
+
+#include <stdio.h>
+#include <stdint.h>
+
+
+/* Timers (wall clock time - summed over all threads, so waiting for I/O counts) */
+#define STATS_T_SCAN      0	/* Reading directories, stat & readlink */
+#define STATS_T_META      1	/* Getting ACLs & extended attributes */
+#define STATS_T_DIGEST    2	/* Content digests (also while copying & verifying) */
+#define STATS_T_COPY      3	/* Copying file contents */
+#define STATS_T_UPDATE    4	/* Updating metadata */
+#define STATS_T_LAST      4
+
+/* Counters */
+#define STATS_C_NEW       0	/* Objects created */
+#define STATS_C_CHANGED   1	/* Objects updated */
+#define STATS_C_UNCHANGED 2	/* Objects already up to date */
+#define STATS_C_REMOVED   3	/* Objects removed */
+#define STATS_C_FILES     4	/* Files copied */
+#define STATS_C_BYTES     5	/* Bytes copied */
+#define STATS_C_DBYTES    6	/* Bytes digested */
+#define STATS_C_DIRS      7	/* Directories read */
+#define STATS_C_ENTRIES   8	/* Directory entries read */
+#define STATS_C_LAST      8
+
+/* System call counters */
+#define STATS_S_STAT      0
+#define STATS_S_READLINK  1
+#define STATS_S_ACL       2	/* acl_get_*() */
+#define STATS_S_XATTR     3	/* Extended attribute listings */
+#define STATS_S_OPENDIR   4
+#define STATS_S_OPEN      5	/* Files opened for copying or digesting */
+#define STATS_S_LAST      5
+
+
+extern int stats_enabled;
+
+
+extern void
+stats_init(void);
+
+extern uint64_t
+stats_now(void);
+
+extern uint64_t
+stats_start(void);
+
+extern void
+stats_stop(int timer,
+	   uint64_t t0);
+
+extern void
+stats_add(int timer,
+	  uint64_t t0);
+
+extern void
+stats_call(int timer);
+
+extern void
+stats_count(int counter,
+	    uint64_t n);
+
+extern void
+stats_syscall(int sc);
+
+extern void
+stats_print(FILE *fp,
+	    int json,
+	    size_t maxrss);
+
+#endif
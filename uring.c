@@ -0,0 +1,214 @@
+/*
+ * uring.c - Minimal Linux io_uring interface
+ * 
+ * Copyright (c) 2021, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+#if defined(HAVE_URING)
+
+#include <sys/mman.h>
+
+
+int
+uring_init(URING *rp,
+	   unsigned int entries) {
+  struct io_uring_params p;
+  unsigned char *sp, *cp;
+
+
+  memset(rp, 0, sizeof(*rp));
+  memset(&p, 0, sizeof(p));
+  rp->fd = -1;
+
+  rp->fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (rp->fd < 0)
+    return -1;
+
+  rp->entries = p.sq_entries;
+  rp->sq_size = p.sq_off.array + p.sq_entries*sizeof(unsigned int);
+  rp->cq_size = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (rp->cq_size > rp->sq_size)
+      rp->sq_size = rp->cq_size;
+    rp->cq_size = rp->sq_size;
+  }
+  
+  rp->sq_ptr = mmap(NULL, rp->sq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+		    rp->fd, IORING_OFF_SQ_RING);
+  if (rp->sq_ptr == MAP_FAILED) {
+    rp->sq_ptr = NULL;
+    goto Fail;
+  }
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    rp->cq_ptr = rp->sq_ptr;
+  else {
+    rp->cq_ptr = mmap(NULL, rp->cq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+		      rp->fd, IORING_OFF_CQ_RING);
+    if (rp->cq_ptr == MAP_FAILED) {
+      rp->cq_ptr = NULL;
+      goto Fail;
+    }
+  }
+
+  rp->sqes_size = p.sq_entries*sizeof(struct io_uring_sqe);
+  rp->sqes = mmap(NULL, rp->sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+		  rp->fd, IORING_OFF_SQES);
+  if (rp->sqes == MAP_FAILED) {
+    rp->sqes = NULL;
+    goto Fail;
+  }
+
+  sp = (unsigned char *) rp->sq_ptr;
+  rp->sq_head  = (unsigned int *) (sp + p.sq_off.head);
+  rp->sq_tail  = (unsigned int *) (sp + p.sq_off.tail);
+  rp->sq_mask  = (unsigned int *) (sp + p.sq_off.ring_mask);
+  rp->sq_array = (unsigned int *) (sp + p.sq_off.array);
+  rp->sq_ltail = *rp->sq_tail;
+
+  cp = (unsigned char *) rp->cq_ptr;
+  rp->cq_head = (unsigned int *) (cp + p.cq_off.head);
+  rp->cq_tail = (unsigned int *) (cp + p.cq_off.tail);
+  rp->cq_mask = (unsigned int *) (cp + p.cq_off.ring_mask);
+  rp->cqes    = (struct io_uring_cqe *) (cp + p.cq_off.cqes);
+  
+  return 0;
+
+ Fail:
+  uring_destroy(rp);
+  return -1;
+}
+
+
+void
+uring_destroy(URING *rp) {
+  int saved_errno = errno;
+
+  if (rp->sqes)
+    munmap(rp->sqes, rp->sqes_size);
+  if (rp->cq_ptr && rp->cq_ptr != rp->sq_ptr)
+    munmap(rp->cq_ptr, rp->cq_size);
+  if (rp->sq_ptr)
+    munmap(rp->sq_ptr, rp->sq_size);
+  if (rp->fd >= 0)
+    close(rp->fd);
+
+  memset(rp, 0, sizeof(*rp));
+  rp->fd = -1;
+  errno = saved_errno;
+}
+
+
+int
+uring_register_buffers(URING *rp,
+		       const struct iovec *iov,
+		       unsigned int n) {
+  return syscall(__NR_io_uring_register, rp->fd, IORING_REGISTER_BUFFERS, iov, n);
+}
+
+
+/*
+ * Get a free submission queue entry (or NULL if the queue is full)
+ */
+struct io_uring_sqe *
+uring_get_sqe(URING *rp) {
+  unsigned int head, idx;
+  struct io_uring_sqe *sqe;
+
+
+  head = __atomic_load_n(rp->sq_head, __ATOMIC_ACQUIRE);
+  if (rp->sq_ltail - head >= rp->entries)
+    return NULL;
+
+  idx = rp->sq_ltail & *rp->sq_mask;
+  rp->sq_array[idx] = idx;
+  rp->sq_ltail++;
+
+  sqe = &rp->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+
+/*
+ * Submit queued entries and (optionally) wait for 'wait_nr' completions
+ */
+int
+uring_submit(URING *rp,
+	     unsigned int wait_nr) {
+  unsigned int n;
+  int rc;
+
+
+  n = rp->sq_ltail - *rp->sq_tail;
+  __atomic_store_n(rp->sq_tail, rp->sq_ltail, __ATOMIC_RELEASE);
+  
+  do {
+    rc = syscall(__NR_io_uring_enter, rp->fd, n, wait_nr,
+		 wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  } while (rc < 0 && errno == EINTR);
+
+  return rc;
+}
+
+
+/*
+ * Get the next completion queue entry (or NULL if none available)
+ */
+struct io_uring_cqe *
+uring_peek_cqe(URING *rp) {
+  unsigned int head, tail;
+
+  head = *rp->cq_head;
+  tail = __atomic_load_n(rp->cq_tail, __ATOMIC_ACQUIRE);
+  if (head == tail)
+    return NULL;
+
+  return &rp->cqes[head & *rp->cq_mask];
+}
+
+
+void
+uring_cqe_seen(URING *rp) {
+  __atomic_store_n(rp->cq_head, *rp->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+#endif
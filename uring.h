@@ -0,0 +1,103 @@
+/*
+ * uring.h - Minimal Linux io_uring interface
+ * 
+ * Copyright (c) 2021, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef URING_H
+#define URING_H 1
+
+#include "config.h"
+
+#if defined(HAVE_LINUX_IO_URING_H)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#if defined(__NR_io_uring_setup)
+#define HAVE_URING 1
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+
+typedef struct uring {
+  int fd;
+  unsigned int entries;
+  
+  /* Submission queue */
+  unsigned int *sq_head;
+  unsigned int *sq_tail;
+  unsigned int *sq_mask;
+  unsigned int *sq_array;
+  unsigned int sq_ltail;	/* Local (not yet submitted) tail */
+  struct io_uring_sqe *sqes;
+  
+  /* Completion queue */
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_ptr;
+  size_t sq_size;
+  void *cq_ptr;
+  size_t cq_size;
+  size_t sqes_size;
+} URING;
+
+
+extern int
+uring_init(URING *rp,
+	   unsigned int entries);
+
+extern void
+uring_destroy(URING *rp);
+
+extern int
+uring_register_buffers(URING *rp,
+		       const struct iovec *iov,
+		       unsigned int n);
+
+extern struct io_uring_sqe *
+uring_get_sqe(URING *rp);
+
+extern int
+uring_submit(URING *rp,
+	     unsigned int wait_nr);
+
+extern struct io_uring_cqe *
+uring_peek_cqe(URING *rp);
+
+extern void
+uring_cqe_seen(URING *rp);
+
+#endif
+#endif
+#endif